@@ -0,0 +1,1254 @@
+//
+// assets.cpp : Asset processing shared between the Engine and the offline tools. Nothing in here
+// should issue OpenGL commands, it only transforms files and memory.
+//
+
+#include "assets.h"
+#include <stb_image.h>
+#ifndef ASSETS_NO_IMPORT
+#include <assimp/Importer.hpp>
+#include <assimp/IOSystem.hpp>
+#include <assimp/IOStream.hpp>
+#include <assimp/scene.h>
+#endif
+#include <assimp/postprocess.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <float.h>
+#include <unordered_map>
+#include <algorithm>
+
+///////////////////////////////////////////////////////////////////////
+// Mipmaps
+
+u32 GetMipCount(i32 width, i32 height)
+{
+    u32 mipCount = 1;
+    while ((width > 1 || height > 1) && mipCount < COOKED_IMAGE_MAX_MIPS)
+    {
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+        mipCount++;
+    }
+    return mipCount;
+}
+
+u32 GetMipChainSize(i32 width, i32 height, i32 nchannels, u32 mipCount)
+{
+    u32 size = 0;
+    for (u32 i = 0; i < mipCount; ++i)
+    {
+        size += width * height * nchannels;
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+    }
+    return size;
+}
+
+void GenerateMipChain(u8* pixels, i32 width, i32 height, i32 nchannels, u32 mipCount)
+{
+    u8* src = pixels;
+    for (u32 level = 1; level < mipCount; ++level)
+    {
+        const i32 dstWidth = width > 1 ? width / 2 : 1;
+        const i32 dstHeight = height > 1 ? height / 2 : 1;
+        u8* dst = src + width * height * nchannels;
+
+        for (i32 y = 0; y < dstHeight; ++y)
+        {
+            const i32 y0 = glm::min(y * 2, height - 1);
+            const i32 y1 = glm::min(y * 2 + 1, height - 1);
+            for (i32 x = 0; x < dstWidth; ++x)
+            {
+                const i32 x0 = glm::min(x * 2, width - 1);
+                const i32 x1 = glm::min(x * 2 + 1, width - 1);
+                for (i32 c = 0; c < nchannels; ++c)
+                {
+                    const u32 sum = src[(y0 * width + x0) * nchannels + c] +
+                                    src[(y0 * width + x1) * nchannels + c] +
+                                    src[(y1 * width + x0) * nchannels + c] +
+                                    src[(y1 * width + x1) * nchannels + c];
+                    dst[(y * dstWidth + x) * nchannels + c] = (u8)((sum + 2) / 4);
+                }
+            }
+        }
+
+        src = dst;
+        width = dstWidth;
+        height = dstHeight;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////
+// Cooked images
+
+// Writes straight to the file, so that cooked assets are not copied into a staging buffer
+struct ByteWriter
+{
+    FILE* file;
+    bool  failed;
+};
+
+static void WriteBytes(ByteWriter& writer, const void* data, u64 size)
+{
+    if (!writer.failed && size > 0 && fwrite(data, 1, size, writer.file) != size)
+        writer.failed = true;
+}
+
+u8* DecodeImageFile(const char* filepath, i32* width, i32* height, i32* nchannels)
+{
+    MappedFile file = MapFile(filepath);
+    if (!file.data || file.size > INT32_MAX)
+    {
+        UnmapFile(file);
+        return NULL;
+    }
+
+    // Textures are RGB or RGBA, so grey and grey-alpha images are expanded to RGBA here
+    i32 fileChannels = 0;
+    stbi_info_from_memory((const u8*)file.data, (int)file.size, width, height, &fileChannels);
+    const i32 desiredChannels = fileChannels < 3 ? 4 : 0;
+
+    stbi_set_flip_vertically_on_load_thread(true);
+    u8* pixels = stbi_load_from_memory((const u8*)file.data, (int)file.size, width, height, nchannels, desiredChannels);
+    UnmapFile(file);
+    if (pixels && desiredChannels != 0)
+        *nchannels = desiredChannels;
+    return pixels;
+}
+
+bool DecodeImageMipChain(const char* filepath, Image* image)
+{
+    i32 width, height, nchannels;
+    u8* srcPixels = DecodeImageFile(filepath, &width, &height, &nchannels);
+    if (!srcPixels)
+    {
+        return false;
+    }
+
+    *image = {};
+    image->size = glm::ivec2(width, height);
+    image->nchannels = nchannels;
+    image->stride = width * nchannels;
+    image->mipCount = GetMipCount(width, height);
+    image->pixels = malloc(GetMipChainSize(width, height, nchannels, image->mipCount));
+    image->ownsMallocPixels = true;
+    memcpy(image->pixels, srcPixels, width * height * nchannels);
+    stbi_image_free(srcPixels);
+
+    GenerateMipChain((u8*)image->pixels, width, height, nchannels, image->mipCount);
+    return true;
+}
+
+bool CookImage(const char* srcPath, const char* dstPath)
+{
+    Image image = {};
+    if (!DecodeImageMipChain(srcPath, &image))
+    {
+        ELOG("CookImage() - Could not open file %s", srcPath);
+        return false;
+    }
+
+    bool success = WriteCookedImage(dstPath, image);
+    free(image.pixels);
+    return success;
+}
+
+bool WriteCookedImage(const char* dstPath, const Image& image)
+{
+    CookedImageHeader header = {};
+    header.magic = COOKED_IMAGE_MAGIC;
+    header.version = COOKED_IMAGE_VERSION;
+    header.width = image.size.x;
+    header.height = image.size.y;
+    header.nchannels = image.nchannels;
+    header.mipCount = image.mipCount;
+
+    const u32 rawSize = GetMipChainSize(image.size.x, image.size.y, image.nchannels, image.mipCount);
+    u8* payload = (u8*)malloc(LZ4CompressBound(rawSize));
+    u32 payloadSize = 0;
+
+    const u8* level = (const u8*)image.pixels;
+    i32 width = image.size.x;
+    i32 height = image.size.y;
+    for (u32 i = 0; i < image.mipCount; ++i)
+    {
+        const u32 levelSize = width * height * image.nchannels;
+        u8* dst = payload + payloadSize;
+
+        // Tiny or incompressible levels are stored raw
+        u32 compressedSize = LZ4Compress(level, levelSize, dst, LZ4CompressBound(levelSize));
+        if (compressedSize == 0 || compressedSize >= levelSize)
+        {
+            memcpy(dst, level, levelSize);
+            compressedSize = levelSize;
+        }
+
+        header.mips[i].offset = sizeof(header) + payloadSize;
+        header.mips[i].compressedSize = compressedSize;
+        header.mips[i].rawSize = levelSize;
+        payloadSize += compressedSize;
+
+        level += levelSize;
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+    }
+
+    FILE* file = fopen(dstPath, "wb");
+    if (!file)
+    {
+        ELOG("fopen() failed writing file %s", dstPath);
+        free(payload);
+        return false;
+    }
+
+    ByteWriter writer = { file, false };
+    WriteBytes(writer, &header, sizeof(header));
+    WriteBytes(writer, payload, payloadSize);
+    if (fclose(file) != 0)
+        writer.failed = true;
+
+    free(payload);
+
+    if (writer.failed)
+    {
+        ELOG("WriteCookedImage() - Failed writing file %s", dstPath);
+        remove(dstPath);
+        return false;
+    }
+    return true;
+}
+
+bool LoadCookedImage(const char* path, Image* image)
+{
+    MappedFile file = MapFile(path);
+    if (!file.data)
+        return false;
+
+    CookedImageHeader header = {};
+    if (file.size < sizeof(header))
+    {
+        ELOG("LoadCookedImage() - Invalid cooked image %s", path);
+        UnmapFile(file);
+        return false;
+    }
+    memcpy(&header, file.data, sizeof(header));
+
+    // Stale or corrupt entries are rejected, and LoadImage cooks them again. The size limit keeps
+    // the whole chain, at most 4/3 of the first level, within the u32 sizes of the format.
+    if (header.magic != COOKED_IMAGE_MAGIC ||
+        header.version != COOKED_IMAGE_VERSION ||
+        header.width <= 0 || header.height <= 0 ||
+        (header.nchannels != 3 && header.nchannels != 4) ||
+        (u64)header.width * header.height * header.nchannels > UINT32_MAX / 2 ||
+        header.mipCount != GetMipCount(header.width, header.height))
+    {
+        ELOG("LoadCookedImage() - Invalid cooked image %s", path);
+        UnmapFile(file);
+        return false;
+    }
+
+    const u32 rawSize = GetMipChainSize(header.width, header.height, header.nchannels, header.mipCount);
+    u8* pixels = (u8*)malloc(rawSize + LZ4_DECODE_SLACK);
+
+    // Levels are decoded in order, so the slack written past one level is overwritten by the next
+    bool success = true;
+    u8* dst = pixels;
+    i32 width = header.width;
+    i32 height = header.height;
+    for (u32 i = 0; i < header.mipCount && success; ++i)
+    {
+        const CookedImageMip& mip = header.mips[i];
+        const u8* src = (const u8*)file.data + mip.offset;
+        if ((u64)mip.offset + mip.compressedSize > file.size ||
+            mip.rawSize != (u32)(width * height * header.nchannels))
+        {
+            success = false;
+        }
+        else if (mip.compressedSize == mip.rawSize)
+        {
+            memcpy(dst, src, mip.rawSize);
+        }
+        else
+        {
+            success = LZ4Decompress(src, mip.compressedSize, dst, mip.rawSize);
+        }
+        dst += mip.rawSize;
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+    }
+
+    UnmapFile(file);
+
+    if (!success)
+    {
+        ELOG("LoadCookedImage() - Corrupted cooked image %s", path);
+        free(pixels);
+        return false;
+    }
+
+    image->pixels = pixels;
+    image->size = glm::ivec2(header.width, header.height);
+    image->nchannels = header.nchannels;
+    image->stride = header.width * header.nchannels;
+    image->mipCount = header.mipCount;
+    image->ownsMallocPixels = true;
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Model import
+
+#define MODEL_IMPORT_FLAGS (aiProcess_Triangulate |           \
+                            aiProcess_GenSmoothNormals |      \
+                            aiProcess_CalcTangentSpace |      \
+                            aiProcess_JoinIdenticalVertices | \
+                            aiProcess_PreTransformVertices |  \
+                            aiProcess_ImproveCacheLocality |  \
+                            aiProcess_OptimizeMeshes |        \
+                            aiProcess_SortByPType)
+
+static std::string GetDirectory(const std::string& path)
+{
+    const size_t separator = path.find_last_of("/\\");
+    return separator == std::string::npos ? std::string(".") : path.substr(0, separator);
+}
+
+#ifndef ASSETS_NO_IMPORT
+
+// Lets Assimp read models and the files they reference (e.g. .mtl) through MapFile,
+// so they can come from a mounted pak.
+class MappedIOStream : public Assimp::IOStream
+{
+public:
+    explicit MappedIOStream(const MappedFile& file) : file(file), position(0) {}
+    ~MappedIOStream() override { UnmapFile(file); }
+
+    size_t Read(void* buffer, size_t size, size_t count) override
+    {
+        if (size == 0)
+            return 0;
+        count = glm::min(count, (size_t)(file.size - position) / size);
+        memcpy(buffer, (const u8*)file.data + position, size * count);
+        position += size * count;
+        return count;
+    }
+
+    size_t Write(const void* buffer, size_t size, size_t count) override { return 0; }
+
+    aiReturn Seek(size_t offset, aiOrigin origin) override
+    {
+        size_t newPosition;
+        switch (origin)
+        {
+            case aiOrigin_SET: newPosition = offset; break;
+            case aiOrigin_CUR: newPosition = position + offset; break;
+            case aiOrigin_END: newPosition = file.size - offset; break;
+            default: return aiReturn_FAILURE;
+        }
+        if (newPosition > file.size)
+            return aiReturn_FAILURE;
+        position = newPosition;
+        return aiReturn_SUCCESS;
+    }
+
+    size_t Tell() const override { return position; }
+    size_t FileSize() const override { return file.size; }
+    void Flush() override {}
+
+private:
+    MappedFile file;
+    size_t     position;
+};
+
+class MappedIOSystem : public Assimp::IOSystem
+{
+public:
+    bool Exists(const char* filepath) const override { return FileExists(filepath); }
+    char getOsSeparator() const override { return '/'; }
+
+    Assimp::IOStream* Open(const char* filepath, const char* mode) override
+    {
+        if (strchr(mode, 'w') || strchr(mode, 'a'))
+            return NULL;
+
+        MappedFile file = MapFile(filepath);
+        return file.data ? new MappedIOStream(file) : NULL;
+    }
+
+    void Close(Assimp::IOStream* stream) override { delete stream; }
+};
+
+static void ProcessAssimpMesh(const aiScene* scene, aiMesh* mesh, CookedModel* model)
+{
+    std::vector<float> vertices;
+    std::vector<u32> indices;
+
+    bool hasTexCoords = false;
+    bool hasTangentSpace = false;
+
+    // Sized up front, growing by push_back alone would reallocate and leave up to twice the needed capacity
+    const u32 floatsPerVertex = 6 + (mesh->mTextureCoords[0] ? 2 : 0) + (mesh->mTangents && mesh->mBitangents ? 6 : 0);
+    vertices.reserve((size_t)mesh->mNumVertices * floatsPerVertex);
+    indices.reserve((size_t)mesh->mNumFaces * 3);
+
+    // process vertices
+    for (unsigned int i = 0; i < mesh->mNumVertices; i++)
+    {
+        vertices.push_back(mesh->mVertices[i].x);
+        vertices.push_back(mesh->mVertices[i].y);
+        vertices.push_back(mesh->mVertices[i].z);
+        vertices.push_back(mesh->mNormals[i].x);
+        vertices.push_back(mesh->mNormals[i].y);
+        vertices.push_back(mesh->mNormals[i].z);
+
+        if (mesh->mTextureCoords[0]) // does the mesh contain texture coordinates?
+        {
+            hasTexCoords = true;
+            vertices.push_back(mesh->mTextureCoords[0][i].x);
+            vertices.push_back(mesh->mTextureCoords[0][i].y);
+        }
+
+        if (mesh->mTangents != nullptr && mesh->mBitangents)
+        {
+            hasTangentSpace = true;
+            vertices.push_back(mesh->mTangents[i].x);
+            vertices.push_back(mesh->mTangents[i].y);
+            vertices.push_back(mesh->mTangents[i].z);
+
+            // For some reason ASSIMP gives me the bitangents flipped.
+            // Maybe it's my fault, but when I generate my own geometry
+            // in other files (see the generation of standard assets)
+            // and all the bitangents have the orientation I expect,
+            // everything works ok.
+            // I think that (even if the documentation says the opposite)
+            // it returns a left-handed tangent space matrix.
+            // SOLUTION: I invert the components of the bitangent here.
+            vertices.push_back(-mesh->mBitangents[i].x);
+            vertices.push_back(-mesh->mBitangents[i].y);
+            vertices.push_back(-mesh->mBitangents[i].z);
+        }
+    }
+
+    // process indices
+    for (unsigned int i = 0; i < mesh->mNumFaces; i++)
+    {
+        const aiFace& face = mesh->mFaces[i];
+        for (unsigned int j = 0; j < face.mNumIndices; j++)
+        {
+            indices.push_back(face.mIndices[j]);
+        }
+    }
+
+    // create the vertex format
+    VertexBufferLayout vertexBufferLayout = {};
+    vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 0, 3, 0 });
+    vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 1, 3, 3 * sizeof(float) });
+    vertexBufferLayout.stride = 6 * sizeof(float);
+    if (hasTexCoords)
+    {
+        vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 2, 2, vertexBufferLayout.stride });
+        vertexBufferLayout.stride += 2 * sizeof(float);
+    }
+    if (hasTangentSpace)
+    {
+        vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 3, 3, vertexBufferLayout.stride });
+        vertexBufferLayout.stride += 3 * sizeof(float);
+
+        vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 4, 3, vertexBufferLayout.stride });
+        vertexBufferLayout.stride += 3 * sizeof(float);
+    }
+
+    // add the submesh into the model
+    model->submeshes.push_back(CookedSubmesh{});
+    CookedSubmesh& submesh = model->submeshes.back();
+    submesh.vertexBufferLayout = vertexBufferLayout;
+    submesh.vertices.swap(vertices);
+    submesh.indices.swap(indices);
+    submesh.materialIdx = mesh->mMaterialIndex;
+    ComputeSubmeshBounds(submesh);
+}
+
+static void ProcessAssimpMaterial(aiMaterial* material, CookedMaterial& myMaterial, const std::string& directory)
+{
+    aiString name;
+    aiColor3D diffuseColor;
+    aiColor3D emissiveColor;
+    aiColor3D specularColor;
+    ai_real shininess = 0.0f;
+    material->Get(AI_MATKEY_NAME, name);
+    material->Get(AI_MATKEY_COLOR_DIFFUSE, diffuseColor);
+    material->Get(AI_MATKEY_COLOR_EMISSIVE, emissiveColor);
+    material->Get(AI_MATKEY_COLOR_SPECULAR, specularColor);
+    material->Get(AI_MATKEY_SHININESS, shininess);
+
+    myMaterial.name = name.C_Str();
+    myMaterial.albedo = glm::vec3(diffuseColor.r, diffuseColor.g, diffuseColor.b);
+    myMaterial.emissive = glm::vec3(emissiveColor.r, emissiveColor.g, emissiveColor.b);
+    myMaterial.smoothness = shininess / 256.0f;
+
+    const aiTextureType textureTypes[MATERIAL_TEXTURE_SLOT_COUNT] = {
+        aiTextureType_DIFFUSE,
+        aiTextureType_EMISSIVE,
+        aiTextureType_SPECULAR,
+        aiTextureType_NORMALS,
+        aiTextureType_HEIGHT
+    };
+
+    for (u32 slot = 0; slot < MATERIAL_TEXTURE_SLOT_COUNT; ++slot)
+    {
+        aiString aiFilename;
+        if (material->GetTextureCount(textureTypes[slot]) > 0)
+        {
+            material->GetTexture(textureTypes[slot], 0, &aiFilename);
+            myMaterial.texturePaths[slot] = directory + "/" + aiFilename.C_Str();
+        }
+    }
+
+    //myMaterial.createNormalFromBump();
+}
+
+static void ProcessAssimpNode(const aiScene* scene, aiNode* node, CookedModel* model)
+{
+    // process all the node's meshes (if any)
+    for (unsigned int i = 0; i < node->mNumMeshes; i++)
+    {
+        aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
+        ProcessAssimpMesh(scene, mesh, model);
+    }
+
+    // then do the same for each of its children
+    for (unsigned int i = 0; i < node->mNumChildren; i++)
+    {
+        ProcessAssimpNode(scene, node->mChildren[i], model);
+    }
+}
+
+bool ImportModel(const char* filepath, CookedModel* model)
+{
+    // Each call has its own importer so that models can be imported in parallel
+    Assimp::Importer importer;
+    importer.SetIOHandler(new MappedIOSystem); // Owned by the importer
+    const aiScene* scene = importer.ReadFile(filepath, MODEL_IMPORT_FLAGS);
+
+    if (!scene)
+    {
+        ELOG("Error loading mesh %s: %s", filepath, importer.GetErrorString());
+        return false;
+    }
+
+    const std::string directory = GetDirectory(filepath);
+
+    model->materials.resize(scene->mNumMaterials);
+    for (unsigned int i = 0; i < scene->mNumMaterials; ++i)
+    {
+        ProcessAssimpMaterial(scene->mMaterials[i], model->materials[i], directory);
+    }
+
+    // The scene is released by the importer as soon as this returns. Its meshes are not freed
+    // one by one as they are converted because the same assimp.lib is linked by the Debug and
+    // Release builds, so deleting them from here would free them on the wrong CRT heap.
+    model->submeshes.reserve(scene->mNumMeshes);
+    ProcessAssimpNode(scene, scene->mRootNode, model);
+    GenerateOccluder(*model);
+
+    return true;
+}
+
+#else
+
+bool ImportModel(const char* filepath, CookedModel* model)
+{
+    ELOG("Error loading mesh %s: importers are not available in this build, cook it with the Cooker", filepath);
+    return false;
+}
+
+#endif // !ASSETS_NO_IMPORT
+
+void ComputeSubmeshBounds(CookedSubmesh& submesh)
+{
+    const u32 floatStride = submesh.vertexBufferLayout.stride / sizeof(float);
+    if (submesh.vertices.empty() || floatStride < 3)
+    {
+        submesh.boundsMin = submesh.boundsMax = glm::vec3(0.0f);
+        submesh.boundingSphere = glm::vec4(0.0f);
+        return;
+    }
+
+    submesh.boundsMin = glm::vec3(FLT_MAX);
+    submesh.boundsMax = glm::vec3(-FLT_MAX);
+    for (u32 i = 0; i + 2 < submesh.vertices.size(); i += floatStride)
+    {
+        const glm::vec3 position(submesh.vertices[i], submesh.vertices[i + 1], submesh.vertices[i + 2]);
+        submesh.boundsMin = glm::min(submesh.boundsMin, position);
+        submesh.boundsMax = glm::max(submesh.boundsMax, position);
+    }
+
+    // Farthest vertex from the center, tighter than half the diagonal of the box
+    const glm::vec3 center = (submesh.boundsMin + submesh.boundsMax) * 0.5f;
+    f32 radiusSquared = 0.0f;
+    for (u32 i = 0; i + 2 < submesh.vertices.size(); i += floatStride)
+    {
+        const glm::vec3 offset = glm::vec3(submesh.vertices[i], submesh.vertices[i + 1], submesh.vertices[i + 2]) - center;
+        radiusSquared = glm::max(radiusSquared, glm::dot(offset, offset));
+    }
+    submesh.boundingSphere = glm::vec4(center, sqrtf(radiusSquared));
+}
+
+// Corners of a box are indexed by bits: 1 is +X, 2 is +Y, 4 is +Z
+static const u32 BoxTriangleIndices[36] =
+{
+    0, 4, 6,  0, 6, 2, // -X
+    1, 3, 7,  1, 7, 5, // +X
+    0, 1, 5,  0, 5, 4, // -Y
+    2, 6, 7,  2, 7, 3, // +Y
+    0, 2, 3,  0, 3, 1, // -Z
+    4, 5, 7,  4, 7, 6, // +Z
+};
+
+struct OccluderBox
+{
+    glm::ivec3 first;  // Voxels, both ends included
+    glm::ivec3 last;
+    u32        volume; // Voxels it covers
+};
+
+void GenerateOccluder(CookedModel& model)
+{
+    model.occluderVertices.clear();
+    model.occluderIndices.clear();
+
+    // Positions of all the triangles
+    std::vector<glm::vec3> triangles;
+    glm::vec3 boundsMin(FLT_MAX), boundsMax(-FLT_MAX);
+    for (const CookedSubmesh& submesh : model.submeshes)
+    {
+        const u32 floatStride = submesh.vertexBufferLayout.stride / sizeof(float);
+        if (floatStride < 3) continue;
+        for (u32 index : submesh.indices)
+        {
+            const float* position = &submesh.vertices[index * floatStride];
+            triangles.push_back(glm::vec3(position[0], position[1], position[2]));
+        }
+        boundsMin = glm::min(boundsMin, submesh.boundsMin);
+        boundsMax = glm::max(boundsMax, submesh.boundsMax);
+    }
+
+    const glm::vec3 extent = boundsMax - boundsMin;
+    const f32 voxelSize = glm::max(extent.x, glm::max(extent.y, extent.z)) / OCCLUDER_GRID_SIZE;
+    if (triangles.empty() || !(voxelSize > 0.0f))
+        return;
+
+    glm::ivec3 gridSize;
+    for (u32 axis = 0; axis < 3; ++axis)
+        gridSize[axis] = glm::clamp((i32)ceilf(extent[axis] / voxelSize), 1, OCCLUDER_GRID_SIZE);
+    const u32 voxelCount = gridSize.x * gridSize.y * gridSize.z;
+
+    // The grid is centered on the bounds, so a wall or a floor thinner than a voxel still has the
+    // centers of its voxels inside
+    const glm::vec3 gridMin = (boundsMin + boundsMax - glm::vec3(gridSize) * voxelSize) * 0.5f;
+
+    // Columns are traced a little off the centers of the voxels, and by a different amount along
+    // each side, so that they do not run along the diagonals that split the quads of the surface.
+    // The two triangles would be crossed at the same point, and the pair would cancel itself out.
+    const glm::vec2 columnOffset(0.5f + 1e-3f, 0.5f + 2e-3f);
+
+    // A voxel is solid if its center is inside the surface along the three axes: a line through
+    // the centers of each column is intersected with the triangles, and the voxels between the
+    // first and second crossing, third and fourth, and so on are inside. Requiring the three axes
+    // to agree keeps holes in the surface from filling whole columns.
+    std::vector<u8> insideAxes(voxelCount, 0);
+    std::vector<std::vector<f32>> crossings;
+    for (u32 axis = 0; axis < 3; ++axis)
+    {
+        const u32 u = (axis + 1) % 3;
+        const u32 v = (axis + 2) % 3;
+        crossings.assign(gridSize[u] * gridSize[v], std::vector<f32>());
+
+        for (u32 i = 0; i + 2 < triangles.size(); i += 3)
+        {
+            const glm::vec3& a = triangles[i];
+            const glm::vec3& b = triangles[i + 1];
+            const glm::vec3& c = triangles[i + 2];
+            const glm::vec2 ab(b[u] - a[u], b[v] - a[v]);
+            const glm::vec2 ac(c[u] - a[u], c[v] - a[v]);
+            const f32 det = ab.x * ac.y - ab.y * ac.x;
+            if (det == 0.0f) continue; // Parallel to the axis
+
+            // Columns whose centers fall within the projection of the triangle
+            const f32 minU = glm::min(a[u], glm::min(b[u], c[u])), maxU = glm::max(a[u], glm::max(b[u], c[u]));
+            const f32 minV = glm::min(a[v], glm::min(b[v], c[v])), maxV = glm::max(a[v], glm::max(b[v], c[v]));
+            const i32 firstU = glm::max((i32)ceilf((minU - gridMin[u]) / voxelSize - columnOffset.x), 0);
+            const i32 lastU = glm::min((i32)floorf((maxU - gridMin[u]) / voxelSize - columnOffset.x), gridSize[u] - 1);
+            const i32 firstV = glm::max((i32)ceilf((minV - gridMin[v]) / voxelSize - columnOffset.y), 0);
+            const i32 lastV = glm::min((i32)floorf((maxV - gridMin[v]) / voxelSize - columnOffset.y), gridSize[v] - 1);
+
+            for (i32 iv = firstV; iv <= lastV; ++iv)
+            {
+                for (i32 iu = firstU; iu <= lastU; ++iu)
+                {
+                    const glm::vec2 ap(gridMin[u] + (iu + columnOffset.x) * voxelSize - a[u],
+                                       gridMin[v] + (iv + columnOffset.y) * voxelSize - a[v]);
+                    const f32 s = (ap.x * ac.y - ap.y * ac.x) / det;
+                    const f32 t = (ab.x * ap.y - ab.y * ap.x) / det;
+                    if (s < 0.0f || t < 0.0f || s + t > 1.0f) continue;
+
+                    crossings[iv * gridSize[u] + iu].push_back(a[axis] + s * (b[axis] - a[axis]) + t * (c[axis] - a[axis]));
+                }
+            }
+        }
+
+        for (i32 iv = 0; iv < gridSize[v]; ++iv)
+        {
+            for (i32 iu = 0; iu < gridSize[u]; ++iu)
+            {
+                std::vector<f32>& column = crossings[iv * gridSize[u] + iu];
+                std::sort(column.begin(), column.end());
+                for (u32 k = 0; k + 1 < column.size(); k += 2)
+                {
+                    const i32 first = glm::max((i32)ceilf((column[k] - gridMin[axis]) / voxelSize - 0.5f), 0);
+                    const i32 last = glm::min((i32)floorf((column[k + 1] - gridMin[axis]) / voxelSize - 0.5f), gridSize[axis] - 1);
+                    for (i32 i = first; i <= last; ++i)
+                    {
+                        glm::ivec3 voxel;
+                        voxel[axis] = i;
+                        voxel[u] = iu;
+                        voxel[v] = iv;
+                        insideAxes[(voxel.z * gridSize.y + voxel.y) * gridSize.x + voxel.x]++;
+                    }
+                }
+            }
+        }
+    }
+
+    // Boxes are taken one at a time, the largest that grows from any of the free solid voxels. They
+    // grow by one voxel along each axis in turn, which keeps them close to cubes, and they are scored
+    // by the voxels they cover, so walls and floors one voxel thick compete with the rest
+    std::vector<u8> isTaken(voxelCount, 0);
+    auto isFree = [&](const glm::ivec3& first, const glm::ivec3& last)
+    {
+        for (i32 z = first.z; z <= last.z; ++z)
+            for (i32 y = first.y; y <= last.y; ++y)
+                for (i32 x = first.x; x <= last.x; ++x)
+                {
+                    const u32 idx = (z * gridSize.y + y) * gridSize.x + x;
+                    if (insideAxes[idx] != 3 || isTaken[idx]) return false;
+                }
+        return true;
+    };
+
+    const u32 minVolume = (u32)(OCCLUDER_MIN_VOLUME_FRACTION * gridSize.x * gridSize.y * gridSize.z);
+    for (u32 boxCount = 0; boxCount < OCCLUDER_MAX_BOXES; ++boxCount)
+    {
+        OccluderBox best = {};
+        for (i32 z = 0; z < gridSize.z; ++z)
+        {
+            for (i32 y = 0; y < gridSize.y; ++y)
+            {
+                for (i32 x = 0; x < gridSize.x; ++x)
+                {
+                    OccluderBox box;
+                    box.first = box.last = glm::ivec3(x, y, z);
+                    if (!isFree(box.first, box.last)) continue;
+
+                    bool canGrow[3] = { true, true, true };
+                    while (canGrow[0] || canGrow[1] || canGrow[2])
+                    {
+                        for (u32 axis = 0; axis < 3; ++axis)
+                        {
+                            if (!canGrow[axis]) continue;
+                            glm::ivec3 slabFirst = box.first, slabLast = box.last;
+                            slabFirst[axis] = slabLast[axis] = box.last[axis] + 1;
+                            if (slabLast[axis] < gridSize[axis] && isFree(slabFirst, slabLast))
+                                box.last[axis]++;
+                            else
+                                canGrow[axis] = false;
+                        }
+                    }
+
+                    const glm::ivec3 size = box.last - box.first + 1;
+                    box.volume = size.x * size.y * size.z;
+                    if (box.volume > best.volume)
+                        best = box;
+                }
+            }
+        }
+
+        if (best.volume == 0 || best.volume < minVolume)
+            break;
+
+        for (i32 z = best.first.z; z <= best.last.z; ++z)
+            for (i32 y = best.first.y; y <= best.last.y; ++y)
+                for (i32 x = best.first.x; x <= best.last.x; ++x)
+                    isTaken[(z * gridSize.y + y) * gridSize.x + x] = 1;
+
+        // From the center of the first voxel to the center of the last one. A box one voxel thick
+        // along an axis is flat once shrunk, so only its two faces across that axis are kept, which
+        // face opposite ways and make a quad seen from both sides. Thinner than that it is a line.
+        bool isFlat[3];
+        u32 flatAxisCount = 0;
+        for (u32 axis = 0; axis < 3; ++axis)
+        {
+            isFlat[axis] = best.first[axis] == best.last[axis];
+            flatAxisCount += isFlat[axis];
+        }
+        if (flatAxisCount > 1)
+            continue;
+
+        const glm::vec3 corners[2] = { gridMin + (glm::vec3(best.first) + 0.5f) * voxelSize,
+                                       gridMin + (glm::vec3(best.last) + 0.5f) * voxelSize };
+        const u32 baseVertex = (u32)model.occluderVertices.size();
+        for (u32 corner = 0; corner < 8; ++corner)
+            model.occluderVertices.push_back(glm::vec3(corners[corner & 1].x, corners[(corner >> 1) & 1].y, corners[(corner >> 2) & 1].z));
+        for (u32 axis = 0; axis < 3; ++axis)
+        {
+            // The faces across an axis are degenerate if one of the other two is flat
+            if (isFlat[(axis + 1) % 3] || isFlat[(axis + 2) % 3]) continue;
+            for (u32 i = 0; i < 12; ++i)
+                model.occluderIndices.push_back(baseVertex + BoxTriangleIndices[axis * 12 + i]);
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////
+// Cooked models
+
+static void WriteU32(ByteWriter& writer, u32 value)
+{
+    WriteBytes(writer, &value, sizeof(value));
+}
+
+static void WriteString(ByteWriter& writer, const std::string& str)
+{
+    WriteU32(writer, (u32)str.size());
+    WriteBytes(writer, str.data(), str.size());
+}
+
+struct ByteReader
+{
+    const u8* ptr;
+    const u8* end;
+    bool      failed;
+};
+
+static bool ReadBytes(ByteReader& reader, void* dst, u64 size)
+{
+    if (reader.failed || (u64)(reader.end - reader.ptr) < size)
+    {
+        reader.failed = true;
+        return false;
+    }
+    memcpy(dst, reader.ptr, size);
+    reader.ptr += size;
+    return true;
+}
+
+static u32 ReadU32(ByteReader& reader)
+{
+    u32 value = 0;
+    ReadBytes(reader, &value, sizeof(value));
+    return value;
+}
+
+static std::string ReadString(ByteReader& reader)
+{
+    const u32 len = ReadU32(reader);
+    if (reader.failed || (u64)(reader.end - reader.ptr) < len)
+    {
+        reader.failed = true;
+        return std::string();
+    }
+    std::string str((const char*)reader.ptr, len);
+    reader.ptr += len;
+    return str;
+}
+
+bool WriteCookedModel(const char* dstPath, const CookedModel& model)
+{
+    FILE* file = fopen(dstPath, "wb");
+    if (!file)
+    {
+        ELOG("fopen() failed writing file %s", dstPath);
+        return false;
+    }
+
+    ByteWriter writer = { file, false };
+    WriteU32(writer, COOKED_MODEL_MAGIC);
+    WriteU32(writer, COOKED_MODEL_VERSION);
+    WriteU32(writer, (u32)model.materials.size());
+    WriteU32(writer, (u32)model.submeshes.size());
+
+    for (const CookedMaterial& material : model.materials)
+    {
+        WriteString(writer, material.name);
+        WriteBytes(writer, &material.albedo, sizeof(material.albedo));
+        WriteBytes(writer, &material.emissive, sizeof(material.emissive));
+        WriteBytes(writer, &material.smoothness, sizeof(material.smoothness));
+        for (u32 slot = 0; slot < MATERIAL_TEXTURE_SLOT_COUNT; ++slot)
+            WriteString(writer, material.texturePaths[slot]);
+    }
+
+    for (const CookedSubmesh& submesh : model.submeshes)
+    {
+        WriteU32(writer, submesh.materialIdx);
+        WriteBytes(writer, &submesh.boundsMin, sizeof(submesh.boundsMin));
+        WriteBytes(writer, &submesh.boundsMax, sizeof(submesh.boundsMax));
+        WriteBytes(writer, &submesh.boundingSphere, sizeof(submesh.boundingSphere));
+        WriteU32(writer, submesh.vertexBufferLayout.stride);
+        WriteU32(writer, (u32)submesh.vertexBufferLayout.attributes.size());
+        WriteBytes(writer, submesh.vertexBufferLayout.attributes.data(),
+                   submesh.vertexBufferLayout.attributes.size() * sizeof(VertexBufferAttribute));
+        WriteU32(writer, (u32)submesh.vertices.size());
+        WriteU32(writer, (u32)submesh.indices.size());
+        WriteBytes(writer, submesh.vertices.data(), submesh.vertices.size() * sizeof(float));
+        WriteBytes(writer, submesh.indices.data(), submesh.indices.size() * sizeof(u32));
+    }
+
+    WriteU32(writer, (u32)model.occluderVertices.size());
+    WriteU32(writer, (u32)model.occluderIndices.size());
+    WriteBytes(writer, model.occluderVertices.data(), model.occluderVertices.size() * sizeof(glm::vec3));
+    WriteBytes(writer, model.occluderIndices.data(), model.occluderIndices.size() * sizeof(u32));
+
+    if (fclose(file) != 0)
+        writer.failed = true;
+
+    // A truncated entry would be rejected when loading, but it is better not to leave it in the cache
+    if (writer.failed)
+    {
+        ELOG("WriteCookedModel() - Failed writing file %s", dstPath);
+        remove(dstPath);
+        return false;
+    }
+    return true;
+}
+
+bool LoadCookedModel(const char* path, CookedModel* model)
+{
+    MappedFile file = MapFile(path);
+    if (!file.data)
+        return false;
+
+    ByteReader reader = { (const u8*)file.data, (const u8*)file.data + file.size, false };
+
+    const u32 magic = ReadU32(reader);
+    const u32 version = ReadU32(reader);
+    if (magic != COOKED_MODEL_MAGIC || version != COOKED_MODEL_VERSION)
+    {
+        ELOG("LoadCookedModel() - Invalid cooked model %s", path);
+        UnmapFile(file);
+        return false;
+    }
+
+    const u32 materialCount = ReadU32(reader);
+    const u32 submeshCount = ReadU32(reader);
+
+    model->materials.resize(reader.failed ? 0 : materialCount);
+    for (u32 i = 0; i < materialCount && !reader.failed; ++i)
+    {
+        CookedMaterial& material = model->materials[i];
+        material.name = ReadString(reader);
+        ReadBytes(reader, &material.albedo, sizeof(material.albedo));
+        ReadBytes(reader, &material.emissive, sizeof(material.emissive));
+        ReadBytes(reader, &material.smoothness, sizeof(material.smoothness));
+        for (u32 slot = 0; slot < MATERIAL_TEXTURE_SLOT_COUNT; ++slot)
+            material.texturePaths[slot] = ReadString(reader);
+    }
+
+    model->submeshes.resize(reader.failed ? 0 : submeshCount);
+    for (u32 i = 0; i < submeshCount && !reader.failed; ++i)
+    {
+        CookedSubmesh& submesh = model->submeshes[i];
+        submesh.materialIdx = ReadU32(reader);
+        ReadBytes(reader, &submesh.boundsMin, sizeof(submesh.boundsMin));
+        ReadBytes(reader, &submesh.boundsMax, sizeof(submesh.boundsMax));
+        ReadBytes(reader, &submesh.boundingSphere, sizeof(submesh.boundingSphere));
+        submesh.vertexBufferLayout.stride = (u8)ReadU32(reader);
+
+        const u32 attributeCount = ReadU32(reader);
+        if (attributeCount > 16) reader.failed = true;
+        submesh.vertexBufferLayout.attributes.resize(reader.failed ? 0 : attributeCount);
+        ReadBytes(reader, submesh.vertexBufferLayout.attributes.data(), attributeCount * sizeof(VertexBufferAttribute));
+
+        const u32 vertexCount = ReadU32(reader);
+        const u32 indexCount = ReadU32(reader);
+        if ((u64)vertexCount * sizeof(float) + (u64)indexCount * sizeof(u32) > (u64)(reader.end - reader.ptr))
+            reader.failed = true;
+        if (reader.failed) break;
+
+        submesh.vertices.resize(vertexCount);
+        submesh.indices.resize(indexCount);
+        ReadBytes(reader, submesh.vertices.data(), vertexCount * sizeof(float));
+        ReadBytes(reader, submesh.indices.data(), indexCount * sizeof(u32));
+
+        if (submesh.materialIdx >= materialCount) reader.failed = true;
+    }
+
+    const u32 occluderVertexCount = ReadU32(reader);
+    const u32 occluderIndexCount = ReadU32(reader);
+    if ((u64)occluderVertexCount * sizeof(glm::vec3) + (u64)occluderIndexCount * sizeof(u32) > (u64)(reader.end - reader.ptr))
+        reader.failed = true;
+    if (!reader.failed)
+    {
+        model->occluderVertices.resize(occluderVertexCount);
+        model->occluderIndices.resize(occluderIndexCount);
+        ReadBytes(reader, model->occluderVertices.data(), occluderVertexCount * sizeof(glm::vec3));
+        ReadBytes(reader, model->occluderIndices.data(), occluderIndexCount * sizeof(u32));
+        for (u32 index : model->occluderIndices)
+            if (index >= occluderVertexCount) reader.failed = true;
+    }
+
+    UnmapFile(file);
+
+    if (reader.failed)
+    {
+        ELOG("LoadCookedModel() - Corrupted cooked model %s", path);
+        *model = CookedModel{};
+        return false;
+    }
+
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Import cache
+
+static bool HashFile(const char* filepath, u64 seed, u64* hash)
+{
+    MappedFile file = MapFile(filepath);
+    if (!file.data)
+        return false;
+
+    *hash = HashBytes(file.data, file.size, seed);
+    UnmapFile(file);
+    return true;
+}
+
+static void MakeCachePath(u64 key, const char* extension, char* cachePath, u32 cachePathSize)
+{
+    snprintf(cachePath, cachePathSize, "%s/%016llx%s", ASSET_CACHE_DIRECTORY, (unsigned long long)key, extension);
+}
+
+static std::unordered_map<std::string, std::string> LoadCacheManifest()
+{
+    std::unordered_map<std::string, std::string> manifest;
+
+    // Mapped so that the manifest can also come from a pak
+    MappedFile file = MapFile(ASSET_CACHE_MANIFEST);
+    if (!file.data)
+        return manifest;
+
+    // Each line is "<cache path> <source path>"
+    const char* ptr = (const char*)file.data;
+    const char* end = ptr + file.size;
+    while (ptr < end)
+    {
+        const char* lineEnd = ptr;
+        while (lineEnd < end && *lineEnd != '\n') lineEnd++;
+
+        const char* separator = ptr;
+        while (separator < lineEnd && *separator != ' ') separator++;
+
+        const char* sourceEnd = lineEnd;
+        while (sourceEnd > separator && sourceEnd[-1] == '\r') sourceEnd--;
+
+        if (separator < lineEnd)
+            manifest[NormalizeAssetPath(std::string(separator + 1, sourceEnd).c_str())] = std::string(ptr, separator);
+
+        ptr = lineEnd + 1;
+    }
+
+    UnmapFile(file);
+    return manifest;
+}
+
+bool LookupCacheManifest(const char* srcPath, char* cachePath, u32 cachePathSize)
+{
+    static const std::unordered_map<std::string, std::string> manifest = LoadCacheManifest();
+
+    auto it = manifest.find(NormalizeAssetPath(srcPath));
+    if (it == manifest.end())
+        return false;
+
+    snprintf(cachePath, cachePathSize, "%s", it->second.c_str());
+    return true;
+}
+
+bool GetImageCachePath(const char* srcPath, char* cachePath, u32 cachePathSize)
+{
+    const u64 settings[] = { ASSET_CACHE_VERSION, COOKED_IMAGE_VERSION };
+    u64 key = HashBytes(settings, sizeof(settings), 0);
+    if (!HashFile(srcPath, key, &key))
+        return LookupCacheManifest(srcPath, cachePath, cachePathSize);
+
+    MakeCachePath(key, ".ctex", cachePath, cachePathSize);
+    return true;
+}
+
+bool GetModelCachePath(const char* srcPath, char* cachePath, u32 cachePathSize)
+{
+    const u64 settings[] = { ASSET_CACHE_VERSION, COOKED_MODEL_VERSION, MODEL_IMPORT_FLAGS };
+    u64 key = HashBytes(settings, sizeof(settings), 0);
+
+    MappedFile file = MapFile(srcPath);
+    if (!file.data)
+        return LookupCacheManifest(srcPath, cachePath, cachePathSize);
+
+    key = HashBytes(file.data, file.size, key);
+
+    // Materials of .obj files live in the material libraries they reference
+    const std::string directory = GetDirectory(srcPath);
+    const char* ptr = (const char*)file.data;
+    const char* end = ptr + file.size;
+    while (ptr < end)
+    {
+        const char* lineEnd = ptr;
+        while (lineEnd < end && *lineEnd != '\n') lineEnd++;
+
+        if (lineEnd - ptr > 7 && strncmp(ptr, "mtllib ", 7) == 0)
+        {
+            const char* nameEnd = lineEnd;
+            while (nameEnd > ptr + 7 && (nameEnd[-1] == '\r' || nameEnd[-1] == ' ')) nameEnd--;
+
+            const std::string libraryPath = directory + "/" + std::string(ptr + 7, nameEnd);
+            if (!HashFile(libraryPath.c_str(), key, &key))
+                key = HashBytes(libraryPath.data(), libraryPath.size(), key);
+        }
+
+        ptr = lineEnd + 1;
+    }
+
+    UnmapFile(file);
+
+    MakeCachePath(key, ".cmesh", cachePath, cachePathSize);
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Paks
+
+static bool WritePadding(FILE* file, u64 size)
+{
+    static const u8 zeros[PAK_ALIGNMENT] = {};
+    while (size > 0)
+    {
+        const u64 chunk = glm::min(size, (u64)sizeof(zeros));
+        if (fwrite(zeros, 1, chunk, file) != chunk)
+            return false;
+        size -= chunk;
+    }
+    return true;
+}
+
+bool WritePak(const char* pakPath, const std::vector<std::string>& filepaths)
+{
+    const u32 entryCount = (u32)filepaths.size();
+
+    // At most half full, so that probe sequences stay short
+    u32 bucketCount = 1;
+    while (bucketCount < entryCount * 2) bucketCount *= 2;
+
+    std::vector<PakEntry> entries(entryCount);
+    std::vector<u32> buckets(bucketCount, UINT32_MAX);
+    std::string names;
+
+    for (u32 i = 0; i < entryCount; ++i)
+    {
+        const std::string path = NormalizeAssetPath(filepaths[i].c_str());
+        PakEntry& entry = entries[i];
+        entry.pathHash = HashBytes(path.data(), path.size(), PAK_HASH_SEED);
+        entry.nameOffset = (u32)names.size();
+        entry.nameLength = (u32)path.size();
+        names += path;
+
+        u32 bucket = (u32)(entry.pathHash & (bucketCount - 1));
+        while (buckets[bucket] != UINT32_MAX)
+        {
+            const PakEntry& other = entries[buckets[bucket]];
+            if (other.pathHash == entry.pathHash && names.compare(other.nameOffset, other.nameLength, path) == 0)
+            {
+                ELOG("WritePak() - %s is added twice", filepaths[i].c_str());
+                return false;
+            }
+            bucket = (bucket + 1) & (bucketCount - 1);
+        }
+        buckets[bucket] = i;
+    }
+
+    PakHeader header = {};
+    header.magic = PAK_MAGIC;
+    header.version = PAK_VERSION;
+    header.entryCount = entryCount;
+    header.bucketCount = bucketCount;
+    header.entriesOffset = sizeof(PakHeader);
+    header.bucketsOffset = header.entriesOffset + entryCount * sizeof(PakEntry);
+    header.namesOffset = header.bucketsOffset + bucketCount * sizeof(u32);
+
+    FILE* file = fopen(pakPath, "wb");
+    if (!file)
+    {
+        ELOG("fopen() failed writing file %s", pakPath);
+        return false;
+    }
+
+    // The index is written at the end, once the payload sizes are known
+    const u64 indexSize = header.namesOffset + names.size();
+    u64 offset = (indexSize + PAK_ALIGNMENT - 1) & ~(u64)(PAK_ALIGNMENT - 1);
+    bool success = WritePadding(file, offset);
+
+    std::vector<u8> compressed;
+    for (u32 i = 0; success && i < entryCount; ++i)
+    {
+        PakEntry& entry = entries[i];
+        entry.offset = offset;
+
+        MappedFile src = MapFile(filepaths[i].c_str());
+        if (!src.data)
+        {
+            // MapFile does not map empty files
+            success = FileExists(filepaths[i].c_str());
+            if (!success)
+                ELOG("WritePak() - Could not read file %s", filepaths[i].c_str());
+            continue;
+        }
+
+        const void* payload = src.data;
+        entry.rawSize = src.size;
+        entry.storedSize = src.size;
+        if (src.size <= UINT32_MAX - KB(64))
+        {
+            compressed.resize(LZ4CompressBound((u32)src.size));
+            const u32 compressedSize = LZ4Compress((const u8*)src.data, (u32)src.size, compressed.data(), (u32)compressed.size());
+            if (compressedSize > 0 && compressedSize <= src.size - src.size / 8)
+            {
+                payload = compressed.data();
+                entry.storedSize = compressedSize;
+                entry.flags |= PAK_ENTRY_LZ4;
+            }
+        }
+
+        const u64 paddedSize = (entry.storedSize + PAK_ALIGNMENT - 1) & ~(u64)(PAK_ALIGNMENT - 1);
+        success = fwrite(payload, 1, entry.storedSize, file) == entry.storedSize &&
+                  WritePadding(file, paddedSize - entry.storedSize);
+        offset += paddedSize;
+
+        UnmapFile(src);
+    }
+
+    if (success)
+    {
+        success = fseek(file, 0, SEEK_SET) == 0 &&
+                  fwrite(&header, sizeof(header), 1, file) == 1 &&
+                  fwrite(entries.data(), sizeof(PakEntry), entryCount, file) == entryCount &&
+                  fwrite(buckets.data(), sizeof(u32), bucketCount, file) == bucketCount &&
+                  fwrite(names.data(), 1, names.size(), file) == names.size();
+    }
+
+    fclose(file);
+    if (!success)
+    {
+        ELOG("WritePak() - Failed writing pak %s", pakPath);
+        remove(pakPath);
+    }
+    return success;
+}
@@ -0,0 +1,207 @@
+//
+// assets.h: This file contains the asset processing code that does not depend on OpenGL,
+// so that it can be shared between the Engine and offline tools (e.g. the asset cooker).
+//
+
+#pragma once
+
+#include "platform.h"
+
+struct Image
+{
+    void*      pixels;
+    glm::ivec2 size;
+    i32        nchannels;
+    i32        stride;
+    u32        mipCount;         // Levels stored contiguously in pixels, from the biggest to the smallest
+    bool       ownsMallocPixels; // Freed with free(), otherwise the pixels belong to stb_image
+};
+
+// COOKED IMAGES
+
+#define COOKED_IMAGE_MAGIC     0x58544741 // "AGTX"
+#define COOKED_IMAGE_VERSION   1
+#define COOKED_IMAGE_MAX_MIPS  16
+
+struct CookedImageMip
+{
+    u32 offset;         // From the start of the file
+    u32 compressedSize; // Equal to rawSize if the level is stored uncompressed
+    u32 rawSize;
+};
+
+struct CookedImageHeader
+{
+    u32            magic;
+    u32            version;
+    i32            width;
+    i32            height;
+    i32            nchannels;
+    u32            mipCount;
+    CookedImageMip mips[COOKED_IMAGE_MAX_MIPS];
+};
+
+u32 GetMipCount(i32 width, i32 height);
+
+/**
+ * Returns the size in bytes of all the levels of a width x height image, mipmaps included.
+ */
+u32 GetMipChainSize(i32 width, i32 height, i32 nchannels, u32 mipCount);
+
+/**
+ * Fills the levels after the first one of a mip chain laid out as in Image::pixels
+ * by box filtering the previous level.
+ */
+void GenerateMipChain(u8* pixels, i32 width, i32 height, i32 nchannels, u32 mipCount);
+
+/**
+ * Decodes an image file with stb_image, flipped vertically as OpenGL expects. The file is
+ * read with MapFile, so it can come from a pak. Grey and grey-alpha images are expanded to
+ * RGBA, so nchannels is always 3 or 4. Free the pixels with stbi_image_free.
+ */
+u8* DecodeImageFile(const char* filepath, i32* width, i32* height, i32* nchannels);
+
+/**
+ * Decodes an image file and generates its whole mip chain on the CPU, laid out like the levels of
+ * a cooked image. Returns false if the file could not be decoded. Free the image with FreeImage.
+ */
+bool DecodeImageMipChain(const char* filepath, Image* image);
+
+/**
+ * Decodes an image with stb_image, generates its mip chain and writes it LZ4
+ * compressed in the cooked image format.
+ */
+bool CookImage(const char* srcPath, const char* dstPath);
+
+bool WriteCookedImage(const char* dstPath, const Image& image);
+
+bool LoadCookedImage(const char* path, Image* image);
+
+// COOKED MODELS
+
+#define COOKED_MODEL_MAGIC   0x444d4741 // "AGMD"
+#define COOKED_MODEL_VERSION 4
+
+#define OCCLUDER_GRID_SIZE           16    // Voxels along the longest side of the model
+#define OCCLUDER_MAX_BOXES           8
+#define OCCLUDER_MIN_VOLUME_FRACTION 0.01f // Of the model bounds, smaller boxes are not worth rasterizing
+
+struct VertexBufferAttribute {
+    u8 location;
+    u8 componentCount;
+    u8 offset;
+
+};
+
+struct VertexBufferLayout
+{
+    std::vector<VertexBufferAttribute> attributes;
+    u8 stride;
+};
+
+enum MaterialTextureSlot
+{
+    MATERIAL_TEXTURE_ALBEDO,
+    MATERIAL_TEXTURE_EMISSIVE,
+    MATERIAL_TEXTURE_SPECULAR,
+    MATERIAL_TEXTURE_NORMALS,
+    MATERIAL_TEXTURE_BUMP,
+    MATERIAL_TEXTURE_SLOT_COUNT
+};
+
+struct CookedMaterial
+{
+    std::string name;
+    glm::vec3   albedo;
+    glm::vec3   emissive;
+    f32         smoothness;
+    std::string texturePaths[MATERIAL_TEXTURE_SLOT_COUNT]; // Empty if the slot has no texture
+};
+
+struct CookedSubmesh
+{
+    VertexBufferLayout vertexBufferLayout;
+    std::vector<float> vertices;
+    std::vector<u32>   indices;
+    u32                materialIdx; // Index into CookedModel::materials
+    glm::vec3          boundsMin;   // Model space AABB of the positions
+    glm::vec3          boundsMax;
+    glm::vec4          boundingSphere; // Center in xyz, radius in w
+};
+
+/**
+ * Geometry and materials of a model as they come out of the importer, before anything
+ * is uploaded to the GPU. It is what the import cache stores.
+ */
+struct CookedModel
+{
+    std::vector<CookedMaterial> materials;
+    std::vector<CookedSubmesh>  submeshes;
+    std::vector<glm::vec3>      occluderVertices; // Low poly occluder in model space, see GenerateOccluder
+    std::vector<u32>            occluderIndices;
+};
+
+/**
+ * Imports a model file with Assimp. It is safe to call from several threads at once.
+ * Builds that define ASSETS_NO_IMPORT, like the Shipping configuration of the Engine, do not
+ * link Assimp and can only use cooked models.
+ */
+bool ImportModel(const char* filepath, CookedModel* model);
+
+/**
+ * Computes the bounds of a submesh from the positions of its vertices, which are the first
+ * attribute of each one. The sphere is centered in the AABB, so it is not the tightest one.
+ */
+void ComputeSubmeshBounds(CookedSubmesh& submesh);
+
+/**
+ * Generates the occluder of a model: the submeshes are voxelized, the voxels inside the surface
+ * along all three axes are merged greedily into boxes, and the largest ones are kept as triangles
+ * (counter clockwise seen from outside). The boxes span the centers of their voxels, so they stay
+ * within the surface instead of growing past it, and the ones a voxel thick become quads. Open
+ * models get no occluder.
+ */
+void GenerateOccluder(CookedModel& model);
+
+bool WriteCookedModel(const char* dstPath, const CookedModel& model);
+
+bool LoadCookedModel(const char* path, CookedModel* model);
+
+// IMPORT CACHE
+//
+// Cooked assets are stored by content: the key hashes the bytes of the source files
+// together with the import settings and the version of the cooked formats, so any
+// change in them produces a different entry, regardless of file timestamps.
+
+#define ASSET_CACHE_DIRECTORY "Cache"
+#define ASSET_CACHE_MANIFEST  ASSET_CACHE_DIRECTORY "/manifest.txt"
+#define ASSET_CACHE_VERSION   1
+
+/**
+ * Finds the cache entry of a source file in the manifest written by the cooker. It is
+ * used when the sources are not shipped, so their content can not be hashed.
+ */
+bool LookupCacheManifest(const char* srcPath, char* cachePath, u32 cachePathSize);
+
+/**
+ * Writes the path of the cache entry for the cooked version of an image.
+ * Returns false if the source image can not be read nor found in the manifest.
+ */
+bool GetImageCachePath(const char* srcPath, char* cachePath, u32 cachePathSize);
+
+/**
+ * Writes the path of the cache entry for the cooked version of a model. The key also
+ * covers the material libraries referenced by .obj files.
+ * Returns false if the source model can not be read nor found in the manifest.
+ */
+bool GetModelCachePath(const char* srcPath, char* cachePath, u32 cachePathSize);
+
+// PAKS
+
+#define ASSET_PAK_FILENAME "assets.pak"
+
+/**
+ * Packs a list of files into a pak (see platform.h) that can be mounted with MountPak.
+ * Each entry is stored LZ4 compressed if that saves at least an eighth of its size.
+ */
+bool WritePak(const char* pakPath, const std::vector<std::string>& filepaths);
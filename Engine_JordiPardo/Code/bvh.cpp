@@ -0,0 +1,546 @@
+//
+// bvh.cpp : Building, refitting and querying the bounding volume hierarchy.
+//
+
+#include "bvh.h"
+#include <float.h>
+#include <algorithm>
+
+// Queries and builds walk the tree with a stack of at most one node per level, plus the root
+#define BVH_STACK_SIZE (BVH_MAX_DEPTH + 2)
+
+struct BvhBin
+{
+    glm::vec3 boundsMin;
+    glm::vec3 boundsMax;
+    u32       itemCount;
+};
+
+enum BoxFrustumResult
+{
+    BOX_OUTSIDE,
+    BOX_INTERSECTING,
+    BOX_INSIDE
+};
+
+static f32 GetSurfaceArea(const glm::vec3& boundsMin, const glm::vec3& boundsMax)
+{
+    const glm::vec3 size = glm::max(boundsMax - boundsMin, glm::vec3(0.0f));
+    return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+static u32 GetSahBin(f32 center, f32 centerMin, f32 binScale)
+{
+    return glm::min((u32)((center - centerMin) * binScale), (u32)BVH_SAH_BINS - 1);
+}
+
+static glm::vec3 GetItemCenter(const Bvh& bvh, u32 itemIdx)
+{
+    return (bvh.itemMin[itemIdx] + bvh.itemMax[itemIdx]) * 0.5f;
+}
+
+static bool IsBvhNodeDead(const Bvh& bvh, u32 nodeIdx)
+{
+    return nodeIdx != 0 && bvh.nodes[nodeIdx].parent == UINT32_MAX;
+}
+
+// Bounds from the children, or from the items for leaves
+static void RefitBvhNode(Bvh& bvh, BvhNode& node)
+{
+    if (node.leftChild != 0)
+    {
+        const BvhNode& left = bvh.nodes[node.leftChild];
+        const BvhNode& right = bvh.nodes[node.leftChild + 1];
+        node.boundsMin = glm::min(left.boundsMin, right.boundsMin);
+        node.boundsMax = glm::max(left.boundsMax, right.boundsMax);
+        return;
+    }
+
+    node.boundsMin = glm::vec3(FLT_MAX);
+    node.boundsMax = glm::vec3(-FLT_MAX);
+    for (u32 i = node.firstItem; i < node.firstItem + node.itemCount; ++i)
+    {
+        node.boundsMin = glm::min(node.boundsMin, bvh.itemMin[bvh.itemIndices[i]]);
+        node.boundsMax = glm::max(node.boundsMax, bvh.itemMax[bvh.itemIndices[i]]);
+    }
+}
+
+static void MakeBvhLeaf(Bvh& bvh, u32 nodeIdx)
+{
+    const BvhNode& node = bvh.nodes[nodeIdx];
+    for (u32 i = node.firstItem; i < node.firstItem + node.itemCount; ++i)
+        bvh.itemLeaves[bvh.itemIndices[i]] = nodeIdx;
+}
+
+// Builds the subtree under a node that already has its range of items, its parent and its depth.
+// The new nodes are appended, so children still come after their parents.
+static void BuildBvhSubtree(Bvh& bvh, u32 subtreeRootIdx)
+{
+    u32 stack[BVH_STACK_SIZE];
+    u32 stackSize = 0;
+    stack[stackSize++] = subtreeRootIdx;
+
+    while (stackSize > 0)
+    {
+        const u32 nodeIdx = stack[--stackSize];
+
+        // A copy, the nodes can be reallocated when the children are added
+        BvhNode node = bvh.nodes[nodeIdx];
+        node.leftChild = 0;
+        RefitBvhNode(bvh, node);
+        node.builtArea = GetSurfaceArea(node.boundsMin, node.boundsMax);
+        bvh.nodes[nodeIdx] = node;
+
+        if (node.itemCount <= 1 || node.depth >= BVH_MAX_DEPTH)
+        {
+            MakeBvhLeaf(bvh, nodeIdx);
+            continue;
+        }
+
+        // Items are binned by their centers, which can all be in the same place on some axis
+        glm::vec3 centerMin(FLT_MAX);
+        glm::vec3 centerMax(-FLT_MAX);
+        for (u32 i = node.firstItem; i < node.firstItem + node.itemCount; ++i)
+        {
+            const glm::vec3 center = GetItemCenter(bvh, bvh.itemIndices[i]);
+            centerMin = glm::min(centerMin, center);
+            centerMax = glm::max(centerMax, center);
+        }
+
+        // The three axes are binned in the same pass over the items
+        BvhBin bins[3][BVH_SAH_BINS];
+        glm::vec3 binScale;
+        for (u32 axis = 0; axis < 3; ++axis)
+        {
+            const f32 extent = centerMax[axis] - centerMin[axis];
+            binScale[axis] = extent > 0.0f ? BVH_SAH_BINS / extent : 0.0f;
+            for (BvhBin& bin : bins[axis])
+                bin = { glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX), 0 };
+        }
+
+        for (u32 i = node.firstItem; i < node.firstItem + node.itemCount; ++i)
+        {
+            const u32 itemIdx = bvh.itemIndices[i];
+            const glm::vec3 itemMin = bvh.itemMin[itemIdx];
+            const glm::vec3 itemMax = bvh.itemMax[itemIdx];
+            const glm::vec3 center = (itemMin + itemMax) * 0.5f;
+            for (u32 axis = 0; axis < 3; ++axis)
+            {
+                BvhBin& bin = bins[axis][GetSahBin(center[axis], centerMin[axis], binScale[axis])];
+                bin.boundsMin = glm::min(bin.boundsMin, itemMin);
+                bin.boundsMax = glm::max(bin.boundsMax, itemMax);
+                bin.itemCount++;
+            }
+        }
+
+        f32 bestCost = FLT_MAX;
+        u32 bestAxis = 0;
+        u32 bestSplit = 0; // Bins before it go to the left child
+        for (u32 axis = 0; axis < 3; ++axis)
+        {
+            if (binScale[axis] == 0.0f)
+                continue;
+
+            // Left side of each split sweeping forward, then the right side sweeping backwards
+            const BvhBin* axisBins = bins[axis];
+            f32 leftAreas[BVH_SAH_BINS - 1];
+            u32 leftCounts[BVH_SAH_BINS - 1];
+            glm::vec3 sideMin(FLT_MAX);
+            glm::vec3 sideMax(-FLT_MAX);
+            u32 sideCount = 0;
+            for (u32 split = 1; split < BVH_SAH_BINS; ++split)
+            {
+                sideMin = glm::min(sideMin, axisBins[split - 1].boundsMin);
+                sideMax = glm::max(sideMax, axisBins[split - 1].boundsMax);
+                sideCount += axisBins[split - 1].itemCount;
+                leftAreas[split - 1] = GetSurfaceArea(sideMin, sideMax);
+                leftCounts[split - 1] = sideCount;
+            }
+
+            sideMin = glm::vec3(FLT_MAX);
+            sideMax = glm::vec3(-FLT_MAX);
+            sideCount = 0;
+            for (u32 split = BVH_SAH_BINS - 1; split > 0; --split)
+            {
+                sideMin = glm::min(sideMin, axisBins[split].boundsMin);
+                sideMax = glm::max(sideMax, axisBins[split].boundsMax);
+                sideCount += axisBins[split].itemCount;
+                if (sideCount == 0 || leftCounts[split - 1] == 0)
+                    continue;
+
+                const f32 cost = leftAreas[split - 1] * leftCounts[split - 1] + GetSurfaceArea(sideMin, sideMax) * sideCount;
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = split;
+                }
+            }
+        }
+
+        // Costs are relative to the area of the node, as in the SAH
+        const f32 leafCost = node.builtArea * node.itemCount;
+        const bool canSplit = bestCost != FLT_MAX;
+        if (node.itemCount <= BVH_MAX_LEAF_ITEMS && (!canSplit || leafCost <= BVH_TRAVERSAL_COST * node.builtArea + bestCost))
+        {
+            MakeBvhLeaf(bvh, nodeIdx);
+            continue;
+        }
+
+        u32 leftCount = node.itemCount / 2; // All the centers in the same point, any split is as good
+        if (canSplit)
+        {
+            const f32 axisCenterMin = centerMin[bestAxis];
+            const f32 axisBinScale = binScale[bestAxis];
+            u32* first = &bvh.itemIndices[node.firstItem];
+            u32* middle = std::partition(first, first + node.itemCount, [&](u32 itemIdx) {
+                return GetSahBin(GetItemCenter(bvh, itemIdx)[bestAxis], axisCenterMin, axisBinScale) < bestSplit;
+            });
+            leftCount = (u32)(middle - first);
+        }
+
+        const u32 leftChild = (u32)bvh.nodes.size();
+        bvh.nodes[nodeIdx].leftChild = leftChild;
+
+        BvhNode child = {};
+        child.parent = nodeIdx;
+        child.depth = node.depth + 1;
+        child.firstItem = node.firstItem;
+        child.itemCount = leftCount;
+        bvh.nodes.push_back(child);
+        child.firstItem += leftCount;
+        child.itemCount = node.itemCount - leftCount;
+        bvh.nodes.push_back(child);
+
+        stack[stackSize++] = leftChild + 1;
+        stack[stackSize++] = leftChild;
+    }
+
+    bvh.isLeafDirty.resize(bvh.nodes.size(), 0);
+}
+
+// Builds the whole tree again from the boxes it already has
+static void RebuildBvh(Bvh& bvh)
+{
+    const u32 itemCount = GetBvhItemCount(bvh);
+    bvh.nodes.clear();
+    bvh.nodes.reserve(itemCount * 2);
+    bvh.itemIndices.resize(itemCount);
+    for (u32 i = 0; i < itemCount; ++i)
+        bvh.itemIndices[i] = i;
+    bvh.itemLeaves.assign(itemCount, 0);
+    bvh.dirtyLeaves.clear();
+    bvh.isLeafDirty.clear();
+    bvh.deadNodeCount = 0;
+
+    BvhNode root = {};
+    root.parent = UINT32_MAX;
+    root.itemCount = itemCount;
+    bvh.nodes.push_back(root);
+    BuildBvhSubtree(bvh, 0);
+}
+
+// Leaves the nodes under the given one dead, they are only reclaimed by a full rebuild
+static void KillBvhSubtree(Bvh& bvh, u32 subtreeRootIdx)
+{
+    u32 stack[BVH_STACK_SIZE];
+    u32 stackSize = 0;
+    const u32 leftChild = bvh.nodes[subtreeRootIdx].leftChild;
+    if (leftChild == 0)
+        return;
+    stack[stackSize++] = leftChild;
+    stack[stackSize++] = leftChild + 1;
+
+    while (stackSize > 0)
+    {
+        BvhNode& node = bvh.nodes[stack[--stackSize]];
+        if (node.leftChild != 0)
+        {
+            stack[stackSize++] = node.leftChild;
+            stack[stackSize++] = node.leftChild + 1;
+        }
+        node.parent = UINT32_MAX;
+        node.leftChild = 0;
+        node.itemCount = 0;
+        bvh.deadNodeCount++;
+    }
+}
+
+void BuildBvh(Bvh& bvh, const glm::vec3* boundsMin, const glm::vec3* boundsMax, u32 itemCount)
+{
+    bvh.itemMin.assign(boundsMin, boundsMin + itemCount);
+    bvh.itemMax.assign(boundsMax, boundsMax + itemCount);
+    RebuildBvh(bvh);
+}
+
+void SetBvhItemBounds(Bvh& bvh, u32 itemIdx, const glm::vec3& boundsMin, const glm::vec3& boundsMax)
+{
+    if (bvh.itemMin[itemIdx] == boundsMin && bvh.itemMax[itemIdx] == boundsMax)
+        return;
+
+    bvh.itemMin[itemIdx] = boundsMin;
+    bvh.itemMax[itemIdx] = boundsMax;
+
+    const u32 leafIdx = bvh.itemLeaves[itemIdx];
+    if (!bvh.isLeafDirty[leafIdx])
+    {
+        bvh.isLeafDirty[leafIdx] = 1;
+        bvh.dirtyLeaves.push_back(leafIdx);
+    }
+}
+
+void UpdateBvh(Bvh& bvh)
+{
+    bvh.refitNodeCount = 0;
+    bvh.rebuiltSubtreeCount = 0;
+    bvh.rebuildNodes.clear();
+
+    // Up from each moved leaf until a node does not change
+    for (u32 leafIdx : bvh.dirtyLeaves)
+    {
+        bvh.isLeafDirty[leafIdx] = 0;
+
+        u32 degradedIdx = UINT32_MAX; // The highest one of the path
+        u32 nodeIdx = leafIdx;
+        while (nodeIdx != UINT32_MAX)
+        {
+            BvhNode& node = bvh.nodes[nodeIdx];
+            const glm::vec3 oldMin = node.boundsMin;
+            const glm::vec3 oldMax = node.boundsMax;
+            RefitBvhNode(bvh, node);
+            bvh.refitNodeCount++;
+
+            if (GetSurfaceArea(node.boundsMin, node.boundsMax) > node.builtArea * BVH_REBUILD_AREA_RATIO)
+                degradedIdx = nodeIdx;
+            if (node.boundsMin == oldMin && node.boundsMax == oldMax)
+                break;
+            nodeIdx = node.parent;
+        }
+
+        if (degradedIdx != UINT32_MAX)
+            bvh.rebuildNodes.push_back(degradedIdx);
+    }
+    bvh.dirtyLeaves.clear();
+
+    // Parents first, so that the subtrees under one already built again are skipped as dead
+    std::sort(bvh.rebuildNodes.begin(), bvh.rebuildNodes.end());
+    bvh.rebuildNodes.erase(std::unique(bvh.rebuildNodes.begin(), bvh.rebuildNodes.end()), bvh.rebuildNodes.end());
+    for (u32 nodeIdx : bvh.rebuildNodes)
+    {
+        if (IsBvhNodeDead(bvh, nodeIdx))
+            continue;
+
+        bvh.rebuiltSubtreeCount++;
+        if (nodeIdx == 0)
+        {
+            RebuildBvh(bvh);
+            return;
+        }
+
+        KillBvhSubtree(bvh, nodeIdx);
+        BuildBvhSubtree(bvh, nodeIdx);
+    }
+
+    if (bvh.deadNodeCount > bvh.nodes.size() / 2)
+        RebuildBvh(bvh);
+}
+
+static BoxFrustumResult TestBoxFrustum(const glm::vec4 planes[6], const glm::vec3& boundsMin, const glm::vec3& boundsMax)
+{
+    const glm::vec3 center = (boundsMin + boundsMax) * 0.5f;
+    const glm::vec3 extents = (boundsMax - boundsMin) * 0.5f;
+
+    BoxFrustumResult result = BOX_INSIDE;
+    for (u32 i = 0; i < 6; ++i)
+    {
+        const glm::vec3 normal = glm::vec3(planes[i]);
+        const f32 distance = glm::dot(normal, center) + planes[i].w;
+        const f32 radius = glm::dot(glm::abs(normal), extents);
+        if (distance + radius < 0.0f)
+            return BOX_OUTSIDE;
+        if (distance - radius < 0.0f)
+            result = BOX_INTERSECTING;
+    }
+    return result;
+}
+
+static bool BoxOverlapsSphere(const glm::vec3& boundsMin, const glm::vec3& boundsMax, const glm::vec3& center, f32 radiusSquared)
+{
+    const glm::vec3 offset = center - glm::clamp(center, boundsMin, boundsMax);
+    return glm::dot(offset, offset) <= radiusSquared;
+}
+
+static bool BoxOverlapsBox(const glm::vec3& aMin, const glm::vec3& aMax, const glm::vec3& bMin, const glm::vec3& bMax)
+{
+    return aMin.x <= bMax.x && aMin.y <= bMax.y && aMin.z <= bMax.z &&
+           aMax.x >= bMin.x && aMax.y >= bMin.y && aMax.z >= bMin.z;
+}
+
+// Distance at which the ray enters the box, FLT_MAX if it misses it within maxDistance
+static f32 IntersectRayBox(const glm::vec3& origin, const glm::vec3& invDirection, const glm::vec3& boundsMin, const glm::vec3& boundsMax, f32 maxDistance)
+{
+    const glm::vec3 t0 = (boundsMin - origin) * invDirection;
+    const glm::vec3 t1 = (boundsMax - origin) * invDirection;
+    const glm::vec3 tNear = glm::min(t0, t1);
+    const glm::vec3 tFar = glm::max(t0, t1);
+    const f32 enter = glm::max(glm::max(tNear.x, tNear.y), glm::max(tNear.z, 0.0f));
+    const f32 exit = glm::min(glm::min(tFar.x, tFar.y), glm::min(tFar.z, maxDistance));
+    return enter <= exit ? enter : FLT_MAX;
+}
+
+void QueryBvhFrustum(const Bvh& bvh, const glm::vec4 planes[6], std::vector<u32>& items)
+{
+    if (bvh.nodes.empty() || bvh.nodes[0].itemCount == 0)
+        return;
+
+    u32 stack[BVH_STACK_SIZE];
+    u32 stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0)
+    {
+        const BvhNode& node = bvh.nodes[stack[--stackSize]];
+        const BoxFrustumResult result = TestBoxFrustum(planes, node.boundsMin, node.boundsMax);
+        if (result == BOX_OUTSIDE)
+            continue;
+
+        if (result == BOX_INSIDE)
+        {
+            const auto first = bvh.itemIndices.begin() + node.firstItem;
+            items.insert(items.end(), first, first + node.itemCount);
+        }
+        else if (node.leftChild != 0)
+        {
+            stack[stackSize++] = node.leftChild + 1;
+            stack[stackSize++] = node.leftChild;
+        }
+        else
+        {
+            for (u32 i = node.firstItem; i < node.firstItem + node.itemCount; ++i)
+            {
+                const u32 itemIdx = bvh.itemIndices[i];
+                if (TestBoxFrustum(planes, bvh.itemMin[itemIdx], bvh.itemMax[itemIdx]) != BOX_OUTSIDE)
+                    items.push_back(itemIdx);
+            }
+        }
+    }
+}
+
+void QueryBvhSphere(const Bvh& bvh, const glm::vec3& center, f32 radius, std::vector<u32>& items)
+{
+    if (bvh.nodes.empty() || bvh.nodes[0].itemCount == 0)
+        return;
+
+    const f32 radiusSquared = radius * radius;
+    u32 stack[BVH_STACK_SIZE];
+    u32 stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0)
+    {
+        const BvhNode& node = bvh.nodes[stack[--stackSize]];
+        if (!BoxOverlapsSphere(node.boundsMin, node.boundsMax, center, radiusSquared))
+            continue;
+
+        if (node.leftChild != 0)
+        {
+            stack[stackSize++] = node.leftChild + 1;
+            stack[stackSize++] = node.leftChild;
+            continue;
+        }
+
+        for (u32 i = node.firstItem; i < node.firstItem + node.itemCount; ++i)
+        {
+            const u32 itemIdx = bvh.itemIndices[i];
+            if (BoxOverlapsSphere(bvh.itemMin[itemIdx], bvh.itemMax[itemIdx], center, radiusSquared))
+                items.push_back(itemIdx);
+        }
+    }
+}
+
+void QueryBvhBox(const Bvh& bvh, const glm::vec3& boundsMin, const glm::vec3& boundsMax, std::vector<u32>& items)
+{
+    if (bvh.nodes.empty() || bvh.nodes[0].itemCount == 0)
+        return;
+
+    u32 stack[BVH_STACK_SIZE];
+    u32 stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0)
+    {
+        const BvhNode& node = bvh.nodes[stack[--stackSize]];
+        if (!BoxOverlapsBox(node.boundsMin, node.boundsMax, boundsMin, boundsMax))
+            continue;
+
+        if (node.leftChild != 0)
+        {
+            stack[stackSize++] = node.leftChild + 1;
+            stack[stackSize++] = node.leftChild;
+            continue;
+        }
+
+        for (u32 i = node.firstItem; i < node.firstItem + node.itemCount; ++i)
+        {
+            const u32 itemIdx = bvh.itemIndices[i];
+            if (BoxOverlapsBox(bvh.itemMin[itemIdx], bvh.itemMax[itemIdx], boundsMin, boundsMax))
+                items.push_back(itemIdx);
+        }
+    }
+}
+
+u32 RaycastBvh(const Bvh& bvh, const glm::vec3& origin, const glm::vec3& direction, f32 maxDistance, f32* hitDistance)
+{
+    if (bvh.nodes.empty() || bvh.nodes[0].itemCount == 0)
+        return UINT32_MAX;
+
+    // Tiny components instead of zeros, so that 0 * inf does not make NaNs in the slab test
+    glm::vec3 invDirection;
+    for (u32 axis = 0; axis < 3; ++axis)
+        invDirection[axis] = 1.0f / (fabsf(direction[axis]) > 1e-30f ? direction[axis] : 1e-30f);
+
+    f32 nearestDistance = maxDistance;
+    u32 nearestItem = UINT32_MAX;
+
+    u32 stack[BVH_STACK_SIZE];
+    u32 stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0)
+    {
+        const BvhNode& node = bvh.nodes[stack[--stackSize]];
+        if (IntersectRayBox(origin, invDirection, node.boundsMin, node.boundsMax, nearestDistance) == FLT_MAX)
+            continue;
+
+        if (node.leftChild != 0)
+        {
+            // The nearest child is popped first, so that hits in it shorten the ray for the other
+            const BvhNode& left = bvh.nodes[node.leftChild];
+            const BvhNode& right = bvh.nodes[node.leftChild + 1];
+            const f32 leftDistance = IntersectRayBox(origin, invDirection, left.boundsMin, left.boundsMax, nearestDistance);
+            const f32 rightDistance = IntersectRayBox(origin, invDirection, right.boundsMin, right.boundsMax, nearestDistance);
+            const bool leftFirst = leftDistance <= rightDistance;
+            const f32 farDistance = leftFirst ? rightDistance : leftDistance;
+            if (farDistance != FLT_MAX)
+                stack[stackSize++] = leftFirst ? node.leftChild + 1 : node.leftChild;
+            if (glm::min(leftDistance, rightDistance) != FLT_MAX)
+                stack[stackSize++] = leftFirst ? node.leftChild : node.leftChild + 1;
+            continue;
+        }
+
+        for (u32 i = node.firstItem; i < node.firstItem + node.itemCount; ++i)
+        {
+            const u32 itemIdx = bvh.itemIndices[i];
+            const f32 distance = IntersectRayBox(origin, invDirection, bvh.itemMin[itemIdx], bvh.itemMax[itemIdx], nearestDistance);
+            if (distance < nearestDistance || (distance != FLT_MAX && nearestItem == UINT32_MAX))
+            {
+                nearestDistance = distance;
+                nearestItem = itemIdx;
+            }
+        }
+    }
+
+    if (hitDistance && nearestItem != UINT32_MAX)
+        *hitDistance = nearestDistance;
+    return nearestItem;
+}
@@ -0,0 +1,89 @@
+//
+// bvh.h: Dynamic bounding volume hierarchy over axis aligned boxes, to find the items of a
+// region (e.g. the entities in the frustum) without scanning all of them.
+//
+// Items are referenced by their index, the tree only stores their boxes. Moved items are
+// refit from their leaf up, and the subtrees that refits made too loose are built again.
+//
+
+#pragma once
+
+#include "platform.h"
+
+#define BVH_SAH_BINS           16
+#define BVH_MAX_LEAF_ITEMS     4
+#define BVH_MAX_DEPTH          64   // Deeper ranges become leaves, so that queries fit a fixed stack
+#define BVH_TRAVERSAL_COST     1.0f // Of visiting a node, relative to testing an item
+#define BVH_REBUILD_AREA_RATIO 1.5f // Refit subtrees that grow past their built area times this are built again
+
+struct BvhNode
+{
+    glm::vec3 boundsMin;
+    u32       firstItem; // Range of Bvh::itemIndices under the node
+    glm::vec3 boundsMax;
+    u32       itemCount;
+    u32       leftChild; // The right one follows it, 0 for leaves (the root is never a child)
+    u32       parent;    // UINT32_MAX for the root and the nodes left behind by rebuilds
+    u32       depth;
+    f32       builtArea; // Surface area when the subtree was built
+};
+
+struct Bvh
+{
+    std::vector<BvhNode>   nodes;        // Children always come after their parents
+    std::vector<u32>       itemIndices;  // Items in the order of the leaves
+    std::vector<glm::vec3> itemMin;      // Box of each item
+    std::vector<glm::vec3> itemMax;
+    std::vector<u32>       itemLeaves;   // Leaf of each item
+    std::vector<u32>       dirtyLeaves;  // With items moved since the last UpdateBvh
+    std::vector<u8>        isLeafDirty;  // By node
+    std::vector<u32>       rebuildNodes; // Scratch of UpdateBvh
+    u32                    deadNodeCount; // Left behind by subtree rebuilds, until the next full build
+
+    // Of the last UpdateBvh
+    u32 refitNodeCount;
+    u32 rebuiltSubtreeCount;
+};
+
+/**
+ * Builds the whole tree for itemCount boxes with a binned SAH.
+ */
+void BuildBvh(Bvh& bvh, const glm::vec3* boundsMin, const glm::vec3* boundsMax, u32 itemCount);
+
+/**
+ * Moves an item. The tree is not refit until UpdateBvh, and nothing is done if the box did not change.
+ */
+void SetBvhItemBounds(Bvh& bvh, u32 itemIdx, const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+
+/**
+ * Refits the ancestors of the moved items, and builds again the largest subtree of each path that
+ * grew past BVH_REBUILD_AREA_RATIO. The whole tree is built again once half of the nodes are dead.
+ */
+void UpdateBvh(Bvh& bvh);
+
+inline u32 GetBvhItemCount(const Bvh& bvh)
+{
+    return (u32)bvh.itemMin.size();
+}
+
+/**
+ * Appends the items whose boxes are not completely outside of one of the planes (see ExtractFrustumPlanes).
+ * Subtrees completely inside the frustum are appended without testing their items.
+ */
+void QueryBvhFrustum(const Bvh& bvh, const glm::vec4 planes[6], std::vector<u32>& items);
+
+/**
+ * Appends the items whose boxes overlap the sphere.
+ */
+void QueryBvhSphere(const Bvh& bvh, const glm::vec3& center, f32 radius, std::vector<u32>& items);
+
+/**
+ * Appends the items whose boxes overlap the box.
+ */
+void QueryBvhBox(const Bvh& bvh, const glm::vec3& boundsMin, const glm::vec3& boundsMax, std::vector<u32>& items);
+
+/**
+ * Returns the item whose box the ray enters first within maxDistance, or UINT32_MAX if none.
+ * The direction does not need to be normalized, distances are measured in its length.
+ */
+u32 RaycastBvh(const Bvh& bvh, const glm::vec3& origin, const glm::vec3& direction, f32 maxDistance, f32* hitDistance);
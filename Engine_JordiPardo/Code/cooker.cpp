@@ -0,0 +1,360 @@
+//
+// cooker.cpp : Command line tool that cooks all the assets of a WorkingDir-style tree into the
+// import cache ahead of time, so that the Engine only has to map cooked files at startup.
+//
+// Usage: Cooker [root directory] [-f] [-pak]
+//
+//   -f    Cook every asset again, even if its cache entry already exists.
+//   -pak  Pack all the files of the tree, cache included, into ASSET_PAK_FILENAME.
+//
+// Cache entries are keyed by the content of their sources (see assets.h), so only the assets
+// whose sources changed since the last run are cooked again.
+//
+
+#include "assets.h"
+
+#include <string.h>
+#include <ctype.h>
+#include <chrono>
+#include <unordered_map>
+#include <algorithm>
+
+enum AssetType
+{
+    ASSET_IMAGE,
+    ASSET_MODEL,
+    ASSET_MATERIAL_LIBRARY,
+    ASSET_TYPE_COUNT
+};
+
+enum CookResult
+{
+    COOK_PENDING,
+    COOK_UP_TO_DATE,
+    COOK_COOKED,
+    COOK_FAILED
+};
+
+struct AssetNode
+{
+    AssetType        type;
+    std::string      path;         // Relative to the root, as the Engine requests it
+    std::vector<u32> dependencies; // .obj -> .mtl -> textures
+    char             cachePath[256];
+    CookResult       result;
+};
+
+struct CookGraph
+{
+    std::vector<AssetNode>               nodes;
+    std::unordered_map<std::string, u32> nodeIndices; // By normalized path
+    bool                                 force;
+    bool                                 pack;
+};
+
+static bool HasExtension(const std::string& path, const char* const* extensions, u32 extensionCount)
+{
+    const size_t dot = path.find_last_of('.');
+    if (dot == std::string::npos)
+        return false;
+
+    const std::string extension = NormalizeAssetPath(path.c_str() + dot);
+    for (u32 i = 0; i < extensionCount; ++i)
+        if (extension == extensions[i])
+            return true;
+    return false;
+}
+
+static std::string GetDirectoryOf(const std::string& path)
+{
+    const size_t separator = path.find_last_of('/');
+    return separator == std::string::npos ? std::string() : path.substr(0, separator + 1);
+}
+
+static u32 FindNode(const CookGraph& graph, const std::string& path)
+{
+    auto it = graph.nodeIndices.find(NormalizeAssetPath(path.c_str()));
+    return it == graph.nodeIndices.end() ? UINT32_MAX : it->second;
+}
+
+/**
+ * Adds an edge for each file referenced by the lines of a text asset that start with one
+ * of the given keywords (mtllib in .obj files, map_* in .mtl files). The file name is the
+ * last token of the line, relative to the directory of the asset.
+ */
+static void AddTextDependencies(CookGraph& graph, u32 nodeIdx, const char* const* keywords, u32 keywordCount)
+{
+    const std::string path = graph.nodes[nodeIdx].path;
+    const std::string directory = GetDirectoryOf(path);
+
+    MappedFile file = MapFile(path.c_str());
+    if (!file.data)
+        return;
+
+    const char* ptr = (const char*)file.data;
+    const char* end = ptr + file.size;
+    while (ptr < end)
+    {
+        const char* lineEnd = ptr;
+        while (lineEnd < end && *lineEnd != '\n') lineEnd++;
+
+        while (ptr < lineEnd && (*ptr == ' ' || *ptr == '\t')) ptr++;
+        for (u32 i = 0; i < keywordCount; ++i)
+        {
+            const size_t keywordLength = strlen(keywords[i]);
+            if ((size_t)(lineEnd - ptr) <= keywordLength || strncmp(ptr, keywords[i], keywordLength) != 0 ||
+                !isspace((unsigned char)ptr[keywordLength]))
+                continue;
+
+            const char* nameEnd = lineEnd;
+            while (nameEnd > ptr && isspace((unsigned char)nameEnd[-1])) nameEnd--;
+            const char* nameBegin = nameEnd;
+            while (nameBegin > ptr + keywordLength && !isspace((unsigned char)nameBegin[-1])) nameBegin--;
+
+            const std::string dependencyPath = directory + std::string(nameBegin, nameEnd);
+            const u32 dependencyIdx = FindNode(graph, dependencyPath);
+            if (dependencyIdx == UINT32_MAX)
+                ELOG("Warning: %s references missing file %s", path.c_str(), dependencyPath.c_str())
+            else
+                graph.nodes[nodeIdx].dependencies.push_back(dependencyIdx);
+            break;
+        }
+
+        ptr = lineEnd + 1;
+    }
+
+    UnmapFile(file);
+}
+
+static void BuildCookGraph(CookGraph& graph)
+{
+    const char* const imageExtensions[] = { ".png", ".jpg", ".jpeg", ".tga", ".bmp", ".psd", ".hdr" };
+    const char* const modelExtensions[] = { ".obj", ".fbx", ".dae", ".gltf", ".glb", ".3ds", ".blend" };
+    const char* const materialExtensions[] = { ".mtl" };
+
+    const std::string cacheDirectory = NormalizeAssetPath(ASSET_CACHE_DIRECTORY) + "/";
+
+    std::vector<std::string> filepaths;
+    ListFilesRecursive(".", filepaths);
+
+    for (const std::string& filepath : filepaths)
+    {
+        // Paths come as "./dir/file", the Engine requests them as "dir/file"
+        const std::string path = filepath.compare(0, 2, "./") == 0 ? filepath.substr(2) : filepath;
+        if (NormalizeAssetPath(path.c_str()).compare(0, cacheDirectory.size(), cacheDirectory) == 0)
+            continue;
+
+        AssetNode node = {};
+        node.path = path;
+        if (HasExtension(path, imageExtensions, ARRAY_COUNT(imageExtensions)))
+            node.type = ASSET_IMAGE;
+        else if (HasExtension(path, modelExtensions, ARRAY_COUNT(modelExtensions)))
+            node.type = ASSET_MODEL;
+        else if (HasExtension(path, materialExtensions, ARRAY_COUNT(materialExtensions)))
+            node.type = ASSET_MATERIAL_LIBRARY;
+        else
+            continue;
+
+        graph.nodeIndices[NormalizeAssetPath(path.c_str())] = (u32)graph.nodes.size();
+        graph.nodes.push_back(node);
+    }
+
+    const char* const modelKeywords[] = { "mtllib" };
+    const char* const materialKeywords[] = { "map_Kd", "map_Ka", "map_Ks", "map_Ke", "map_Ns", "map_d", "map_Bump", "map_bump", "bump", "norm", "disp" };
+
+    for (u32 i = 0; i < graph.nodes.size(); ++i)
+    {
+        const AssetNode& node = graph.nodes[i];
+        if (node.type == ASSET_MODEL && HasExtension(node.path, modelExtensions, 1))
+            AddTextDependencies(graph, i, modelKeywords, ARRAY_COUNT(modelKeywords));
+        else if (node.type == ASSET_MATERIAL_LIBRARY)
+            AddTextDependencies(graph, i, materialKeywords, ARRAY_COUNT(materialKeywords));
+    }
+}
+
+/**
+ * Appends the nodes a node depends on, directly or through others, that are not in the list yet.
+ */
+static void CollectDependencies(const CookGraph& graph, u32 nodeIdx, std::vector<u32>& dependencies)
+{
+    for (u32 dependencyIdx : graph.nodes[nodeIdx].dependencies)
+    {
+        if (std::find(dependencies.begin(), dependencies.end(), dependencyIdx) != dependencies.end())
+            continue;
+        dependencies.push_back(dependencyIdx);
+        CollectDependencies(graph, dependencyIdx, dependencies);
+    }
+}
+
+static bool IsCached(const char* cachePath)
+{
+    return GetFileLastWriteTimestamp(cachePath) != 0;
+}
+
+struct CookJob
+{
+    CookGraph*       graph;
+    std::vector<u32> nodeIndices;
+};
+
+static void CookAssets(void* userData, u32 begin, u32 end)
+{
+    CookJob* job = (CookJob*)userData;
+    for (u32 i = begin; i < end; ++i)
+    {
+        AssetNode& node = job->graph->nodes[job->nodeIndices[i]];
+
+        if (node.type == ASSET_IMAGE)
+        {
+            if (!GetImageCachePath(node.path.c_str(), node.cachePath, sizeof(node.cachePath)))
+                node.result = COOK_FAILED;
+            else if (!job->graph->force && IsCached(node.cachePath))
+                node.result = COOK_UP_TO_DATE;
+            else
+                node.result = CookImage(node.path.c_str(), node.cachePath) ? COOK_COOKED : COOK_FAILED;
+        }
+        else if (node.type == ASSET_MODEL)
+        {
+            // The key of a model covers its material libraries, so editing a .mtl cooks the model again
+            CookedModel model;
+            if (!GetModelCachePath(node.path.c_str(), node.cachePath, sizeof(node.cachePath)))
+                node.result = COOK_FAILED;
+            else if (!job->graph->force && IsCached(node.cachePath))
+                node.result = COOK_UP_TO_DATE;
+            else if (ImportModel(node.path.c_str(), &model) && WriteCookedModel(node.cachePath, model))
+                node.result = COOK_COOKED;
+            else
+                node.result = COOK_FAILED;
+        }
+    }
+}
+
+static void CookAssetsOfType(CookGraph& graph, AssetType type)
+{
+    CookJob job = {};
+    job.graph = &graph;
+    for (u32 i = 0; i < graph.nodes.size(); ++i)
+        if (graph.nodes[i].type == type)
+            job.nodeIndices.push_back(i);
+
+    ParallelFor((u32)job.nodeIndices.size(), 1, CookAssets, &job);
+}
+
+static bool WriteCacheManifest(const CookGraph& graph)
+{
+    FILE* file = fopen(ASSET_CACHE_MANIFEST, "wb");
+    if (!file)
+    {
+        ELOG("fopen() failed writing file %s", ASSET_CACHE_MANIFEST);
+        return false;
+    }
+
+    for (const AssetNode& node : graph.nodes)
+        if (node.result == COOK_UP_TO_DATE || node.result == COOK_COOKED)
+            fprintf(file, "%s %s\n", node.cachePath, node.path.c_str());
+
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    const char* root = ".";
+    CookGraph graph = {};
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-f") == 0)
+            graph.force = true;
+        else if (strcmp(argv[i], "-pak") == 0)
+            graph.pack = true;
+        else
+            root = argv[i];
+    }
+
+    if (!SetWorkingDirectory(root))
+    {
+        ELOG("Could not open directory %s", root);
+        return -1;
+    }
+
+    if (!MakeDirectory(ASSET_CACHE_DIRECTORY))
+    {
+        ELOG("Could not create directory %s/%s", root, ASSET_CACHE_DIRECTORY);
+        return -1;
+    }
+
+    const auto startTime = std::chrono::steady_clock::now();
+
+    BuildCookGraph(graph);
+
+    // Textures first, then the models that reference them
+    CookAssetsOfType(graph, ASSET_IMAGE);
+    CookAssetsOfType(graph, ASSET_MODEL);
+
+    WriteCacheManifest(graph);
+
+    bool packed = true;
+    if (graph.pack)
+    {
+        // Listed again so that the pak gets the cache entries written above
+        std::vector<std::string> filepaths;
+        ListFilesRecursive(".", filepaths);
+
+        std::vector<std::string> pakFilepaths;
+        for (const std::string& filepath : filepaths)
+        {
+            const std::string path = filepath.compare(0, 2, "./") == 0 ? filepath.substr(2) : filepath;
+            if (NormalizeAssetPath(path.c_str()) != NormalizeAssetPath(ASSET_PAK_FILENAME))
+                pakFilepaths.push_back(path);
+        }
+
+        packed = WritePak(ASSET_PAK_FILENAME, pakFilepaths);
+        if (packed)
+            printf("Packed %u files into %s\n", (u32)pakFilepaths.size(), ASSET_PAK_FILENAME);
+    }
+
+    const f64 elapsed = std::chrono::duration<f64>(std::chrono::steady_clock::now() - startTime).count();
+
+    const char* typeNames[ASSET_TYPE_COUNT] = { "images", "models", "material libraries" };
+    u32 counts[ASSET_TYPE_COUNT][COOK_FAILED + 1] = {};
+    std::vector<u32> dependencies;
+    for (u32 i = 0; i < graph.nodes.size(); ++i)
+    {
+        const AssetNode& node = graph.nodes[i];
+        counts[node.type][node.result]++;
+        if (node.result != COOK_FAILED)
+            continue;
+
+        // The models still load without a texture that failed, so the ones using it are listed too
+        printf("FAILED %s\n", node.path.c_str());
+        for (u32 modelIdx = 0; modelIdx < graph.nodes.size(); ++modelIdx)
+        {
+            if (graph.nodes[modelIdx].type != ASSET_MODEL)
+                continue;
+            dependencies.clear();
+            CollectDependencies(graph, modelIdx, dependencies);
+            if (std::find(dependencies.begin(), dependencies.end(), i) != dependencies.end())
+                printf("    used by %s\n", graph.nodes[modelIdx].path.c_str());
+        }
+    }
+
+    for (u32 type = 0; type < ASSET_TYPE_COUNT; ++type)
+    {
+        if (type == ASSET_MATERIAL_LIBRARY)
+        {
+            // Material libraries are not cooked on their own, they are part of their models' keys
+            printf("%-20s %u tracked\n", typeNames[type], counts[type][COOK_PENDING]);
+            continue;
+        }
+        printf("%-20s %u cooked, %u up to date, %u failed\n", typeNames[type],
+               counts[type][COOK_COOKED], counts[type][COOK_UP_TO_DATE], counts[type][COOK_FAILED]);
+    }
+    printf("Cooked %s in %.2f s using %u threads\n", root, elapsed, GetJobThreadCount());
+
+    for (const AssetNode& node : graph.nodes)
+        if (node.result == COOK_FAILED)
+            return 1;
+
+    return packed ? 0 : 1;
+}
@@ -0,0 +1,174 @@
+//
+// culling.cpp : Frustum planes, and the sphere and box tests against them.
+//
+
+#include "culling.h"
+#include <float.h>
+#include <atomic>
+
+// SSE is always there on x64, AVX only if the build enables it (/arch:AVX, -mavx)
+#if defined(__AVX__)
+#define CULLING_SIMD_AVX
+#include <immintrin.h>
+#elif defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define CULLING_SIMD_SSE
+#include <xmmintrin.h>
+#endif
+
+void ResizeCullingSpheres(CullingSpheres& spheres, u32 count)
+{
+    const u32 paddedCount = (count + CULLING_SPHERE_PADDING - 1) / CULLING_SPHERE_PADDING * CULLING_SPHERE_PADDING;
+    spheres.count = count;
+    spheres.centerX.assign(paddedCount, 0.0f);
+    spheres.centerY.assign(paddedCount, 0.0f);
+    spheres.centerZ.assign(paddedCount, 0.0f);
+    spheres.radius.assign(paddedCount, -FLT_MAX);
+    spheres.visible.resize(paddedCount);
+}
+
+struct CullSpheresJob
+{
+    const glm::vec4*  planes;
+    CullingSpheres*   spheres;
+    std::atomic<u32>  visibleCount;
+};
+
+// A sphere is visible unless it is completely behind one of the planes:
+// dot(normal, center) + distance < -radius
+static void CullSphereBatches(void* userData, u32 begin, u32 end)
+{
+    CullSpheresJob* job = (CullSpheresJob*)userData;
+    CullingSpheres& spheres = *job->spheres;
+    const glm::vec4* planes = job->planes;
+    u32 visibleCount = 0;
+
+#if defined(CULLING_SIMD_AVX)
+    for (u32 i = begin; i < end; i += 8)
+    {
+        const __m256 x = _mm256_loadu_ps(&spheres.centerX[i]);
+        const __m256 y = _mm256_loadu_ps(&spheres.centerY[i]);
+        const __m256 z = _mm256_loadu_ps(&spheres.centerZ[i]);
+        const __m256 negRadius = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(&spheres.radius[i]));
+
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (u32 p = 0; p < 6; ++p)
+        {
+            __m256 distance = _mm256_set1_ps(planes[p].w);
+            distance = _mm256_add_ps(distance, _mm256_mul_ps(x, _mm256_set1_ps(planes[p].x)));
+            distance = _mm256_add_ps(distance, _mm256_mul_ps(y, _mm256_set1_ps(planes[p].y)));
+            distance = _mm256_add_ps(distance, _mm256_mul_ps(z, _mm256_set1_ps(planes[p].z)));
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, negRadius, _CMP_GE_OQ));
+        }
+
+        const u32 mask = (u32)_mm256_movemask_ps(inside);
+        for (u32 lane = 0; lane < 8; ++lane)
+        {
+            spheres.visible[i + lane] = (u8)((mask >> lane) & 1);
+            visibleCount += (mask >> lane) & 1;
+        }
+    }
+#elif defined(CULLING_SIMD_SSE)
+    for (u32 i = begin; i < end; i += 4)
+    {
+        const __m128 x = _mm_loadu_ps(&spheres.centerX[i]);
+        const __m128 y = _mm_loadu_ps(&spheres.centerY[i]);
+        const __m128 z = _mm_loadu_ps(&spheres.centerZ[i]);
+        const __m128 negRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&spheres.radius[i]));
+
+        __m128 inside = _mm_cmpeq_ps(_mm_setzero_ps(), _mm_setzero_ps());
+        for (u32 p = 0; p < 6; ++p)
+        {
+            __m128 distance = _mm_set1_ps(planes[p].w);
+            distance = _mm_add_ps(distance, _mm_mul_ps(x, _mm_set1_ps(planes[p].x)));
+            distance = _mm_add_ps(distance, _mm_mul_ps(y, _mm_set1_ps(planes[p].y)));
+            distance = _mm_add_ps(distance, _mm_mul_ps(z, _mm_set1_ps(planes[p].z)));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negRadius));
+        }
+
+        const u32 mask = (u32)_mm_movemask_ps(inside);
+        for (u32 lane = 0; lane < 4; ++lane)
+        {
+            spheres.visible[i + lane] = (u8)((mask >> lane) & 1);
+            visibleCount += (mask >> lane) & 1;
+        }
+    }
+#else
+    for (u32 i = begin; i < end; ++i)
+    {
+        const glm::vec4 sphere(spheres.centerX[i], spheres.centerY[i], spheres.centerZ[i], spheres.radius[i]);
+        spheres.visible[i] = IsSphereInFrustum(planes, sphere) ? 1 : 0;
+        visibleCount += spheres.visible[i];
+    }
+#endif
+
+    job->visibleCount += visibleCount;
+}
+
+u32 CullSpheres(const glm::vec4 planes[6], CullingSpheres& spheres)
+{
+    CullSpheresJob job;
+    job.planes = planes;
+    job.spheres = &spheres;
+    job.visibleCount = 0;
+
+    // The padded count, so every batch is a whole number of SIMD iterations
+    ParallelFor((u32)spheres.radius.size(), CULLING_BATCH_SIZE, CullSphereBatches, &job);
+    return job.visibleCount;
+}
+
+void ExtractFrustumPlanes(const glm::mat4& viewProjection, glm::vec4 planes[6])
+{
+    // Rows of the matrix, glm is column major
+    const glm::mat4 m = glm::transpose(viewProjection);
+    planes[0] = m[3] + m[0]; // Left
+    planes[1] = m[3] - m[0]; // Right
+    planes[2] = m[3] + m[1]; // Bottom
+    planes[3] = m[3] - m[1]; // Top
+    planes[4] = m[3] + m[2]; // Near
+    planes[5] = m[3] - m[2]; // Far
+    for (u32 i = 0; i < 6; ++i)
+        planes[i] /= glm::length(glm::vec3(planes[i]));
+}
+
+// Shaders/cull_instances.glsl does the same test
+bool IsBoxInFrustum(const glm::vec4 planes[6], const glm::mat4& worldMatrix, const glm::vec3& boundsMin, const glm::vec3& boundsMax)
+{
+    const glm::vec3 center = glm::vec3(worldMatrix * glm::vec4((boundsMin + boundsMax) * 0.5f, 1.0f));
+    const glm::mat3 absMatrix = glm::mat3(glm::abs(glm::vec3(worldMatrix[0])), glm::abs(glm::vec3(worldMatrix[1])), glm::abs(glm::vec3(worldMatrix[2])));
+    const glm::vec3 extents = absMatrix * ((boundsMax - boundsMin) * 0.5f);
+
+    for (u32 i = 0; i < 6; ++i)
+    {
+        const glm::vec3 normal = glm::vec3(planes[i]);
+        if (glm::dot(normal, center) + planes[i].w + glm::dot(glm::abs(normal), extents) < 0.0f)
+            return false;
+    }
+    return true;
+}
+
+void TransformBoundingBox(const glm::mat4& worldMatrix, const glm::vec3& boundsMin, const glm::vec3& boundsMax, glm::vec3* worldMin, glm::vec3* worldMax)
+{
+    const glm::vec3 center = glm::vec3(worldMatrix * glm::vec4((boundsMin + boundsMax) * 0.5f, 1.0f));
+    const glm::mat3 absMatrix = glm::mat3(glm::abs(glm::vec3(worldMatrix[0])), glm::abs(glm::vec3(worldMatrix[1])), glm::abs(glm::vec3(worldMatrix[2])));
+    const glm::vec3 extents = absMatrix * ((boundsMax - boundsMin) * 0.5f);
+    *worldMin = center - extents;
+    *worldMax = center + extents;
+}
+
+bool IsSphereInFrustum(const glm::vec4 planes[6], const glm::vec4& sphere)
+{
+    for (u32 i = 0; i < 6; ++i)
+    {
+        if (glm::dot(glm::vec3(planes[i]), glm::vec3(sphere)) + planes[i].w < -sphere.w)
+            return false;
+    }
+    return true;
+}
+
+glm::vec4 TransformBoundingSphere(const glm::mat4& worldMatrix, const glm::vec4& sphere)
+{
+    const glm::vec3 center = glm::vec3(worldMatrix * glm::vec4(glm::vec3(sphere), 1.0f));
+    const f32 maxScale = glm::max(glm::length(glm::vec3(worldMatrix[0])),
+                                  glm::max(glm::length(glm::vec3(worldMatrix[1])), glm::length(glm::vec3(worldMatrix[2]))));
+    return glm::vec4(center, sphere.w * maxScale);
+}
@@ -0,0 +1,72 @@
+//
+// culling.h: Visibility tests against the camera frustum on the CPU.
+//
+
+#pragma once
+
+#include "platform.h"
+
+// Spheres tested by each ParallelFor batch. Batches start at multiples of it, so it has to
+// be a multiple of CULLING_SPHERE_PADDING for the SIMD loads to stay within the arrays.
+#define CULLING_BATCH_SIZE     1024
+#define CULLING_SPHERE_PADDING 8    // Widest SIMD width (AVX), the arrays are padded to it
+
+/**
+ * World space bounding spheres in SoA layout, so that the test loads the same component of
+ * several spheres at once. The padding spheres have a negative radius and are never visible.
+ */
+struct CullingSpheres
+{
+    std::vector<f32> centerX;
+    std::vector<f32> centerY;
+    std::vector<f32> centerZ;
+    std::vector<f32> radius;
+    std::vector<u8>  visible; // Written by CullSpheres, 1 if the sphere touches the frustum
+    u32              count;   // Without the padding
+};
+
+/**
+ * Sets the number of spheres and pads the arrays. The spheres have to be written again.
+ */
+void ResizeCullingSpheres(CullingSpheres& spheres, u32 count);
+
+inline void SetCullingSphere(CullingSpheres& spheres, u32 idx, const glm::vec4& sphere)
+{
+    spheres.centerX[idx] = sphere.x;
+    spheres.centerY[idx] = sphere.y;
+    spheres.centerZ[idx] = sphere.z;
+    spheres.radius[idx] = sphere.w;
+}
+
+/**
+ * Tests all the spheres against the planes with SSE, or AVX in builds that enable it, split
+ * in batches with ParallelFor. Returns the number of visible spheres.
+ */
+u32 CullSpheres(const glm::vec4 planes[6], CullingSpheres& spheres);
+
+/**
+ * Extracts the planes of the frustum of a view projection matrix, normalized and with their
+ * normals pointing inside.
+ */
+void ExtractFrustumPlanes(const glm::mat4& viewProjection, glm::vec4 planes[6]);
+
+/**
+ * Returns false if the AABB, transformed by the world matrix, is completely outside of one of the planes.
+ */
+bool IsBoxInFrustum(const glm::vec4 planes[6], const glm::mat4& worldMatrix, const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+
+/**
+ * World space AABB of a model space one.
+ */
+void TransformBoundingBox(const glm::mat4& worldMatrix, const glm::vec3& boundsMin, const glm::vec3& boundsMax, glm::vec3* worldMin, glm::vec3* worldMax);
+
+/**
+ * Scalar version of the test done by CullSpheres.
+ */
+bool IsSphereInFrustum(const glm::vec4 planes[6], const glm::vec4& sphere);
+
+/**
+ * Moves a model space sphere to world space. The radius is scaled by the largest scale of the
+ * matrix, so the sphere still contains the geometry under non uniform scales.
+ */
+glm::vec4 TransformBoundingSphere(const glm::mat4& worldMatrix, const glm::vec4& sphere);
@@ -9,185 +9,1870 @@
 #include <imgui.h>
 #include <stb_image.h>
 #include <stb_image_write.h>
-#include <assimp/cimport.h>
-#include <assimp/scene.h>
-#include <assimp/postprocess.h>
 #include <GLFW/glfw3.h>
+#include <atomic>
 
-GLuint CreateProgramFromSource(String programSource, const char* shaderName)
+// Each stage is built as a separable program, so that it can be shared by all the pipelines that
+// use it. Compiles and links without asking for any status, so that the driver does not have to
+// finish a build before the next one is submitted.
+static GLuint SubmitShaderStageBuild(String source, GLenum stageType, const char* shaderName, const char* defines, GLuint* shaderHandle)
+{
+    char versionString[] = "#version 430\n";
+    char shaderNameDefine[128];
+    sprintf(shaderNameDefine, "#define %s\n", shaderName);
+    const char* stageDefine = stageType == GL_VERTEX_SHADER ? "#define VERTEX\n" :
+                              stageType == GL_COMPUTE_SHADER ? "#define COMPUTE\n" : "#define FRAGMENT\n";
+
+    const GLchar* shaderSource[] = {
+        versionString,
+        shaderNameDefine,
+        defines,
+        stageDefine,
+        source.str
+    };
+    const GLint shaderLengths[] = {
+        (GLint) strlen(versionString),
+        (GLint) strlen(shaderNameDefine),
+        (GLint) strlen(defines),
+        (GLint) strlen(stageDefine),
+        (GLint) source.len
+    };
+
+    *shaderHandle = glCreateShader(stageType);
+    glShaderSource(*shaderHandle, ARRAY_COUNT(shaderSource), shaderSource, shaderLengths);
+    glCompileShader(*shaderHandle);
+
+    GLuint programHandle = glCreateProgram();
+    glProgramParameteri(programHandle, GL_PROGRAM_SEPARABLE, GL_TRUE);
+    glProgramParameteri(programHandle, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glAttachShader(programHandle, *shaderHandle);
+    glLinkProgram(programHandle);
+
+    return programHandle;
+}
+
+// Waits for the build if it is not done yet, and reports its errors. Returns false if it failed.
+static bool FinishShaderStageBuild(GLuint programHandle, GLuint shaderHandle, GLenum stageType, const char* shaderName)
 {
     GLchar  infoLogBuffer[1024] = {};
     GLsizei infoLogBufferSize = sizeof(infoLogBuffer);
     GLsizei infoLogSize;
     GLint   success;
-    
-    char versionString[] = "#version 430\n";
-    char shaderNameDefine[128];
-    sprintf(shaderNameDefine, "#define %s\n", shaderName);
-    char vertexShaderDefine[] = "#define VERTEX\n";
-    char fragmentShaderDefine[] = "#define FRAGMENT\n";
 
-    const GLchar* vertexShaderSource[] = {
-        versionString,
-        shaderNameDefine,
-        vertexShaderDefine,
-        programSource.str
-    };
-    const GLint vertexShaderLengths[] = {
-        (GLint) strlen(versionString),
-        (GLint) strlen(shaderNameDefine),
-        (GLint) strlen(vertexShaderDefine),
-        (GLint) programSource.len
-    };
-    const GLchar* fragmentShaderSource[] = {
-        versionString,
-        shaderNameDefine,
-        fragmentShaderDefine,
-        programSource.str
-    };
-    const GLint fragmentShaderLengths[] = {
-        (GLint) strlen(versionString),
-        (GLint) strlen(shaderNameDefine),
-        (GLint) strlen(fragmentShaderDefine),
-        (GLint) programSource.len
-    };
+    const char* stageName = stageType == GL_VERTEX_SHADER ? "vertex" : stageType == GL_COMPUTE_SHADER ? "compute" : "fragment";
+
+    glGetShaderiv(shaderHandle, GL_COMPILE_STATUS, &success);
+    if (!success)
+    {
+        glGetShaderInfoLog(shaderHandle, infoLogBufferSize, &infoLogSize, infoLogBuffer);
+        ELOG("glCompileShader() failed with %s shader %s\nReported message:\n%s\n", stageName, shaderName, infoLogBuffer);
+    }
+
+    GLint linked;
+    glGetProgramiv(programHandle, GL_LINK_STATUS, &linked);
+    if (!linked)
+    {
+        glGetProgramInfoLog(programHandle, infoLogBufferSize, &infoLogSize, infoLogBuffer);
+        ELOG("glLinkProgram() failed with %s shader %s\nReported message:\n%s\n", stageName, shaderName, infoLogBuffer);
+    }
+
+    glDetachShader(programHandle, shaderHandle);
+    glDeleteShader(shaderHandle);
+
+    return linked;
+}
+
+static bool PreprocessShaderFile(const std::string& filepath, u32 depth, std::string* source, std::vector<std::string>* dependencies)
+{
+    if (depth > SHADER_MAX_INCLUDE_DEPTH)
+    {
+        ELOG("Too many nested includes reading shader file %s", filepath.c_str());
+        return false;
+    }
+
+    // Its index is the source string number of the #line directives, which compilers show in errors
+    u32 fileIdx = 0;
+    const std::string normalizedPath = NormalizeAssetPath(filepath.c_str());
+    while (fileIdx < dependencies->size() && NormalizeAssetPath((*dependencies)[fileIdx].c_str()) != normalizedPath) fileIdx++;
+    if (fileIdx == dependencies->size())
+        dependencies->push_back(filepath);
+
+    MappedFile file = MapFile(filepath.c_str());
+    if (!file.data)
+    {
+        ELOG("Could not read shader file %s", filepath.c_str());
+        return false;
+    }
+
+    const size_t separator = filepath.find_last_of('/');
+    const std::string directory = separator == std::string::npos ? std::string() : filepath.substr(0, separator + 1);
+
+    char lineDirective[64];
+    snprintf(lineDirective, sizeof(lineDirective), "#line 1 %u\n", fileIdx);
+    source->append(lineDirective);
+
+    bool success = true;
+    const char* ptr = (const char*)file.data;
+    const char* end = ptr + file.size;
+    for (u32 lineNumber = 1; ptr < end && success; ++lineNumber)
+    {
+        const char* lineEnd = ptr;
+        while (lineEnd < end && *lineEnd != '\n') lineEnd++;
+
+        const char* token = ptr;
+        while (token < lineEnd && (*token == ' ' || *token == '\t')) token++;
+
+        if (lineEnd - token > 8 && strncmp(token, "#include", 8) == 0)
+        {
+            const char* nameBegin = token + 8;
+            while (nameBegin < lineEnd && (*nameBegin == ' ' || *nameBegin == '\t')) nameBegin++;
+            const char closing = nameBegin < lineEnd && *nameBegin == '<' ? '>' : '"';
+            const char* nameEnd = nameBegin + 1;
+            while (nameEnd < lineEnd && *nameEnd != closing) nameEnd++;
+
+            if (nameBegin >= lineEnd || (*nameBegin != '"' && *nameBegin != '<') || nameEnd >= lineEnd)
+            {
+                ELOG("%s(%u): malformed #include", filepath.c_str(), lineNumber);
+                success = false;
+                break;
+            }
+
+            // Files are included every time, so headers need include guards like in C
+            success = PreprocessShaderFile(directory + std::string(nameBegin + 1, nameEnd), depth + 1, source, dependencies);
+
+            snprintf(lineDirective, sizeof(lineDirective), "#line %u %u\n", lineNumber + 1, fileIdx);
+            source->append(lineDirective);
+        }
+        else
+        {
+            source->append(ptr, lineEnd - ptr);
+            source->push_back('\n');
+        }
+
+        ptr = lineEnd + 1;
+    }
+
+    UnmapFile(file);
+    return success;
+}
+
+bool PreprocessShader(const char* filepath, std::string* source, std::vector<std::string>* dependencies)
+{
+    source->clear();
+    dependencies->clear();
+    return PreprocessShaderFile(filepath, 0, source, dependencies);
+}
+
+static u64 GetShaderStageBinaryKey(String stageSource, GLenum stageType, const char* shaderName, const char* defines)
+{
+    const u64 settings[] = { PROGRAM_BINARY_VERSION, stageType };
+    u64 key = HashBytes(settings, sizeof(settings), 0);
+    key = HashBytes(stageSource.str, stageSource.len, key);
+    key = HashBytes(shaderName, strlen(shaderName), key);
+    key = HashBytes(defines, strlen(defines), key);
+
+    const GLenum driverStrings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+    for (u32 i = 0; i < ARRAY_COUNT(driverStrings); ++i)
+    {
+        const char* driverString = (const char*)glGetString(driverStrings[i]);
+        if (driverString)
+            key = HashBytes(driverString, strlen(driverString), key);
+    }
+    return key;
+}
+
+static void GetProgramBinaryPath(u64 key, char* path, u32 pathSize)
+{
+    snprintf(path, pathSize, "%s/%016llx.glprog", ASSET_CACHE_DIRECTORY, (unsigned long long)key);
+}
+
+// Returns 0 if there is no binary for the key, or if the driver does not accept it
+static GLuint LoadProgramBinary(const char* path, u64 key, bool* isRejected)
+{
+    *isRejected = false;
+
+    MappedFile file = MapFile(path);
+    if (!file.data)
+        return 0;
+
+    GLuint programHandle = 0;
+    const ProgramBinaryHeader* header = (const ProgramBinaryHeader*)file.data;
+    if (file.size >= sizeof(ProgramBinaryHeader) &&
+        header->magic == PROGRAM_BINARY_MAGIC && header->version == PROGRAM_BINARY_VERSION && header->key == key &&
+        header->binarySize <= file.size - sizeof(ProgramBinaryHeader))
+    {
+        programHandle = glCreateProgram();
+        glProgramParameteri(programHandle, GL_PROGRAM_SEPARABLE, GL_TRUE);
+        glProgramBinary(programHandle, header->binaryFormat, (const u8*)file.data + sizeof(ProgramBinaryHeader), header->binarySize);
+
+        GLint success;
+        glGetProgramiv(programHandle, GL_LINK_STATUS, &success);
+        if (!success)
+        {
+            glDeleteProgram(programHandle);
+            programHandle = 0;
+        }
+    }
+
+    if (!programHandle)
+    {
+        ELOG("Program binary %s was rejected, compiling from source", path);
+        *isRejected = true;
+    }
+
+    UnmapFile(file);
+    return programHandle;
+}
+
+static bool SaveProgramBinary(GLuint programHandle, const char* path, u64 key)
+{
+    GLint binarySize = 0;
+    glGetProgramiv(programHandle, GL_PROGRAM_BINARY_LENGTH, &binarySize);
+    if (binarySize <= 0)
+        return false;
+
+    std::vector<u8> binary(binarySize);
+    GLenum binaryFormat;
+    glGetProgramBinary(programHandle, binarySize, &binarySize, &binaryFormat, binary.data());
+
+    FILE* file = fopen(path, "wb");
+    if (!file)
+    {
+        ELOG("fopen() failed writing file %s", path);
+        return false;
+    }
+
+    ProgramBinaryHeader header = {};
+    header.magic = PROGRAM_BINARY_MAGIC;
+    header.version = PROGRAM_BINARY_VERSION;
+    header.key = key;
+    header.binaryFormat = binaryFormat;
+    header.binarySize = binarySize;
+
+    const bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                         fwrite(binary.data(), binarySize, 1, file) == 1;
+    fclose(file);
+    if (!written)
+    {
+        ELOG("fwrite() failed writing file %s", path);
+        remove(path);
+    }
+    return written;
+}
+
+// Shaders used while the real programs are still building. They share the attribute locations,
+// the uniform blocks and the texture uniform names of the programs they stand in for.
+static const char* FallbackProgramSource = R"(
+#ifdef FALLBACK_MESH
+
+#if defined(VERTEX)
+layout(location = 0) in vec3 aPosition;
+layout(location = 5) in uvec2 aDrawParams;
+layout(binding = 0, std140) uniform GlobalParams
+{
+    mat4 uView;
+    mat4 uProjection;
+    vec3 uCameraPosition;
+    uint uLightCount;
+};
+layout(binding = 1, std430) readonly buffer WorldMatrices
+{
+    mat4 uWorldMatrices[];
+};
+out gl_PerVertex { vec4 gl_Position; };
+invariant gl_Position;
+void main()
+{
+    // As in mesh_vertex.glsl, so that the forward pass still matches the depth pre-pass with GL_EQUAL
+    vec3 position = vec3(uWorldMatrices[aDrawParams.x + gl_InstanceID] * vec4(aPosition, 1.0));
+    gl_Position = uProjection * uView * vec4(position, 1.0);
+}
+#elif defined(FRAGMENT)
+layout(location = 0) out vec4 rt0;
+layout(location = 1) out vec4 rt1;
+layout(location = 2) out vec4 rt2;
+layout(location = 3) out vec4 rt3;
+void main()
+{
+    rt0 = vec4(0.5, 0.5, 0.5, 1.0);
+    rt1 = vec4(0.0, 0.0, 1.0, 1.0);
+    rt2 = vec4(0.0, 0.0, 0.0, 1.0);
+    rt3 = rt0;
+}
+#endif
+
+#elif defined(FALLBACK_QUAD)
+
+#if defined(VERTEX)
+layout(location = 0) in vec3 aPosition;
+layout(location = 1) in vec2 aTexCoord;
+out vec2 vTexCoord;
+out gl_PerVertex { vec4 gl_Position; };
+void main()
+{
+    vTexCoord = aTexCoord;
+    gl_Position = vec4(aPosition, 1.0);
+}
+#elif defined(FRAGMENT)
+in vec2 vTexCoord;
+uniform sampler2D uColor;
+layout(location = 0) out vec4 oColor;
+void main()
+{
+    oColor = texture(uColor, vTexCoord);
+}
+#endif
+
+#endif
+)";
+
+// glMaxShaderCompilerThreadsKHR is not in the 4.3 core profile that glad loads
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+typedef void (APIENTRYP PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)(GLuint count);
+
+static GLbitfield GetShaderStageBit(GLenum stageType)
+{
+    return stageType == GL_VERTEX_SHADER ? GL_VERTEX_SHADER_BIT :
+           stageType == GL_COMPUTE_SHADER ? GL_COMPUTE_SHADER_BIT : GL_FRAGMENT_SHADER_BIT;
+}
+
+// Preprocesses the source of a stage, and then loads it from the binary cache or submits its build.
+// Stages without a file are the fallbacks, built from FallbackProgramSource.
+static void BuildShaderStage(App* app, ShaderStage& stage)
+{
+    const f64 startTime = glfwGetTime();
+
+    // The new program may reuse the name of a deleted one, whose uniform values are still cached
+    app->glState.uniformValues.clear();
+
+    std::string source;
+    if (stage.filepath.empty())
+    {
+        source = FallbackProgramSource;
+    }
+    else
+    {
+        const bool isPreprocessed = PreprocessShader(stage.filepath.c_str(), &source, &stage.dependencies);
+
+        // Taken even if preprocessing failed, so that fixing the error reloads the stage
+        stage.dependencyTimestamps.resize(stage.dependencies.size());
+        for (u32 i = 0; i < stage.dependencies.size(); ++i)
+            stage.dependencyTimestamps[i] = GetFileLastWriteTimestamp(stage.dependencies[i].c_str());
+
+        if (!isPreprocessed)
+        {
+            stage.handle = 0;
+            stage.buildState = PROGRAM_FAILED;
+            return;
+        }
+    }
+
+    ProgramCacheStats& stats = app->programCache;
+    String stageSource = { (char*)source.c_str(), (u32)source.size() };
+    char binaryPath[512];
+    stage.binaryKey = GetShaderStageBinaryKey(stageSource, stage.type, stage.shaderName.c_str(), stage.defines.c_str());
+    GetProgramBinaryPath(stage.binaryKey, binaryPath, sizeof(binaryPath));
+
+    stage.handle = 0;
+    if (stats.isSupported)
+    {
+        bool isRejected;
+        stage.handle = LoadProgramBinary(binaryPath, stage.binaryKey, &isRejected);
+        stats.rejectedCount += isRejected ? 1 : 0;
+    }
+
+    if (stage.handle)
+    {
+        stage.buildState = PROGRAM_READY;
+        stats.binaryHits++;
+    }
+    else
+    {
+        ProgramBuildQueue& builds = app->programBuilds;
+        if (builds.pendingCount++ == 0)
+            builds.submitTime = startTime;
+
+        stage.handle = SubmitShaderStageBuild(stageSource, stage.type, stage.shaderName.c_str(), stage.defines.c_str(), &stage.shaderHandle);
+        stage.buildState = PROGRAM_BUILDING;
+        stats.compiledCount++;
+    }
+
+    stats.loadTime += glfwGetTime() - startTime;
+}
+
+static void FinishShaderStage(App* app, ShaderStage& stage)
+{
+    const bool linked = FinishShaderStageBuild(stage.handle, stage.shaderHandle, stage.type, stage.shaderName.c_str());
+    stage.shaderHandle = 0;
+    stage.buildState = linked ? PROGRAM_READY : PROGRAM_FAILED;
+
+    if (!linked)
+    {
+        for (u32 i = 0; i < stage.dependencies.size(); ++i)
+            ELOG("    source string %u is %s", i, stage.dependencies[i].c_str());
+    }
+    else if (app->programCache.isSupported)
+    {
+        char binaryPath[512];
+        GetProgramBinaryPath(stage.binaryKey, binaryPath, sizeof(binaryPath));
+        SaveProgramBinary(stage.handle, binaryPath, stage.binaryKey);
+    }
+
+    ProgramBuildQueue& builds = app->programBuilds;
+    if (--builds.pendingCount == 0)
+    {
+        builds.readyTime = glfwGetTime() - builds.submitTime;
+        ILOG("All shader stages built %.2f ms after the first submission", builds.readyTime * 1000.0);
+    }
+}
+
+static bool IsShaderStageReady(App* app, ShaderStage& stage)
+{
+    if (stage.buildState == PROGRAM_BUILDING)
+    {
+        GLint isComplete = GL_TRUE;
+        if (app->programBuilds.hasParallelCompile)
+            glGetProgramiv(stage.handle, GL_COMPLETION_STATUS_KHR, &isComplete);
+        if (isComplete)
+            FinishShaderStage(app, stage);
+    }
+    return stage.buildState == PROGRAM_READY;
+}
+
+// Returns the stage built from the same file, name and defines if there is one, so that all the
+// pipelines that use it share it, and builds a new one otherwise
+static u32 FindShaderStage(App* app, GLenum stageType, const std::string& filepath, const std::string& shaderName, const std::string& defines)
+{
+    for (u32 i = 0; i < app->shaderStages.size(); ++i)
+    {
+        const ShaderStage& stage = app->shaderStages[i];
+        if (stage.type == stageType && stage.filepath == filepath && stage.shaderName == shaderName && stage.defines == defines)
+            return i;
+    }
+
+    ShaderStage stage = {};
+    stage.type = stageType;
+    stage.filepath = filepath;
+    stage.shaderName = shaderName;
+    stage.defines = defines;
+    app->shaderStages.push_back(stage);
+
+    BuildShaderStage(app, app->shaderStages.back());
+
+    return (u32)app->shaderStages.size() - 1;
+}
+
+static u32 AddProgram(App* app, const u32 stageIndices[PROGRAM_STAGE_COUNT], u32 fallbackProgramIdx)
+{
+    const ShaderStage& fragmentStage = app->shaderStages[stageIndices[PROGRAM_STAGE_FRAGMENT]];
+
+    Program program = {};
+    glGenProgramPipelines(1, &program.handle);
+    program.filepath = fragmentStage.filepath;
+    program.programName = fragmentStage.shaderName;
+    program.lastWriteTimestamp = fragmentStage.filepath.empty() ? 0 : GetFileLastWriteTimestamp(fragmentStage.filepath.c_str());
+    for (u32 i = 0; i < PROGRAM_STAGE_COUNT; ++i)
+        program.stageIndices[i] = stageIndices[i];
+    program.fallbackProgramIdx = fallbackProgramIdx;
+    app->programs.push_back(program);
+
+    return app->programs.size() - 1;
+}
+
+void InitProgramBuilds(App* app)
+{
+    ProgramBuildQueue& builds = app->programBuilds;
+
+    PFNGLMAXSHADERCOMPILERTHREADSKHRPROC maxShaderCompilerThreads = NULL;
+    if (glfwExtensionSupported("GL_KHR_parallel_shader_compile"))
+        maxShaderCompilerThreads = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)glfwGetProcAddress("glMaxShaderCompilerThreadsKHR");
+    else if (glfwExtensionSupported("GL_ARB_parallel_shader_compile"))
+        maxShaderCompilerThreads = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)glfwGetProcAddress("glMaxShaderCompilerThreadsARB");
+
+    if (maxShaderCompilerThreads)
+    {
+        maxShaderCompilerThreads(0xFFFFFFFF); // As many as the driver wants
+        builds.hasParallelCompile = true;
+    }
+    else
+    {
+        ILOG("GL_KHR_parallel_shader_compile is not available, programs will finish building when first used");
+    }
+
+    GLint programBinaryFormatCount = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &programBinaryFormatCount);
+    app->programCache.isSupported = programBinaryFormatCount > 0;
+
+    // The fallbacks are needed from the first frame, so they are built right away
+    const char* fallbackNames[] = { "FALLBACK_MESH", "FALLBACK_QUAD" };
+    u32* fallbackIndices[] = { &app->fallbackMeshProgramIdx, &app->fallbackQuadProgramIdx };
+    for (u32 i = 0; i < ARRAY_COUNT(fallbackNames); ++i)
+    {
+        u32 stageIndices[PROGRAM_STAGE_COUNT];
+        stageIndices[PROGRAM_STAGE_VERTEX] = FindShaderStage(app, GL_VERTEX_SHADER, std::string(), fallbackNames[i], std::string());
+        stageIndices[PROGRAM_STAGE_FRAGMENT] = FindShaderStage(app, GL_FRAGMENT_SHADER, std::string(), fallbackNames[i], std::string());
+        for (u32 stageIdx : stageIndices)
+        {
+            if (app->shaderStages[stageIdx].buildState == PROGRAM_BUILDING)
+                FinishShaderStage(app, app->shaderStages[stageIdx]);
+        }
+
+        *fallbackIndices[i] = AddProgram(app, stageIndices, UINT32_MAX);
+    }
+}
+
+u32 LoadProgram(App* app, const char* vertexFilepath, const char* vertexName, const char* fragmentFilepath, const char* fragmentName, u32 fallbackProgramIdx)
+{
+    u32 stageIndices[PROGRAM_STAGE_COUNT];
+    stageIndices[PROGRAM_STAGE_VERTEX] = FindShaderStage(app, GL_VERTEX_SHADER, vertexFilepath, vertexName, std::string());
+    stageIndices[PROGRAM_STAGE_FRAGMENT] = FindShaderStage(app, GL_FRAGMENT_SHADER, fragmentFilepath, fragmentName, std::string());
+    return AddProgram(app, stageIndices, fallbackProgramIdx);
+}
+
+u32 GetProgramPermutation(App* app, u32 programIdx, u32 permutationKey)
+{
+    const u64 mapKey = ((u64)programIdx << 32) | permutationKey;
+    auto it = app->programPermutations.find(mapKey);
+    if (it != app->programPermutations.end())
+        return it->second;
+
+    // The vertex stage only depends on the features that change its outputs, so permutations that
+    // differ in anything else share it
+    const char* featureDefines[SHADER_FEATURE_COUNT] = { "HAS_ALBEDO_TEX", "NORMAL_MAP" };
+    std::string vertexDefines;
+    std::string fragmentDefines;
+    for (u32 i = 0; i < SHADER_FEATURE_COUNT; ++i)
+    {
+        if (!(permutationKey & (1 << i)))
+            continue;
+        fragmentDefines += std::string("#define ") + featureDefines[i] + "\n";
+        if (SHADER_VERTEX_FEATURES & (1 << i))
+            vertexDefines += std::string("#define ") + featureDefines[i] + "\n";
+    }
+    fragmentDefines += "#define LIGHT_COUNT " + std::to_string(permutationKey >> 16) + "\n";
+
+    // Copied, as adding the stages can move them
+    const Program& program = app->programs[programIdx];
+    const ShaderStage vertexStage = app->shaderStages[program.stageIndices[PROGRAM_STAGE_VERTEX]];
+    const ShaderStage fragmentStage = app->shaderStages[program.stageIndices[PROGRAM_STAGE_FRAGMENT]];
+    const u32 fallbackProgramIdx = program.fallbackProgramIdx;
+
+    u32 stageIndices[PROGRAM_STAGE_COUNT];
+    stageIndices[PROGRAM_STAGE_VERTEX] = FindShaderStage(app, GL_VERTEX_SHADER, vertexStage.filepath, vertexStage.shaderName, vertexDefines);
+    stageIndices[PROGRAM_STAGE_FRAGMENT] = FindShaderStage(app, GL_FRAGMENT_SHADER, fragmentStage.filepath, fragmentStage.shaderName, fragmentDefines);
+
+    const u32 permutationIdx = AddProgram(app, stageIndices, fallbackProgramIdx);
+    app->programPermutations[mapKey] = permutationIdx;
+    return permutationIdx;
+}
+
+void HotReloadPrograms(App* app)
+{
+    ProgramBuildQueue& builds = app->programBuilds;
+    const f64 now = glfwGetTime();
+    if (now - builds.lastReloadCheckTime < PROGRAM_RELOAD_INTERVAL)
+        return;
+    builds.lastReloadCheckTime = now;
+
+    for (u32 stageIdx = 0; stageIdx < app->shaderStages.size(); ++stageIdx)
+    {
+        ShaderStage& stage = app->shaderStages[stageIdx];
+        if (stage.filepath.empty() || stage.buildState == PROGRAM_BUILDING)
+            continue;
+
+        bool isOutdated = false;
+        for (u32 i = 0; i < stage.dependencies.size() && !isOutdated; ++i)
+            isOutdated = GetFileLastWriteTimestamp(stage.dependencies[i].c_str()) != stage.dependencyTimestamps[i];
+        if (!isOutdated)
+            continue;
+
+        ILOG("Reloading shader stage %s from %s", stage.shaderName.c_str(), stage.filepath.c_str());
+
+        // Detached from the pipelines that use it, which attach it again in GetProgram once it is built
+        for (Program& program : app->programs)
+        {
+            for (u32 i = 0; i < PROGRAM_STAGE_COUNT; ++i)
+            {
+                if (program.stageIndices[i] == stageIdx && program.attachedStageHandles[i])
+                {
+                    glUseProgramStages(program.handle, GetShaderStageBit(stage.type), 0);
+                    program.attachedStageHandles[i] = 0;
+                }
+            }
+        }
+
+        // The compute pipelines attach their stage themselves, and compare the handle to know when
+        // to. The rebuilt stage usually gets the name of the deleted one back, so they are reset too
+        GpuCulling& culling = app->gpuCulling;
+        if (stageIdx == culling.stageIdx && culling.attachedStageHandle)
+        {
+            glUseProgramStages(culling.pipeline, GL_COMPUTE_SHADER_BIT, 0);
+            culling.attachedStageHandle = 0;
+        }
+        HiZPyramid& hiZ = app->hiZ;
+        if (stageIdx == hiZ.stageIdx && hiZ.attachedStageHandle)
+        {
+            glUseProgramStages(hiZ.pipeline, GL_COMPUTE_SHADER_BIT, 0);
+            hiZ.attachedStageHandle = 0;
+        }
+
+        if (stage.handle)
+            glDeleteProgram(stage.handle);
+        BuildShaderStage(app, stage);
+        builds.reloadCount++;
+    }
+}
+
+Program& GetProgram(App* app, u32 programIdx)
+{
+    Program& program = app->programs[programIdx];
+
+    bool isReady = true;
+    bool isAttached = false;
+    for (u32 i = 0; i < PROGRAM_STAGE_COUNT; ++i)
+    {
+        ShaderStage& stage = app->shaderStages[program.stageIndices[i]];
+        if (!IsShaderStageReady(app, stage))
+        {
+            isReady = false;
+            continue;
+        }
+
+        if (program.attachedStageHandles[i] != stage.handle)
+        {
+            glUseProgramStages(program.handle, GetShaderStageBit(stage.type), stage.handle);
+            program.attachedStageHandles[i] = stage.handle;
+            if (i == PROGRAM_STAGE_VERTEX)
+                LoadProgramAttributes(program);
+            isAttached = true;
+        }
+    }
+
+    if (isAttached)
+        ReflectProgramUniforms(program);
+
+    if (!isReady && program.fallbackProgramIdx != UINT32_MAX)
+        return GetProgram(app, program.fallbackProgramIdx);
+    return program;
+}
+
+// For programs without a fallback, which can not be drawn with until then
+static bool IsProgramReady(App* app, u32 programIdx)
+{
+    const Program& program = app->programs[programIdx];
+    for (u32 i = 0; i < PROGRAM_STAGE_COUNT; ++i)
+    {
+        if (!IsShaderStageReady(app, app->shaderStages[program.stageIndices[i]]))
+            return false;
+    }
+    return true;
+}
+
+void BenchmarkProgramCache(App* app)
+{
+    ProgramCacheStats& stats = app->programCache;
+    stats.benchmarkCompileTime = 0.0;
+    stats.benchmarkBinaryTime = 0.0;
+
+    u32 stageCount = 0;
+    for (const ShaderStage& stage : app->shaderStages)
+    {
+        if (stage.filepath.empty())
+            continue; // Fallbacks are built from memory
+
+        std::string source;
+        std::vector<std::string> dependencies;
+        if (!PreprocessShader(stage.filepath.c_str(), &source, &dependencies))
+            continue;
+        String stageSource = { (char*)source.c_str(), (u32)source.size() };
+
+        f64 start = glfwGetTime();
+        GLuint shaderHandle;
+        GLuint compiledHandle = SubmitShaderStageBuild(stageSource, stage.type, stage.shaderName.c_str(), stage.defines.c_str(), &shaderHandle);
+        FinishShaderStageBuild(compiledHandle, shaderHandle, stage.type, stage.shaderName.c_str());
+        glFinish();
+        stats.benchmarkCompileTime += glfwGetTime() - start;
+
+        // Going through the file, as BuildShaderStage does on a warm start
+        char binaryPath[512];
+        const u64 key = GetShaderStageBinaryKey(stageSource, stage.type, stage.shaderName.c_str(), stage.defines.c_str());
+        GetProgramBinaryPath(key, binaryPath, sizeof(binaryPath));
+        stageCount++;
+        if (stats.isSupported && SaveProgramBinary(compiledHandle, binaryPath, key))
+        {
+            bool isRejected;
+            start = glfwGetTime();
+            GLuint binaryHandle = LoadProgramBinary(binaryPath, key, &isRejected);
+            glFinish();
+            stats.benchmarkBinaryTime += glfwGetTime() - start;
+            glDeleteProgram(binaryHandle);
+        }
+
+        glDeleteProgram(compiledHandle);
+    }
+
+    ILOG("Program cache benchmark (%u shader stages)", stageCount);
+    ILOG("    from source: %.2f ms", stats.benchmarkCompileTime * 1000.0);
+    ILOG("    from binary: %.2f ms", stats.benchmarkBinaryTime * 1000.0);
+}
+
+Image LoadImage(const char* filename)
+{
+    Image img = {};
+
+    // Prefer the cooked version of the image from the import cache, which stores all
+    // the mip levels and decodes much faster than a PNG. Missing entries are cooked.
+    char cachePath[512];
+    if (GetImageCachePath(filename, cachePath, sizeof(cachePath)))
+    {
+        if (LoadCookedImage(cachePath, &img))
+        {
+            return img;
+        }
+        if (CookImage(filename, cachePath) && LoadCookedImage(cachePath, &img))
+        {
+            return img;
+        }
+    }
+
+    // Without a cache the mips are generated here, so the layer is uploaded with all of them
+    if (!DecodeImageMipChain(filename, &img))
+    {
+        ELOG("Could not open file %s", filename);
+    }
+    return img;
+}
+
+void FreeImage(Image image)
+{
+    if (image.ownsMallocPixels)
+        free(image.pixels);
+    else
+        stbi_image_free(image.pixels);
+}
+
+void AllocateTextureArrayLayer(App* app, const Image& image, Texture& texture)
+{
+    // RGB images are expanded to RGBA8 on upload so that they share pages with RGBA ones
+    const GLenum internalFormat = GL_RGBA8;
+    const u32 mipCount = GetMipCount(image.size.x, image.size.y);
+
+    u32 arrayIdx = UINT32_MAX;
+    for (u32 i = 0; i < app->textureArrays.size(); ++i)
+    {
+        const TextureArray& page = app->textureArrays[i];
+        if (page.size == image.size && page.internalFormat == internalFormat &&
+            page.layerCount < TEXTURE_ARRAY_PAGE_MAX_LAYERS)
+        {
+            arrayIdx = i;
+            break;
+        }
+    }
+
+    if (arrayIdx == UINT32_MAX)
+    {
+        TextureArray page = {};
+        page.size = image.size;
+        page.internalFormat = internalFormat;
+        page.mipCount = mipCount;
+
+        arrayIdx = (u32)app->textureArrays.size();
+        app->textureArrays.push_back(page);
+    }
+
+    TextureArray& page = app->textureArrays[arrayIdx];
+    if (page.layerCount == page.layerCapacity)
+    {
+        const u32 newCapacity = page.layerCapacity == 0 ? TEXTURE_ARRAY_PAGE_INITIAL_LAYERS : page.layerCapacity * 2;
+
+        GLuint newHandle;
+        glGenTextures(1, &newHandle);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, newHandle);
+        glTexStorage3D(GL_TEXTURE_2D_ARRAY, page.mipCount, internalFormat, page.size.x, page.size.y, newCapacity);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+        // Immutable storage can not grow, so the layers already in use are copied to the new page
+        if (page.handle)
+        {
+            i32 width = page.size.x;
+            i32 height = page.size.y;
+            for (u32 i = 0; i < page.mipCount; ++i)
+            {
+                glCopyImageSubData(page.handle, GL_TEXTURE_2D_ARRAY, i, 0, 0, 0,
+                                   newHandle, GL_TEXTURE_2D_ARRAY, i, 0, 0, 0,
+                                   width, height, page.layerCount);
+                width = width > 1 ? width / 2 : 1;
+                height = height > 1 ? height / 2 : 1;
+            }
+            glDeleteTextures(1, &page.handle);
+
+            for (u32 i = 0; i < app->textures.size(); ++i)
+                if (app->textures[i].arrayIdx == arrayIdx)
+                    app->textures[i].handle = newHandle;
+        }
+
+        page.handle = newHandle;
+        page.layerCapacity = newCapacity;
+    }
+
+    const u32 layer = page.layerCount++;
+
+    QueueTextureLayerUpload(app, image, arrayIdx, layer);
+
+    texture.handle = page.handle;
+    texture.arrayIdx = arrayIdx;
+    texture.layer = layer;
+}
+
+u32 LoadTexture2D(App* app, const char* filepath)
+{
+    for (u32 texIdx = 0; texIdx < app->textures.size(); ++texIdx)
+        if (app->textures[texIdx].filepath == filepath)
+            return texIdx;
+
+    Image image = LoadImage(filepath);
+
+    // Pages are RGBA8 and uploads read 3 or 4 bytes per pixel, anything else would overrun them
+    if (image.pixels && image.nchannels != 3 && image.nchannels != 4)
+    {
+        ELOG("LoadTexture2D() - Unsupported number of channels in %s", filepath);
+        FreeImage(image);
+        image.pixels = NULL;
+    }
+
+    if (image.pixels)
+    {
+        // The upload queue frees the image once its pixels are on the GPU
+        Texture tex = {};
+        AllocateTextureArrayLayer(app, image, tex);
+        tex.filepath = filepath;
+
+        u32 texIdx = app->textures.size();
+        app->textures.push_back(tex);
+
+        return texIdx;
+    }
+    else
+    {
+        return UINT32_MAX;
+    }
+}
+
+void BenchmarkImageDecode(App* app)
+{
+    const u32 iterations = 10;
+
+    f64 stbTime = 0.0;
+    f64 stbBytes = 0.0;
+    f64 cookedTime = 0.0;
+    f64 cookedBytes = 0.0;
+
+    for (u32 texIdx = 0; texIdx < app->textures.size(); ++texIdx)
+    {
+        const char* filepath = app->textures[texIdx].filepath.c_str();
+        char cookedPath[512];
+        if (!GetImageCachePath(filepath, cookedPath, sizeof(cookedPath)))
+            continue;
+
+        for (u32 i = 0; i < iterations; ++i)
+        {
+            // Both paths end with the whole mip chain in memory, as LoadImage needs it
+            Image decoded = {};
+            f64 start = glfwGetTime();
+            const bool isDecoded = DecodeImageMipChain(filepath, &decoded);
+            const f64 decodeTime = glfwGetTime() - start;
+
+            Image cooked = {};
+            start = glfwGetTime();
+            const bool isCookedLoaded = LoadCookedImage(cookedPath, &cooked);
+            const f64 cookedLoadTime = glfwGetTime() - start;
+
+            // Only iterations where both succeeded are counted, so they cover the same images
+            if (isDecoded && isCookedLoaded)
+            {
+                stbTime += decodeTime;
+                stbBytes += (f64)GetMipChainSize(decoded.size.x, decoded.size.y, decoded.nchannels, decoded.mipCount);
+                cookedTime += cookedLoadTime;
+                cookedBytes += (f64)GetMipChainSize(cooked.size.x, cooked.size.y, cooked.nchannels, cooked.mipCount);
+            }
+            if (isDecoded) FreeImage(decoded);
+            if (isCookedLoaded) FreeImage(cooked);
+            if (!isDecoded || !isCookedLoaded) break;
+        }
+    }
+
+    app->stbDecodeThroughput = stbTime > 0.0 ? stbBytes / MB(1) / stbTime : 0.0;
+    app->cookedDecodeThroughput = cookedTime > 0.0 ? cookedBytes / MB(1) / cookedTime : 0.0;
+
+    ILOG("Image decode benchmark (%u textures x %u iterations)", (u32)app->textures.size(), iterations);
+    ILOG("    stb_image + mips: %.1f MB/s (%.2f ms)", app->stbDecodeThroughput, stbTime * 1000.0);
+    ILOG("    cooked:           %.1f MB/s (%.2f ms)", app->cookedDecodeThroughput, cookedTime * 1000.0);
+}
+
+///////////////////////////////////////////////////////////////////////
+// GPU uploads
+
+// glBufferStorage is core in OpenGL 4.4, but the context and glad only go up to 4.3
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#define GL_MAP_COHERENT_BIT   0x0080
+typedef void (APIENTRYP PFNGLBUFFERSTORAGEPROC)(GLenum target, GLsizeiptr size, const void* data, GLbitfield flags);
+
+// Returns NULL if persistently mapped buffers are not available
+static PFNGLBUFFERSTORAGEPROC LoadBufferStorage()
+{
+    if (glfwExtensionSupported("GL_ARB_buffer_storage"))
+        return (PFNGLBUFFERSTORAGEPROC)glfwGetProcAddress("glBufferStorage");
+    return NULL;
+}
+
+void InitUploadQueue(App* app)
+{
+    UploadQueue& uploads = app->uploads;
+    uploads.budgetMB = UPLOAD_DEFAULT_BUDGET_MB;
+
+    PFNGLBUFFERSTORAGEPROC bufferStorage = LoadBufferStorage();
+
+    glGenBuffers(1, &uploads.ringHandle);
+    glBindBuffer(GL_COPY_READ_BUFFER, uploads.ringHandle);
+    if (bufferStorage)
+    {
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        bufferStorage(GL_COPY_READ_BUFFER, UPLOAD_RING_SIZE, NULL, flags);
+        uploads.ringMemory = (u8*)glMapBufferRange(GL_COPY_READ_BUFFER, 0, UPLOAD_RING_SIZE, flags);
+    }
+    else
+    {
+        glBufferData(GL_COPY_READ_BUFFER, UPLOAD_RING_SIZE, NULL, GL_STREAM_COPY);
+        ILOG("GL_ARB_buffer_storage is not available, uploads will map the staging ring for each copy");
+    }
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+}
+
+static void PushUploadRequest(App* app, const UploadRequest& request)
+{
+    UploadQueue& uploads = app->uploads;
+    if (uploads.firstRequest == uploads.requests.size())
+    {
+        uploads.requests.clear();
+        uploads.firstRequest = 0;
+    }
+    uploads.requests.push_back(request);
+    uploads.pendingBytes += request.size;
+}
+
+void QueueSubmeshUpload(App* app, u32 meshIdx, u32 submeshIdx)
+{
+    const Submesh& submesh = app->meshes[meshIdx].submeshes[submeshIdx];
+    const u64 sizes[] = { submesh.vertices.size() * sizeof(float), submesh.indices.size() * sizeof(u32) };
+    const UploadType types[] = { UPLOAD_SUBMESH_VERTICES, UPLOAD_SUBMESH_INDICES };
+
+    for (u32 i = 0; i < ARRAY_COUNT(types); ++i)
+    {
+        if (sizes[i] == 0)
+            continue;
+
+        UploadRequest request = {};
+        request.type = types[i];
+        request.size = sizes[i];
+        request.meshIdx = meshIdx;
+        request.submeshIdx = submeshIdx;
+        PushUploadRequest(app, request);
+
+        app->meshes[meshIdx].pendingUploads++;
+    }
+}
+
+void QueueTextureLayerUpload(App* app, const Image& image, u32 arrayIdx, u32 layer)
+{
+    const TextureArray& page = app->textureArrays[arrayIdx];
+
+    UploadRequest request = {};
+    request.type = UPLOAD_TEXTURE_LAYER;
+    request.meshIdx = UINT32_MAX;
+    request.image = image;
+    request.image.mipCount = glm::min(image.mipCount, page.mipCount);
+    request.size = GetMipChainSize(image.size.x, image.size.y, image.nchannels, request.image.mipCount);
+    request.arrayIdx = arrayIdx;
+    request.layer = layer;
+    PushUploadRequest(app, request);
+}
+
+static void RetireUploadRegions(UploadQueue& uploads)
+{
+    u32 retired = 0;
+    while (retired < uploads.regions.size())
+    {
+        UploadRegion& region = uploads.regions[retired];
+        const GLenum status = glClientWaitSync(region.fence, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+            break;
+
+        glDeleteSync(region.fence);
+        uploads.tail = region.end;
+        retired++;
+    }
+    uploads.regions.erase(uploads.regions.begin(), uploads.regions.begin() + retired);
+}
+
+// Returns false if the GPU is still reading the part of the ring that would be overwritten
+static bool AllocateUploadSpace(UploadQueue& uploads, u64 size, u64* ringOffset)
+{
+    size = (size + UPLOAD_RING_ALIGNMENT - 1) & ~(u64)(UPLOAD_RING_ALIGNMENT - 1);
+
+    // Allocations do not wrap around the end of the ring, the remaining bytes are skipped
+    const u64 offset = uploads.head % UPLOAD_RING_SIZE;
+    const u64 padding = offset + size > UPLOAD_RING_SIZE ? UPLOAD_RING_SIZE - offset : 0;
+    if (uploads.head + padding + size - uploads.tail > UPLOAD_RING_SIZE)
+        return false;
+
+    uploads.head += padding;
+    *ringOffset = uploads.head % UPLOAD_RING_SIZE;
+    uploads.head += size;
+    return true;
+}
+
+static void WriteUploadRing(UploadQueue& uploads, u64 ringOffset, const void* data, u64 size)
+{
+    if (uploads.ringMemory)
+    {
+        memcpy(uploads.ringMemory + ringOffset, data, size);
+        return;
+    }
+
+    // The fences already keep this range from being in use, so the driver does not need to sync
+    glBindBuffer(GL_COPY_WRITE_BUFFER, uploads.ringHandle);
+    void* dst = glMapBufferRange(GL_COPY_WRITE_BUFFER, ringOffset, size,
+                                 GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    if (dst)
+    {
+        memcpy(dst, data, size);
+        glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+// Uploads the next part of a request that fits in budget bytes, or at least one texture row if
+// forceProgress is set, so that rows bigger than the budget are not stuck. Returns the bytes uploaded.
+static u64 ProcessUploadRequest(App* app, UploadRequest& request, u64 budget, bool forceProgress)
+{
+    UploadQueue& uploads = app->uploads;
+    const u64 maxChunkSize = glm::min(budget, (u64)UPLOAD_RING_SIZE / 2);
+
+    if (request.type != UPLOAD_TEXTURE_LAYER)
+    {
+        const MeshPool& pool = app->meshPool;
+        const Submesh& submesh = app->meshes[request.meshIdx].submeshes[request.submeshIdx];
+        const void* data;
+        GLuint buffer;
+        u64 bufferOffset;
+        if (request.type == UPLOAD_SUBMESH_VERTICES)
+        {
+            const VertexFormatPool& format = pool.vertexFormats[submesh.vertexFormatIdx];
+            data = submesh.vertices.data();
+            buffer = format.vertexBufferHandle;
+            bufferOffset = (u64)submesh.baseVertex * format.layout.stride;
+        }
+        else
+        {
+            data = submesh.indices.data();
+            buffer = pool.indexBufferHandle;
+            bufferOffset = (u64)submesh.firstIndex * sizeof(u32);
+        }
+
+        const u64 size = glm::min(request.size - request.uploadedSize, maxChunkSize);
+        u64 ringOffset;
+        if (size == 0 || !AllocateUploadSpace(uploads, size, &ringOffset))
+            return 0;
+
+        WriteUploadRing(uploads, ringOffset, (const u8*)data + request.uploadedSize, size);
+
+        glBindBuffer(GL_COPY_READ_BUFFER, uploads.ringHandle);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, ringOffset, bufferOffset + request.uploadedSize, size);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+        request.uploadedSize += size;
+        return size;
+    }
+
+    // Textures are split in bands of rows of a mip level
+    const Image& image = request.image;
+    u64 levelStart = 0;
+    i32 width = image.size.x;
+    i32 height = image.size.y;
+    u32 level = 0;
+    for (;;)
+    {
+        const u64 levelSize = (u64)width * height * image.nchannels;
+        if (request.uploadedSize < levelStart + levelSize)
+            break;
+        levelStart += levelSize;
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+        level++;
+    }
+
+    const u64 rowSize = (u64)width * image.nchannels;
+    const i32 firstRow = (i32)((request.uploadedSize - levelStart) / rowSize);
+    i32 rowCount = glm::min(height - firstRow, (i32)(maxChunkSize / rowSize));
+    if (rowCount == 0 && forceProgress)
+        rowCount = 1;
+    const u64 size = rowCount * rowSize;
+    u64 ringOffset;
+    if (rowCount <= 0 || !AllocateUploadSpace(uploads, size, &ringOffset))
+        return 0;
+
+    WriteUploadRing(uploads, ringOffset, (const u8*)image.pixels + request.uploadedSize, size);
+
+    const GLenum dataFormat = image.nchannels == 3 ? GL_RGB : GL_RGBA;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, uploads.ringHandle);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, app->textureArrays[request.arrayIdx].handle);
+    // Small mip levels of RGB images have rows that are not 4 byte aligned
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, firstRow, request.layer, width, rowCount, 1,
+                    dataFormat, GL_UNSIGNED_BYTE, (void*)ringOffset);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    request.uploadedSize += size;
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    return size;
+}
+
+void ProcessUploads(App* app)
+{
+    UploadQueue& uploads = app->uploads;
+    RetireUploadRegions(uploads);
+
+    const u64 budget = (u64)glm::max(uploads.budgetMB, 1) * MB(1);
+    u64 uploadedBytes = 0;
+
+    while (uploads.firstRequest < uploads.requests.size() && uploadedBytes < budget)
+    {
+        UploadRequest& request = uploads.requests[uploads.firstRequest];
+        if (request.uploadedSize < request.size)
+        {
+            const u64 chunkSize = ProcessUploadRequest(app, request, budget - uploadedBytes, uploadedBytes == 0);
+            if (chunkSize == 0)
+                break; // Out of budget, or the ring is full until the GPU catches up
+            uploadedBytes += chunkSize;
+        }
+
+        if (request.uploadedSize == request.size)
+        {
+            if (request.type == UPLOAD_TEXTURE_LAYER)
+                FreeImage(request.image);
+            if (request.meshIdx != UINT32_MAX && --app->meshes[request.meshIdx].pendingUploads == 0)
+                ApplyGeometryResidency(app, request.meshIdx);
+            uploads.firstRequest++;
+        }
+    }
+
+    if (uploads.head != uploads.fencedHead)
+    {
+        UploadRegion region = {};
+        region.end = uploads.head;
+        region.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        uploads.regions.push_back(region);
+        uploads.fencedHead = uploads.head;
+    }
+
+    uploads.uploadedBytesLastFrame = uploadedBytes;
+    uploads.pendingBytes = 0;
+    for (u32 i = uploads.firstRequest; i < uploads.requests.size(); ++i)
+        uploads.pendingBytes += uploads.requests[i].size - uploads.requests[i].uploadedSize;
+}
+
+///////////////////////////////////////////////////////////////////////
+// GL state cache
+
+void BeginGLStateFrame(App* app)
+{
+    GLStateCache& state = app->glState;
+    state.issuedCountLastFrame = state.issuedCount;
+    state.elidedCountLastFrame = state.elidedCount;
+    state.issuedCount = 0;
+    state.elidedCount = 0;
+
+    state.framebuffer = GL_STATE_UNKNOWN;
+    state.programPipeline = GL_STATE_UNKNOWN;
+    state.vertexArray = GL_STATE_UNKNOWN;
+    for (u32 i = 0; i < GL_STATE_BUFFER_TARGET_COUNT; ++i)
+        state.buffers[i] = GL_STATE_UNKNOWN;
+    for (u32 i = 0; i < GL_STATE_BUFFER_BINDINGS; ++i)
+    {
+        state.uniformBuffers[i] = { GL_STATE_UNKNOWN, 0, 0 };
+        state.storageBuffers[i] = { GL_STATE_UNKNOWN, 0, 0 };
+    }
+    state.activeTextureUnit = GL_STATE_UNKNOWN;
+    for (u32 unit = 0; unit < GL_STATE_TEXTURE_UNITS; ++unit)
+    {
+        for (u32 i = 0; i < GL_STATE_TEXTURE_TARGET_COUNT; ++i)
+            state.textures[unit][i] = GL_STATE_UNKNOWN;
+        state.samplers[unit] = GL_STATE_UNKNOWN;
+    }
+    state.blendEnabled = GL_STATE_UNKNOWN;
+    state.blendFunc = GL_STATE_UNKNOWN;
+    state.depthTestEnabled = GL_STATE_UNKNOWN;
+    state.depthWriteEnabled = GL_STATE_UNKNOWN;
+    state.depthFunc = GL_STATE_UNKNOWN;
+    state.colorWriteEnabled = GL_STATE_UNKNOWN;
+}
+
+// Returns true if the cached state already has the value, and otherwise takes it so the caller issues the call
+static bool IsStateCached(GLStateCache& state, u32& cached, u32 value)
+{
+    if (cached == value)
+    {
+        state.elidedCount++;
+        return true;
+    }
+    cached = value;
+    state.issuedCount++;
+    return false;
+}
+
+static u32 GetBufferTargetIdx(GLenum target)
+{
+    switch (target)
+    {
+    case GL_ARRAY_BUFFER:        return GL_STATE_BUFFER_ARRAY;
+    case GL_UNIFORM_BUFFER:      return GL_STATE_BUFFER_UNIFORM;
+    case GL_COPY_READ_BUFFER:    return GL_STATE_BUFFER_COPY_READ;
+    case GL_COPY_WRITE_BUFFER:   return GL_STATE_BUFFER_COPY_WRITE;
+    case GL_PIXEL_UNPACK_BUFFER: return GL_STATE_BUFFER_PIXEL_UNPACK;
+    case GL_SHADER_STORAGE_BUFFER: return GL_STATE_BUFFER_SHADER_STORAGE;
+    case GL_DRAW_INDIRECT_BUFFER: return GL_STATE_BUFFER_DRAW_INDIRECT;
+    default:                     return UINT32_MAX;
+    }
+}
+
+static u32 GetTextureTargetIdx(GLenum target)
+{
+    switch (target)
+    {
+    case GL_TEXTURE_2D:       return GL_STATE_TEXTURE_2D;
+    case GL_TEXTURE_2D_ARRAY: return GL_STATE_TEXTURE_2D_ARRAY;
+    case GL_TEXTURE_CUBE_MAP: return GL_STATE_TEXTURE_CUBE_MAP;
+    default:                  return UINT32_MAX;
+    }
+}
+
+void BindFramebuffer(App* app, GLuint framebuffer)
+{
+    if (!IsStateCached(app->glState, app->glState.framebuffer, framebuffer))
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+}
+
+void BindProgramPipeline(App* app, GLuint pipeline)
+{
+    if (!IsStateCached(app->glState, app->glState.programPipeline, pipeline))
+        glBindProgramPipeline(pipeline);
+}
+
+void BindVertexArray(App* app, GLuint vertexArray)
+{
+    if (!IsStateCached(app->glState, app->glState.vertexArray, vertexArray))
+        glBindVertexArray(vertexArray);
+}
+
+// GL_ELEMENT_ARRAY_BUFFER is part of the VAO state, so it is not cached and always bound
+void BindBuffer(App* app, GLenum target, GLuint buffer)
+{
+    GLStateCache& state = app->glState;
+    const u32 targetIdx = GetBufferTargetIdx(target);
+    if (targetIdx == UINT32_MAX)
+    {
+        state.issuedCount++;
+        glBindBuffer(target, buffer);
+    }
+    else if (!IsStateCached(state, state.buffers[targetIdx], buffer))
+    {
+        glBindBuffer(target, buffer);
+    }
+}
+
+void BindBufferRange(App* app, GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size)
+{
+    GLStateCache& state = app->glState;
+    BufferRangeBinding* bindings = target == GL_UNIFORM_BUFFER ? state.uniformBuffers :
+                                   target == GL_SHADER_STORAGE_BUFFER ? state.storageBuffers : NULL;
+
+    if (bindings && index < GL_STATE_BUFFER_BINDINGS)
+    {
+        BufferRangeBinding& binding = bindings[index];
+        if (binding.buffer == buffer && binding.offset == offset && binding.size == size)
+        {
+            state.elidedCount++;
+            return;
+        }
+        binding = { buffer, offset, size };
+    }
+
+    // Binding a range also binds the buffer to the generic binding point of the target
+    const u32 targetIdx = GetBufferTargetIdx(target);
+    if (targetIdx != UINT32_MAX)
+        state.buffers[targetIdx] = buffer;
+    state.issuedCount++;
+    glBindBufferRange(target, index, buffer, offset, size);
+}
+
+void BindTexture(App* app, u32 unit, GLenum target, GLuint texture)
+{
+    GLStateCache& state = app->glState;
+    const u32 targetIdx = GetTextureTargetIdx(target);
+    if (unit < GL_STATE_TEXTURE_UNITS && targetIdx != UINT32_MAX && IsStateCached(state, state.textures[unit][targetIdx], texture))
+        return;
+
+    if (!IsStateCached(state, state.activeTextureUnit, unit))
+        glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(target, texture);
+}
+
+void BindSampler(App* app, u32 unit, GLuint sampler)
+{
+    GLStateCache& state = app->glState;
+    if (unit >= GL_STATE_TEXTURE_UNITS)
+    {
+        state.issuedCount++;
+        glBindSampler(unit, sampler);
+    }
+    else if (!IsStateCached(state, state.samplers[unit], sampler))
+    {
+        glBindSampler(unit, sampler);
+    }
+}
+
+// The blend factors are only set while blending is enabled
+void SetBlendState(App* app, bool enabled, GLenum srcFactor, GLenum dstFactor)
+{
+    GLStateCache& state = app->glState;
+    if (!IsStateCached(state, state.blendEnabled, enabled ? 1 : 0))
+    {
+        if (enabled)
+            glEnable(GL_BLEND);
+        else
+            glDisable(GL_BLEND);
+    }
+
+    if (enabled && !IsStateCached(state, state.blendFunc, srcFactor << 16 | dstFactor))
+        glBlendFunc(srcFactor, dstFactor);
+}
+
+void SetDepthState(App* app, bool testEnabled, bool writeEnabled, GLenum func)
+{
+    GLStateCache& state = app->glState;
+    if (!IsStateCached(state, state.depthTestEnabled, testEnabled ? 1 : 0))
+    {
+        if (testEnabled)
+            glEnable(GL_DEPTH_TEST);
+        else
+            glDisable(GL_DEPTH_TEST);
+    }
+    if (!IsStateCached(state, state.depthWriteEnabled, writeEnabled ? 1 : 0))
+        glDepthMask(writeEnabled ? GL_TRUE : GL_FALSE);
+    if (testEnabled && !IsStateCached(state, state.depthFunc, func))
+        glDepthFunc(func);
+}
+
+void SetColorWriteState(App* app, bool enabled)
+{
+    GLStateCache& state = app->glState;
+    if (!IsStateCached(state, state.colorWriteEnabled, enabled ? 1 : 0))
+        glColorMask(enabled, enabled, enabled, enabled);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Uniform ring
+
+void InitUniformRing(App* app)
+{
+    UniformRing& ring = app->uniforms;
+
+    // Blocks are read as uniform blocks or as arrays of mat4 and LocalParams from the start of the
+    // region, so their offsets have to be multiples of all of those. The alignments are powers of two
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &app->uniformBufferAlignment);
+    glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &app->storageBufferAlignment);
+    ring.blockAlignment = glm::max((u32)sizeof(mat4), glm::max((u32)app->uniformBufferAlignment, (u32)app->storageBufferAlignment));
+
+    const u32 ringSize = UNIFORM_RING_FRAMES * UNIFORM_RING_FRAME_SIZE;
+    PFNGLBUFFERSTORAGEPROC bufferStorage = LoadBufferStorage();
+
+    glGenBuffers(1, &ring.handle);
+    glBindBuffer(GL_UNIFORM_BUFFER, ring.handle);
+    if (bufferStorage)
+    {
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        bufferStorage(GL_UNIFORM_BUFFER, ringSize, NULL, flags);
+        ring.memory = (u8*)glMapBufferRange(GL_UNIFORM_BUFFER, 0, ringSize, flags);
+        ring.isPersistent = ring.memory != NULL;
+    }
+    else
+    {
+        glBufferData(GL_UNIFORM_BUFFER, ringSize, NULL, GL_STREAM_DRAW);
+        ILOG("GL_ARB_buffer_storage is not available, the uniform ring will be mapped every frame");
+    }
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+static u8* GetUniformRegionMemory(const UniformRing& ring)
+{
+    if (!ring.memory)
+        return NULL;
+    return ring.isPersistent ? ring.memory + ring.frameIdx * UNIFORM_RING_FRAME_SIZE : ring.memory;
+}
+
+// Returns the offset of the block in this frame's region, or UINT32_MAX if it does not fit
+static u32 AllocateUniformBlock(App* app, u32 size)
+{
+    UniformRing& ring = app->uniforms;
+    const u32 alignment = ring.blockAlignment;
+    size = (size + alignment - 1) / alignment * alignment;
+
+    if (!GetUniformRegionMemory(ring) || ring.head + size > UNIFORM_RING_FRAME_SIZE)
+        return UINT32_MAX;
+
+    const u32 offset = ring.head;
+    ring.head += size;
+    return offset;
+}
+
+void BeginUniformFrame(App* app, const mat4& view, const mat4& projection)
+{
+    UniformRing& ring = app->uniforms;
+
+    // Only blocks if the GPU is more than UNIFORM_RING_FRAMES - 1 frames behind
+    GLsync& fence = ring.fences[ring.frameIdx];
+    if (fence)
+    {
+        glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, UINT64_MAX);
+        glDeleteSync(fence);
+        fence = 0;
+    }
+
+    const u32 regionOffset = ring.frameIdx * UNIFORM_RING_FRAME_SIZE;
+    if (!ring.isPersistent)
+    {
+        // The fence already keeps this region from being in use, so the driver does not need to sync
+        BindBuffer(app, GL_UNIFORM_BUFFER, ring.handle);
+        ring.memory = (u8*)glMapBufferRange(GL_UNIFORM_BUFFER, regionOffset, UNIFORM_RING_FRAME_SIZE,
+                                            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    }
+    ring.head = 0;
+    ring.blockCount = 0;
+    ring.drawParamsOffset = UINT32_MAX;
+    ring.drawCommandsOffset = UINT32_MAX;
+
+    GlobalParams params = {};
+    params.view = view;
+    params.projection = projection;
+    params.cameraPosition = app->camera.position;
+    params.lightCount = (u32)app->lights.size();
+    app->viewProjection = projection * view;
+    ExtractFrustumPlanes(app->viewProjection, app->frustumPlanes);
+    memcpy(params.frustumPlanes, app->frustumPlanes, sizeof(params.frustumPlanes));
+    params.hiZViewProjection = app->hiZ.viewProjection;
+    params.hiZWidth = (u32)app->displaySize.x;
+    params.hiZHeight = (u32)app->displaySize.y;
+    params.hiZLevelCount = app->hiZ.levelCount;
+    params.hiZEnabled = app->hiZ.isValid && app->useOcclusionCulling ? 1 : 0;
+
+    const u32 offset = AllocateUniformBlock(app, sizeof(GlobalParams));
+    if (offset == UINT32_MAX)
+        return;
+
+    memcpy(GetUniformRegionMemory(ring) + offset, &params, sizeof(params));
+    ring.globalParamsOffset = regionOffset + offset;
+    ring.blockCount++;
+    BindBufferRange(app, GL_UNIFORM_BUFFER, UNIFORM_BINDING_GLOBAL_PARAMS, ring.handle, ring.globalParamsOffset, sizeof(GlobalParams));
+}
+
+// Returns the index of the LocalParams of the model's first submesh, or UINT32_MAX if they do not fit
+static u32 PushModelParams(App* app, u32 modelIdx)
+{
+    UniformRing& ring = app->uniforms;
+    const Model& model = app->models[modelIdx];
+    const Mesh& mesh = app->meshes[model.meshIdx];
+
+    const u32 offset = AllocateUniformBlock(app, (u32)mesh.submeshes.size() * (u32)sizeof(LocalParams));
+    if (offset == UINT32_MAX)
+        return UINT32_MAX;
+
+    u8* blocks = GetUniformRegionMemory(ring) + offset;
+    for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+    {
+        const Material& material = app->materials[model.materialIdx[i]];
+
+        LocalParams params = {};
+        params.albedo = material.albedo;
+        if (material.albedoTextureIdx < app->textures.size())
+            params.textureLayer = app->textures[material.albedoTextureIdx].layer;
+        if (material.normalsTextureIdx < app->textures.size())
+            params.normalTextureLayer = app->textures[material.normalsTextureIdx].layer;
+
+        memcpy(blocks + i * sizeof(LocalParams), &params, sizeof(params));
+    }
+
+    ring.blockCount += (u32)mesh.submeshes.size();
+    return offset / (u32)sizeof(LocalParams);
+}
+
+// Entities are all visible unless CullEntities tested them this frame
+static bool IsEntityVisible(const App* app, u32 entityIdx)
+{
+    return entityIdx >= app->entitySpheres.count || app->entitySpheres.visible[entityIdx];
+}
 
-    GLuint vshader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vshader, ARRAY_COUNT(vertexShaderSource), vertexShaderSource, vertexShaderLengths);
-    glCompileShader(vshader);
-    glGetShaderiv(vshader, GL_COMPILE_STATUS, &success);
-    if (!success)
+void BuildInstanceGroups(App* app)
+{
+    UniformRing& ring = app->uniforms;
+    std::vector<InstanceGroup>& groups = app->instanceGroups;
+    std::vector<u32>& modelGroups = app->modelInstanceGroups;
+
+    // Both keep their capacity from frame to frame
+    groups.clear();
+    modelGroups.assign(app->models.size(), UINT32_MAX);
+
+    for (u32 i = 0; i < app->entities.size(); ++i)
     {
-        glGetShaderInfoLog(vshader, infoLogBufferSize, &infoLogSize, infoLogBuffer);
-        ELOG("glCompileShader() failed with vertex shader %s\nReported message:\n%s\n", shaderName, infoLogBuffer);
+        const Entity& entity = app->entities[i];
+        if (!IsEntityVisible(app, i))
+            continue;
+
+        u32& groupIdx = modelGroups[entity.modelIndex];
+        if (groupIdx == UINT32_MAX)
+        {
+            groupIdx = (u32)groups.size();
+            groups.push_back({ entity.modelIndex, 0, 0, 0, UINT32_MAX, FLT_MAX });
+        }
+        groups[groupIdx].instanceCount++;
+        groups[groupIdx].nearestDistance = glm::min(groups[groupIdx].nearestDistance, glm::distance(entity.position, app->camera.position));
     }
 
-    GLuint fshader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fshader, ARRAY_COUNT(fragmentShaderSource), fragmentShaderSource, fragmentShaderLengths);
-    glCompileShader(fshader);
-    glGetShaderiv(fshader, GL_COMPILE_STATUS, &success);
-    if (!success)
+    u8* regionMemory = GetUniformRegionMemory(ring);
+    const u32 regionOffset = ring.frameIdx * UNIFORM_RING_FRAME_SIZE;
+    u32 instanceCount = 0;
+    for (InstanceGroup& group : groups)
     {
-        glGetShaderInfoLog(fshader, infoLogBufferSize, &infoLogSize, infoLogBuffer);
-        ELOG("glCompileShader() failed with fragment shader %s\nReported message:\n%s\n", shaderName, infoLogBuffer);
+        const u32 instanceOffset = AllocateUniformBlock(app, group.instanceCount * (u32)sizeof(mat4));
+        group.firstLocalParams = instanceOffset == UINT32_MAX ? UINT32_MAX : PushModelParams(app, group.modelIdx);
+        if (group.firstLocalParams == UINT32_MAX)
+        {
+            ring.droppedEntityCount += group.instanceCount;
+            group.instanceCount = 0;
+            continue;
+        }
+
+        // Counted again while the matrices are written
+        group.firstWorldMatrix = instanceOffset / (u32)sizeof(mat4);
+        group.firstInstance = instanceCount;
+        instanceCount += group.instanceCount;
+        group.instanceCount = 0;
     }
+    app->instanceWorldMatrices.resize(instanceCount);
 
-    GLuint programHandle = glCreateProgram();
-    glAttachShader(programHandle, vshader);
-    glAttachShader(programHandle, fshader);
-    glLinkProgram(programHandle);
-    glGetProgramiv(programHandle, GL_LINK_STATUS, &success);
-    if (!success)
+    for (u32 i = 0; i < app->entities.size(); ++i)
     {
-        glGetProgramInfoLog(programHandle, infoLogBufferSize, &infoLogSize, infoLogBuffer);
-        ELOG("glLinkProgram() failed with program %s\nReported message:\n%s\n", shaderName, infoLogBuffer);
+        Entity& entity = app->entities[i];
+        entity.localParamsSize = 0;
+        if (!IsEntityVisible(app, i))
+            continue;
+
+        InstanceGroup& group = groups[modelGroups[entity.modelIndex]];
+        if (group.firstLocalParams == UINT32_MAX)
+            continue;
+
+        app->instanceWorldMatrices[group.firstInstance + group.instanceCount] = entity.worldMatrix;
+        group.instanceCount++;
+
+        entity.localParamsOffset = regionOffset + group.firstLocalParams * (u32)sizeof(LocalParams);
+        entity.localParamsSize = (u32)app->meshes[app->models[group.modelIdx].meshIdx].submeshes.size() * (u32)sizeof(LocalParams);
     }
 
-    glUseProgram(0);
+    // The ring is only written, the culling reads the CPU copy
+    for (const InstanceGroup& group : groups)
+    {
+        if (group.instanceCount > 0)
+            memcpy(regionMemory + group.firstWorldMatrix * sizeof(mat4), &app->instanceWorldMatrices[group.firstInstance], group.instanceCount * sizeof(mat4));
+    }
+}
 
-    glDetachShader(programHandle, vshader);
-    glDetachShader(programHandle, fshader);
-    glDeleteShader(vshader);
-    glDeleteShader(fshader);
+void FlushUniformFrame(App* app)
+{
+    UniformRing& ring = app->uniforms;
+    if (ring.isPersistent || !ring.memory)
+        return; // Coherent mappings need no flush
 
-    return programHandle;
+    BindBuffer(app, GL_UNIFORM_BUFFER, ring.handle);
+    glUnmapBuffer(GL_UNIFORM_BUFFER);
+    ring.memory = NULL;
 }
 
-u32 LoadProgram(App* app, const char* filepath, const char* programName)
+void EndUniformFrame(App* app)
 {
-    String programSource = ReadTextFile(filepath);
+    UniformRing& ring = app->uniforms;
+    ring.fences[ring.frameIdx] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    ring.blockCountLastFrame = ring.blockCount;
+    ring.usedBytesLastFrame = ring.head;
+    ring.frameIdx = (ring.frameIdx + 1) % UNIFORM_RING_FRAMES;
+}
 
-    Program program = {};
-    program.handle = CreateProgramFromSource(programSource, programName);
-    program.filepath = filepath;
-    program.programName = programName;
-    program.lastWriteTimestamp = GetFileLastWriteTimestamp(filepath);
-    app->programs.push_back(program);
+///////////////////////////////////////////////////////////////////////
+// Mesh pool
 
-    return app->programs.size() - 1;
+static u32 PoolAllocate(PoolAllocator& allocator, u32 size)
+{
+    // Empty submeshes take no range, so they never make a full pool grow
+    if (size == 0)
+        return 0;
+
+    for (u32 i = 0; i < allocator.freeRanges.size(); ++i)
+    {
+        PoolRange& range = allocator.freeRanges[i];
+        if (range.size >= size)
+        {
+            const u32 offset = range.offset;
+            range.offset += size;
+            range.size -= size;
+            if (range.size == 0)
+                allocator.freeRanges.erase(allocator.freeRanges.begin() + i);
+            allocator.usedSize += size;
+            return offset;
+        }
+    }
+    return UINT32_MAX;
 }
 
-Image LoadImage(const char* filename)
+static void PoolFree(PoolAllocator& allocator, u32 offset, u32 size)
 {
-    Image img = {};
-    stbi_set_flip_vertically_on_load(true);
-    img.pixels = stbi_load(filename, &img.size.x, &img.size.y, &img.nchannels, 0);
-    if (img.pixels)
+    if (size == 0)
+        return;
+
+    std::vector<PoolRange>& ranges = allocator.freeRanges;
+    u32 i = 0;
+    while (i < ranges.size() && ranges[i].offset < offset) i++;
+    ranges.insert(ranges.begin() + i, PoolRange{ offset, size });
+
+    if (i + 1 < ranges.size() && ranges[i].offset + ranges[i].size == ranges[i + 1].offset)
     {
-        img.stride = img.size.x * img.nchannels;
+        ranges[i].size += ranges[i + 1].size;
+        ranges.erase(ranges.begin() + i + 1);
     }
-    else
+    if (i > 0 && ranges[i - 1].offset + ranges[i - 1].size == ranges[i].offset)
     {
-        ELOG("Could not open file %s", filename);
+        ranges[i - 1].size += ranges[i].size;
+        ranges.erase(ranges.begin() + i);
     }
-    return img;
+
+    allocator.usedSize -= size;
 }
 
-void FreeImage(Image image)
+static bool IsSameVertexLayout(const VertexBufferLayout& a, const VertexBufferLayout& b)
 {
-    stbi_image_free(image.pixels);
+    if (a.stride != b.stride || a.attributes.size() != b.attributes.size())
+        return false;
+    for (u32 i = 0; i < a.attributes.size(); ++i)
+        if (a.attributes[i].location != b.attributes[i].location ||
+            a.attributes[i].componentCount != b.attributes[i].componentCount ||
+            a.attributes[i].offset != b.attributes[i].offset)
+            return false;
+    return true;
 }
 
-GLuint CreateTexture2DFromImage(Image image)
+// The buffers are part of the VAO state, so it has to be updated every time a pool is rebuilt
+static void BindVertexFormatBuffers(const MeshPool& pool, const VertexFormatPool& format)
 {
-    GLenum internalFormat = GL_RGB8;
-    GLenum dataFormat     = GL_RGB;
-    GLenum dataType       = GL_UNSIGNED_BYTE;
-
-    switch (image.nchannels)
+    glBindVertexArray(format.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, format.vertexBufferHandle);
+    for (const VertexBufferAttribute& attribute : format.layout.attributes)
     {
-        case 3: dataFormat = GL_RGB; internalFormat = GL_RGB8; break;
-        case 4: dataFormat = GL_RGBA; internalFormat = GL_RGBA8; break;
-        default: ELOG("LoadTexture2D() - Unsupported number of channels");
+        glVertexAttribPointer(attribute.location, attribute.componentCount, GL_FLOAT, GL_FALSE,
+                              format.layout.stride, (void*)(u64)attribute.offset);
+        glEnableVertexAttribArray(attribute.location);
     }
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pool.indexBufferHandle);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
 
-    GLuint texHandle;
-    glGenTextures(1, &texHandle);
-    glBindTexture(GL_TEXTURE_2D, texHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, image.size.x, image.size.y, 0, dataFormat, dataType, image.pixels);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glGenerateMipmap(GL_TEXTURE_2D);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    return texHandle;
+u32 FindVertexFormatPool(App* app, const VertexBufferLayout& layout)
+{
+    MeshPool& pool = app->meshPool;
+    for (u32 i = 0; i < pool.vertexFormats.size(); ++i)
+        if (IsSameVertexLayout(pool.vertexFormats[i].layout, layout))
+            return i;
+
+    // The buffer is created by the first allocation. The DrawParams are bound once per frame
+    VertexFormatPool format = {};
+    format.layout = layout;
+    glGenVertexArrays(1, &format.vao);
+    glBindVertexArray(format.vao);
+    glVertexAttribIFormat(DRAW_PARAMS_ATTRIBUTE_LOCATION, 2, GL_UNSIGNED_INT, 0);
+    glVertexAttribBinding(DRAW_PARAMS_ATTRIBUTE_LOCATION, DRAW_PARAMS_VERTEX_BINDING);
+    glEnableVertexAttribArray(DRAW_PARAMS_ATTRIBUTE_LOCATION);
+    glVertexBindingDivisor(DRAW_PARAMS_VERTEX_BINDING, DRAW_PARAMS_DIVISOR);
+    glBindVertexArray(0);
+    pool.vertexFormats.push_back(format);
+    return (u32)pool.vertexFormats.size() - 1;
 }
 
-u32 LoadTexture2D(App* app, const char* filepath)
+/**
+ * Moves the ranges in use of a pool (the index pool if formatIdx is UINT32_MAX) to the start
+ * of a new buffer with room for newCapacity elements, so all the free space ends up together.
+ */
+static void RebuildPool(App* app, u32 formatIdx, u32 newCapacity)
 {
-    for (u32 texIdx = 0; texIdx < app->textures.size(); ++texIdx)
-        if (app->textures[texIdx].filepath == filepath)
-            return texIdx;
+    MeshPool& pool = app->meshPool;
+    const bool isIndexPool = formatIdx == UINT32_MAX;
+    PoolAllocator& allocator = isIndexPool ? pool.indexAllocator : pool.vertexFormats[formatIdx].allocator;
+    GLuint& bufferHandle = isIndexPool ? pool.indexBufferHandle : pool.vertexFormats[formatIdx].vertexBufferHandle;
+    const u64 elementSize = isIndexPool ? sizeof(u32) : pool.vertexFormats[formatIdx].layout.stride;
+
+    GLuint newBufferHandle;
+    glGenBuffers(1, &newBufferHandle);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, newBufferHandle);
+    glBufferData(GL_COPY_WRITE_BUFFER, newCapacity * elementSize, NULL, GL_STATIC_DRAW);
+    glBindBuffer(GL_COPY_READ_BUFFER, bufferHandle);
+
+    // Ranges are copied on the GPU, and uploads still queued will be written at the new offsets
+    u32 offset = 0;
+    for (Mesh& mesh : app->meshes)
+    {
+        for (Submesh& submesh : mesh.submeshes)
+        {
+            u32& rangeOffset = isIndexPool ? submesh.firstIndex : submesh.baseVertex;
+            const u32 rangeSize = isIndexPool ? submesh.indexCount : submesh.vertexCount;
+            if (rangeOffset == UINT32_MAX || rangeSize == 0 || (!isIndexPool && submesh.vertexFormatIdx != formatIdx))
+                continue;
+
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                                rangeOffset * elementSize, offset * elementSize, rangeSize * elementSize);
+            rangeOffset = offset;
+            offset += rangeSize;
+        }
+    }
 
-    Image image = LoadImage(filepath);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    glDeleteBuffers(1, &bufferHandle);
+    bufferHandle = newBufferHandle;
 
-    if (image.pixels)
+    allocator.capacity = newCapacity;
+    allocator.usedSize = offset;
+    allocator.freeRanges.clear();
+    if (offset < newCapacity)
+        allocator.freeRanges.push_back(PoolRange{ offset, newCapacity - offset });
+
+    if (isIndexPool)
     {
-        Texture tex = {};
-        tex.handle = CreateTexture2DFromImage(image);
-        tex.filepath = filepath;
+        for (const VertexFormatPool& format : pool.vertexFormats)
+            BindVertexFormatBuffers(pool, format);
+    }
+    else
+    {
+        BindVertexFormatBuffers(pool, pool.vertexFormats[formatIdx]);
+    }
 
-        u32 texIdx = app->textures.size();
-        app->textures.push_back(tex);
+    pool.rebuildCount++;
+}
 
-        FreeImage(image);
-        return texIdx;
+static u32 AllocatePoolRange(App* app, u32 formatIdx, u32 size)
+{
+    MeshPool& pool = app->meshPool;
+    PoolAllocator& allocator = formatIdx == UINT32_MAX ? pool.indexAllocator : pool.vertexFormats[formatIdx].allocator;
+
+    u32 offset = PoolAllocate(allocator, size);
+    if (offset == UINT32_MAX)
+    {
+        // Packing the ranges in use is enough if the free space is just fragmented
+        u32 newCapacity = glm::max(allocator.capacity, (u32)(formatIdx == UINT32_MAX ? MESH_POOL_INITIAL_INDICES : MESH_POOL_INITIAL_VERTICES));
+        while (newCapacity - allocator.usedSize < size)
+            newCapacity *= 2;
+
+        RebuildPool(app, formatIdx, newCapacity);
+        offset = PoolAllocate(allocator, size);
     }
-    else
+    return offset;
+}
+
+void AllocateSubmeshGeometry(App* app, u32 meshIdx, u32 submeshIdx)
+{
+    Submesh& submesh = app->meshes[meshIdx].submeshes[submeshIdx];
+    submesh.vertexFormatIdx = FindVertexFormatPool(app, submesh.vertexBufferLayout);
+    submesh.vertexCount = (u32)(submesh.vertices.size() * sizeof(float) / submesh.vertexBufferLayout.stride);
+    submesh.indexCount = (u32)submesh.indices.size();
+
+    // Not allocated yet, so that rebuilding the pools below skips this submesh
+    submesh.baseVertex = UINT32_MAX;
+    submesh.firstIndex = UINT32_MAX;
+
+    const u32 baseVertex = AllocatePoolRange(app, submesh.vertexFormatIdx, submesh.vertexCount);
+    submesh.baseVertex = baseVertex;
+    const u32 firstIndex = AllocatePoolRange(app, UINT32_MAX, submesh.indexCount);
+    submesh.firstIndex = firstIndex;
+
+    QueueSubmeshUpload(app, meshIdx, submeshIdx);
+}
+
+void FreeMeshGeometry(App* app, u32 meshIdx)
+{
+    MeshPool& pool = app->meshPool;
+    Mesh& mesh = app->meshes[meshIdx];
+
+    for (Submesh& submesh : mesh.submeshes)
     {
-        return UINT32_MAX;
+        if (submesh.baseVertex != UINT32_MAX)
+            PoolFree(pool.vertexFormats[submesh.vertexFormatIdx].allocator, submesh.baseVertex, submesh.vertexCount);
+        if (submesh.firstIndex != UINT32_MAX)
+            PoolFree(pool.indexAllocator, submesh.firstIndex, submesh.indexCount);
+        submesh.baseVertex = UINT32_MAX;
+        submesh.firstIndex = UINT32_MAX;
     }
+
+    // Uploads that did not happen yet have nowhere to go
+    UploadQueue& uploads = app->uploads;
+    for (u32 i = uploads.firstRequest; i < uploads.requests.size(); ++i)
+        if (uploads.requests[i].type != UPLOAD_TEXTURE_LAYER && uploads.requests[i].meshIdx == meshIdx)
+            uploads.requests[i].uploadedSize = uploads.requests[i].size;
+
+    mesh.submeshes.clear();
 }
 
 void Init(App* app)
 {
+    // Deployments ship their assets in a pak, development builds read the loose files
+    MountPak(ASSET_PAK_FILENAME);
+    MakeDirectory(ASSET_CACHE_DIRECTORY);
+
+    InitUploadQueue(app);
+    InitUniformRing(app);
+    InitProgramBuilds(app);
+
+    // - programs, submitted first so that the driver builds them while the assets load
+    app->deferredQuadProgramIdx = LoadProgram(app, "Shaders/quad_vertex.glsl", "QUAD_VERTEX", "Shaders/deferred_quad.glsl", "DEFERRED_QUAD", app->fallbackQuadProgramIdx);
+    app->forwardQuadProgramIdx = LoadProgram(app, "Shaders/quad_vertex.glsl", "QUAD_VERTEX", "Shaders/forward_quad.glsl", "FORWARD_QUAD", app->fallbackQuadProgramIdx);
+    app->forwardMeshProgramIdx = LoadProgram(app, "Shaders/mesh_vertex.glsl", "MESH_VERTEX", "Shaders/forward_shader.glsl", "FORWARD_SHADER", app->fallbackMeshProgramIdx);
+    app->deferredProgramIdx = LoadProgram(app, "Shaders/mesh_vertex.glsl", "MESH_VERTEX", "Shaders/deferred_shader.glsl", "DEFERRED_SHADER", app->fallbackMeshProgramIdx);
+    app->depthProgramIdx = LoadProgram(app, "Shaders/quad_vertex.glsl", "QUAD_VERTEX", "Shaders/depth_shader.glsl", "DEPTH_SHADER", app->fallbackQuadProgramIdx);
+    InitGpuCulling(app);
+    InitDepthPrepass(app);
+
+    ILOG("Shader stages submitted in %.2f ms (%u from binary cache, %u compiling, %u rejected)",
+         app->programCache.loadTime * 1000.0, app->programCache.binaryHits, app->programCache.compiledCount, app->programCache.rejectedCount);
+
     app->currentRenderTargetMode = RenderTargetsMode::FINAL_RENDER;
 
 
     app->renderMode = RenderMode::FORWARD;
+    app->depthPrepass.mode = DEPTH_PREPASS_AUTO;
+    app->useMultiDrawIndirect = true;
+    app->cullingMode = CULLING_GPU;
+    app->useOcclusionCulling = true;
 
 
     // TODO: Initialize your resources here!
@@ -260,38 +1945,16 @@ void Init(App* app)
     app->lights.push_back(CreateLight(app, LightType::LightType_Point, vec3(0.0f, 2.0, 1.0f), vec3(1.0f), vec3(0.0f, 0.0f, 0.2f)));
 
 
-    // - programs (and retrieve uniform indices)
-    app->deferredQuadProgramIdx = LoadProgram(app, "Shaders/deferred_quad.glsl", "DEFERRED_QUAD");
-    Program& texturedGeometryProgram = app->programs[app->deferredQuadProgramIdx];
-
-    app->forwardQuadProgramIdx = LoadProgram(app, "Shaders/forward_quad.glsl", "FORWARD_QUAD");
-    Program& forwardGeometryProgram = app->programs[app->forwardQuadProgramIdx];
-    
     Entity entity;
     entity.position = vec3(0.0f, 0.0f, -0.5f);
-    app->model = LoadModel(app, "Patrick/Patrick.obj");
+    app->model = LoadModel(app, "Patrick/Patrick.obj", GEOMETRY_RESIDENCY_POSITIONS);
     entity.metallic = 2.0f;
     entity.roughness = 2.75f;
     entity.modelIndex = app->model;
+    entity.isOccluder = true;
     app->mainEntity = entity;
     app->entities.push_back(entity);
 
-    //Render
-    app->forwardMeshProgramIdx = LoadProgram(app, "Shaders/forward_shader.glsl", "FORWARD_SHADER");
-    Program& forwardMeshProgram = app->programs[app->forwardMeshProgramIdx];
-    LoadProgramAttributes(forwardMeshProgram);
-
-    //Geomtry
-    app->deferredProgramIdx = LoadProgram(app, "Shaders/deferred_shader.glsl", "DEFERRED_SHADER");
-    Program& deferredMeshProgram = app->programs[app->deferredProgramIdx];
-    LoadProgramAttributes(deferredMeshProgram);
-
-    //DEPTH
-    app->depthProgramIdx = LoadProgram(app, "Shaders/depth_shader.glsl", "DEPTH_SHADER");
-    Program& depthProgram = app->programs[app->depthProgramIdx];
-    LoadProgramAttributes(depthProgram);
-
-
     //Framebuffers
     //Frame Buffer Handle
 
@@ -397,6 +2060,106 @@ void Gui(App* app)
 
 
 
+    if (ImGui::Button("Benchmark image decode"))
+    {
+        BenchmarkImageDecode(app);
+    }
+    ImGui::Text("Textures: %u in %u texture array pages", (u32)app->textures.size(), (u32)app->textureArrays.size());
+    const MeshPool& meshPool = app->meshPool;
+    u64 vertexPoolUsed = 0;
+    u64 vertexPoolCapacity = 0;
+    for (const VertexFormatPool& format : meshPool.vertexFormats)
+    {
+        vertexPoolUsed += (u64)format.allocator.usedSize * format.layout.stride;
+        vertexPoolCapacity += (u64)format.allocator.capacity * format.layout.stride;
+    }
+    ImGui::Text("Mesh pool: %u vertex formats, %u rebuilds", (u32)meshPool.vertexFormats.size(), meshPool.rebuildCount);
+    ImGui::Text("    vertices %.2f / %.2f MB, indices %.2f / %.2f MB",
+                (f64)vertexPoolUsed / MB(1), (f64)vertexPoolCapacity / MB(1),
+                (f64)meshPool.indexAllocator.usedSize * sizeof(u32) / MB(1), (f64)meshPool.indexAllocator.capacity * sizeof(u32) / MB(1));
+    // RAM saved is what the GPU copy of the geometry takes minus what is still kept
+    const char* residencyNames[GEOMETRY_RESIDENCY_COUNT] = { "none", "positions", "full" };
+    u32 residencyMeshCounts[GEOMETRY_RESIDENCY_COUNT] = {};
+    u64 residencyKeptBytes[GEOMETRY_RESIDENCY_COUNT] = {};
+    u64 residencySavedBytes[GEOMETRY_RESIDENCY_COUNT] = {};
+    for (const Mesh& mesh : app->meshes)
+    {
+        if (mesh.pendingUploads > 0)
+            continue;
+        residencyMeshCounts[mesh.residency]++;
+        for (const Submesh& submesh : mesh.submeshes)
+        {
+            const u64 gpuBytes = (u64)submesh.vertexCount * submesh.vertexBufferLayout.stride + (u64)submesh.indexCount * sizeof(u32);
+            const u64 keptBytes = submesh.vertices.capacity() * sizeof(float) + submesh.indices.capacity() * sizeof(u32) +
+                                  submesh.positions.capacity() * sizeof(vec3);
+            residencyKeptBytes[mesh.residency] += keptBytes;
+            residencySavedBytes[mesh.residency] += gpuBytes > keptBytes ? gpuBytes - keptBytes : 0;
+        }
+    }
+    for (u32 i = 0; i < GEOMETRY_RESIDENCY_COUNT; ++i)
+    {
+        ImGui::Text("Geometry residency %-9s: %u meshes, %.2f MB kept, %.2f MB saved", residencyNames[i], residencyMeshCounts[i],
+                    (f64)residencyKeptBytes[i] / MB(1), (f64)residencySavedBytes[i] / MB(1));
+    }
+    ImGui::SliderInt("Upload budget (MB/frame)", &app->uploads.budgetMB, 1, 64);
+    ImGui::Text("Uploads: %.2f MB last frame, %.2f MB pending",
+                (f64)app->uploads.uploadedBytesLastFrame / MB(1), (f64)app->uploads.pendingBytes / MB(1));
+    ImGui::Text("Uniform ring: %u blocks, %.1f KB last frame, %u entities dropped",
+                app->uniforms.blockCountLastFrame, (f64)app->uniforms.usedBytesLastFrame / KB(1), app->uniforms.droppedEntityCount);
+    ImGui::Text("Instancing: %u entities in %u groups", (u32)app->entities.size(), (u32)app->instanceGroups.size());
+    ImGui::Checkbox("Multi-draw indirect", &app->useMultiDrawIndirect);
+    const char* cullingModeNames[CULLING_MODE_COUNT] = { "None", "CPU", "GPU" };
+    ImGui::Combo("Frustum culling", (int*)&app->cullingMode, cullingModeNames, CULLING_MODE_COUNT);
+    if (app->cullingMode == CULLING_CPU)
+    {
+        ImGui::Checkbox("Cull entities with the BVH", &app->useEntityBvh);
+        ImGui::Text("Entity culling: %u of %u visible (%.3f ms)", app->visibleEntityCount, (u32)app->entities.size(), app->entityCullingTime * 1000.0);
+        ImGui::Checkbox("Software occlusion culling", &app->useSoftwareOcclusion);
+        if (app->useSoftwareOcclusion)
+            ImGui::Text("Software occlusion: %u entities culled by %u occluder triangles (%.3f ms)",
+                        app->occludedEntityCount, (u32)app->occlusionBuffer.triangles.size(), app->occlusionTime * 1000.0);
+        ImGui::Text("Culling: %u of %u instances visible", app->visibleInstanceCount, app->totalInstanceCount);
+    }
+    if (app->cullingMode == CULLING_GPU)
+    {
+        ImGui::Checkbox("Hi-Z occlusion culling", &app->useOcclusionCulling);
+        if (ImGui::Button("Check GPU culling against the CPU"))
+            app->gpuCulling.verifyNextFrame = true;
+    }
+    ImGui::Text("Entity BVH: %u nodes, %u refit and %u subtrees built again last frame",
+                (u32)app->entityBvh.nodes.size(), app->entityBvh.refitNodeCount, app->entityBvh.rebuiltSubtreeCount);
+    if (ImGui::Button("Benchmark entity BVH"))
+    {
+        BenchmarkEntityBvh(app);
+    }
+    ImGui::Text("Render queue: %u draw items in %u draw calls", (u32)app->renderQueue.items.size(), app->renderQueue.drawCallCount);
+    ImGui::Text("GL state: %u calls issued, %u elided last frame",
+                app->glState.issuedCountLastFrame, app->glState.elidedCountLastFrame);
+    if (app->cookedDecodeThroughput > 0.0)
+    {
+        ImGui::Text("Decode stb_image + mips: %.1f MB/s", app->stbDecodeThroughput);
+        ImGui::Text("Decode cooked:           %.1f MB/s", app->cookedDecodeThroughput);
+    }
+
+    const ProgramCacheStats& programCache = app->programCache;
+    ImGui::Text("Shader stages: %s start in %.2f ms, %u from binary cache, %u compiled, %u rejected",
+                programCache.compiledCount > 0 ? "cold" : "warm", programCache.loadTime * 1000.0,
+                programCache.binaryHits, programCache.compiledCount, programCache.rejectedCount);
+    if (app->programBuilds.pendingCount > 0)
+        ImGui::Text("    %u shader stages still building, drawing with fallbacks", app->programBuilds.pendingCount);
+    else if (app->programBuilds.readyTime > 0.0)
+        ImGui::Text("    all built %.2f ms after submission", app->programBuilds.readyTime * 1000.0);
+    ImGui::Text("    %u pipelines share %u shader stages", (u32)app->programs.size(), (u32)app->shaderStages.size());
+    if (ImGui::Button("Benchmark program cache"))
+    {
+        BenchmarkProgramCache(app);
+    }
+    if (programCache.benchmarkCompileTime > 0.0)
+    {
+        ImGui::Text("Stages from source: %.2f ms", programCache.benchmarkCompileTime * 1000.0);
+        ImGui::Text("Stages from binary: %.2f ms", programCache.benchmarkBinaryTime * 1000.0);
+    }
+
     float cameraPosition[3] = { app->camera.position.x, app->camera.position.y, app->camera.position.z };
     ImGui::DragFloat3("Camera position", cameraPosition, 0.1f, -20000000000000000.0f, 200000000000000000000.0f);
     app->camera.position = vec3(cameraPosition[0], cameraPosition[1], cameraPosition[2]);
@@ -416,6 +2179,16 @@ void Gui(App* app)
 
         ImGui::EndCombo();
     }
+    if (app->renderMode == RenderMode::FORWARD)
+    {
+        DepthPrepass& prepass = app->depthPrepass;
+        const char* depthPrepassModeNames[DEPTH_PREPASS_MODE_COUNT] = { "Off", "On", "Auto" };
+        ImGui::Combo("Depth pre-pass", (int*)&prepass.mode, depthPrepassModeNames, DEPTH_PREPASS_MODE_COUNT);
+        if (prepass.overdraw > 0.0f)
+            ImGui::Text("Depth pre-pass: %s, overdraw %.2f when last drawn", prepass.isEnabled ? "on" : "off", prepass.overdraw);
+        else
+            ImGui::Text("Depth pre-pass: %s, overdraw not measured yet", prepass.isEnabled ? "on" : "off");
+    }
 
     const char* renderTargets[] = { "ALBEDO","NORMALS","POSITION","DEPTH","FINAL RENDER"};
     if (ImGui::BeginCombo("RenderTargets", renderTargets[(u32)app->currentRenderTargetMode])) {
@@ -477,404 +2250,1018 @@ void Gui(App* app)
 void Update(App* app)
 {
     HandleInput(app);
+    HotReloadPrograms(app);
 
     for (int i = 1; i < app->lights.size(); i++)
     {
         app->lights[i].position = app->entities[i].position;
     }
 
+    for (Entity& entity : app->entities)
+    {
+        entity.worldMatrix = TransformPositionScale(entity.position, vec3(0.45f));
+    }
+    UpdateEntityBvh(app);
 }
 
 void Render(App* app)
 {
+    ProcessUploads(app);
+    BeginGLStateFrame(app);
+
     //Render on a framebuffer object
-    glBindFramebuffer(GL_FRAMEBUFFER, app->framebufferHandle);
+    BindFramebuffer(app, app->framebufferHandle);
 
     //Render Targets Buffers
     GLuint drawBuffers[] = { app->colorAttachmentHandle, app->normalAttachmentHandle, app->positionAttachmentHandle,app->finalRenderAttachmentHandle };
     glDrawBuffers(ARRAY_COUNT(drawBuffers), drawBuffers);
 
-    //Clear color and depth and enable depth test
+    //Clear color and depth and enable depth test. The clears are masked by the write states
+    SetColorWriteState(app, true);
+    SetDepthState(app, true, true, GL_LESS);
     glClearColor(0.1f, 0.1f, 0.1f, 0.0f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glEnable(GL_DEPTH_TEST);
+
+    // The same blending as the full screen pass, so that one does not have to change it
+    SetBlendState(app, true, GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
     //Render models
-    Program programModel = app->programs[app->deferredProgramIdx];
+    u32 programModelIdx = app->deferredProgramIdx;
 
     if (app->renderMode == RenderMode::FORWARD) {
         glPushDebugGroup(GL_DEBUG_SOURCE_APPLICATION, 1, -1, "Forward Model Shader");
-        programModel = app->programs[app->forwardMeshProgramIdx];
+        programModelIdx = app->forwardMeshProgramIdx;
     }
     else {
         glPushDebugGroup(GL_DEBUG_SOURCE_APPLICATION, 1, -1, "Deferred Model Shader");
     }
 
-    glUseProgram(programModel.handle);
+    //Matrix
+    float aspectRatio = (float)app->displaySize.x / (float)app->displaySize.y;
+    float znear = 0.1f;
+    float zfar = 1000.0f;
+
+    mat4 projection = glm::perspective(glm::radians(app->camera.zoom), aspectRatio, znear, zfar);
+    mat4 view = app->camera.GetViewMatrix();
+
+    // All the blocks of the frame are written before the first draw that reads them
+    BeginUniformFrame(app, view, projection);
+    CullEntities(app);
+    BuildInstanceGroups(app);
+    BuildRenderQueue(app, programModelIdx, zfar);
+    WriteDrawCommands(app);
+    FlushUniformFrame(app);
+
+    CullDrawsOnGpu(app);
+    DrawDepthPrepass(app);
+    SubmitRenderQueue(app);
+    EndDepthPrepass(app);
+    BuildHiZPyramid(app, projection * view);
+
+    BindFramebuffer(app, 0);
+
+    DrawDice(app);
+
+    EndUniformFrame(app);
+}
+
+// Handles of the uniforms set by the draw code, hashed once
+static const UniformHandle TextureUniform = GetUniformHandle("uTexture");
+static const UniformHandle NormalTextureUniform = GetUniformHandle("uNormalTexture");
+static const UniformHandle ColorUniform = GetUniformHandle("uColor");
+static const UniformHandle NormalsUniform = GetUniformHandle("uNormals");
+static const UniformHandle PositionUniform = GetUniformHandle("uPosition");
+static const UniformHandle DepthUniform = GetUniformHandle("uDepth");
+static const UniformHandle RenderTargetModeUniform = GetUniformHandle("renderTargetMode");
+
+void PassLightsToCurrentProgram(Program& programModel, App* app)
+{
+    // The names of the elements of the lights array are only hashed when a light is first passed
+    while (app->lightUniforms.size() < app->lights.size())
+    {
+        const u32 lightIdx = (u32)app->lightUniforms.size();
+        char uniformName[64];
+        LightUniformHandles handles;
+        snprintf(uniformName, sizeof(uniformName), "lights[%u].type", lightIdx);
+        handles.type = GetUniformHandle(uniformName);
+        snprintf(uniformName, sizeof(uniformName), "lights[%u].color", lightIdx);
+        handles.color = GetUniformHandle(uniformName);
+        snprintf(uniformName, sizeof(uniformName), "lights[%u].direction", lightIdx);
+        handles.direction = GetUniformHandle(uniformName);
+        snprintf(uniformName, sizeof(uniformName), "lights[%u].position", lightIdx);
+        handles.position = GetUniformHandle(uniformName);
+        app->lightUniforms.push_back(handles);
+    }
+
+    // The light count is part of the permutation key, see GetProgramPermutation
+    for (u32 i = 0; i < app->lights.size(); i++)
+    {
+        const LightUniformHandles& handles = app->lightUniforms[i];
+        SetUniform1ui(app, programModel, handles.type, (u32)app->lights[i].type);
+        SetUniform3fv(app, programModel, handles.color, app->lights[i].color);
+        SetUniform3fv(app, programModel, handles.position, app->lights[i].position);
+        SetUniform3fv(app, programModel, handles.direction, app->lights[i].direction);
+    }
+}
+
+void DrawDice(App* app)
+{
+    glClearColor(0.1f, 0.1f, 0.1f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glPushDebugGroup(GL_DEBUG_SOURCE_APPLICATION, 1, -1, "Dice Texture");
+
+    // - bind the program 
+    u32 programTexturedGeometryIdx = app->forwardQuadProgramIdx;
+    if (app->renderMode == RenderMode::DEFERRED)
+    {
+        programTexturedGeometryIdx = GetProgramPermutation(app, app->deferredQuadProgramIdx, MAKE_PERMUTATION_KEY(0, (u32)app->lights.size()));
+    }
+
+    if (app->renderMode == RenderMode::FORWARD && app->currentRenderTargetMode == RenderTargetsMode::DEPTH)
+    {
+        programTexturedGeometryIdx = app->depthProgramIdx;
+    }
+
+    Program& programTexturedGeometry = GetProgram(app, programTexturedGeometryIdx);
+
+
+    BindProgramPipeline(app, programTexturedGeometry.handle);
+    BindVertexArray(app, app->vao);
+
+    if (app->renderMode == RenderMode::DEFERRED) {
+        SetUniform1ui(app, programTexturedGeometry, RenderTargetModeUniform, (u32)app->currentRenderTargetMode);
+
+        PassLightsToCurrentProgram(programTexturedGeometry, app);
+    }
+
+
+    // - set the blending state
+    SetBlendState(app, true, GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+    if (app->renderMode == RenderMode::FORWARD) {
+        switch (app->currentRenderTargetMode)
+        {
+        case RenderTargetsMode::ALBEDO:
+            BindTexture(app, 0, GL_TEXTURE_2D, app->colorAttachmentHandle);
+            break;
+        case RenderTargetsMode::NORMALS:
+            BindTexture(app, 0, GL_TEXTURE_2D, app->normalAttachmentHandle);
+            break;
+        case RenderTargetsMode::POSITION:
+            BindTexture(app, 0, GL_TEXTURE_2D, app->positionAttachmentHandle);
+            break;
+        case RenderTargetsMode::DEPTH: 
+            BindTexture(app, 0, GL_TEXTURE_2D, app->depthAttachmentHandle); 
+            break;
+        case RenderTargetsMode::FINAL_RENDER:
+            BindTexture(app, 0, GL_TEXTURE_2D, app->finalRenderAttachmentHandle);
+            break;
+        default:
+            break;
+        }
+        SetUniform1i(app, programTexturedGeometry, ColorUniform, 0);
+
+    }
+    else {
+        BindTexture(app, 0, GL_TEXTURE_2D, app->colorAttachmentHandle);
+        SetUniform1i(app, programTexturedGeometry, ColorUniform, 0);
+
+        BindTexture(app, 1, GL_TEXTURE_2D, app->normalAttachmentHandle);
+        SetUniform1i(app, programTexturedGeometry, NormalsUniform, 1);
+
+        BindTexture(app, 2, GL_TEXTURE_2D, app->positionAttachmentHandle);
+        SetUniform1i(app, programTexturedGeometry, PositionUniform, 2);
+
+        BindTexture(app, 3, GL_TEXTURE_2D, app->depthAttachmentHandle);
+        SetUniform1i(app, programTexturedGeometry, DepthUniform, 3);
+    }
+
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+    glPopDebugGroup();
+}
+
+
+
+static bool HasTangents(const VertexBufferLayout& layout)
+{
+    u32 tangentAttributes = 0;
+    for (const VertexBufferAttribute& attribute : layout.attributes)
+        tangentAttributes += (attribute.location == 3 || attribute.location == 4) ? 1 : 0;
+    return tangentAttributes == 2;
+}
+
+static u32 GetMaterialFeatures(App* app, const Material& material, const Submesh& submesh)
+{
+    const bool hasAlbedoTexture = material.albedoTextureIdx < app->textures.size();
+    const bool hasNormalMap = material.normalsTextureIdx < app->textures.size() && HasTangents(submesh.vertexBufferLayout);
+    return (hasAlbedoTexture ? SHADER_FEATURE_ALBEDO_TEX : 0) | (hasNormalMap ? SHADER_FEATURE_NORMAL_MAP : 0);
+}
+
+void BuildRenderQueue(App* app, u32 programIdx, f32 zfar)
+{
+    RenderQueue& queue = app->renderQueue;
+    queue.items.clear();
+
+    const u32 lightCount = (u32)app->lights.size();
+    for (u32 groupIdx = 0; groupIdx < app->instanceGroups.size(); ++groupIdx)
+    {
+        const InstanceGroup& group = app->instanceGroups[groupIdx];
+        const Model& model = app->models[group.modelIdx];
+        const Mesh& mesh = app->meshes[model.meshIdx];
+        if (mesh.pendingUploads > 0 || group.instanceCount == 0)
+            continue;
+
+        // A group is as near as its nearest instance
+        const f32 depth = group.nearestDistance / zfar;
+        for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+        {
+            const Submesh& submesh = mesh.submeshes[i];
+            const u32 materialIdx = model.materialIdx[i];
+            const u32 features = GetMaterialFeatures(app, app->materials[materialIdx], submesh);
+
+            DrawItem item = {};
+            item.programIdx = GetProgramPermutation(app, programIdx, MAKE_PERMUTATION_KEY(features, lightCount));
+            item.groupIdx = groupIdx;
+            item.submeshIdx = i;
+            item.key = MakeDrawKey(RENDER_PASS_OPAQUE, item.programIdx, submesh.vertexFormatIdx, materialIdx, depth);
+            queue.items.push_back(item);
+        }
+    }
+
+    SortRenderQueue(queue);
+}
+
+// Culls on the CPU while the culling shader is not ready
+static CullingMode GetCullingMode(App* app)
+{
+    if (app->cullingMode == CULLING_GPU && !IsShaderStageReady(app, app->shaderStages[app->gpuCulling.stageIdx]))
+        return CULLING_CPU;
+    return app->cullingMode;
+}
+
+static void GetEntityBounds(App* app, const Entity& entity, vec3* boundsMin, vec3* boundsMax)
+{
+    const Mesh& mesh = app->meshes[app->models[entity.modelIndex].meshIdx];
+    TransformBoundingBox(entity.worldMatrix, mesh.boundsMin, mesh.boundsMax, boundsMin, boundsMax);
+}
+
+struct OccludeeTestJob
+{
+    App*             app;
+    std::atomic<u32> occludedCount;
+};
+
+static void TestOccludees(void* userData, u32 begin, u32 end)
+{
+    OccludeeTestJob* job = (OccludeeTestJob*)userData;
+    App* app = job->app;
+    std::vector<u8>& visible = app->entitySpheres.visible;
+    u32 occludedCount = 0;
+
+    // Each batch writes its own range of the flags
+    for (u32 i = begin; i < end; ++i)
+    {
+        if (!visible[i]) continue;
+
+        vec3 boundsMin, boundsMax;
+        GetEntityBounds(app, app->entities[i], &boundsMin, &boundsMax);
+        if (IsBoxOccluded(app->occlusionBuffer, app->viewProjection, boundsMin, boundsMax))
+        {
+            visible[i] = 0;
+            occludedCount++;
+        }
+    }
+
+    job->occludedCount += occludedCount;
+}
 
-    //LIGHTS
-    PassLightsToCurrentProgram(programModel, app);
+static void CullOccludedEntities(App* app)
+{
+    const f64 startTime = glfwGetTime();
+    OcclusionBuffer& buffer = app->occlusionBuffer;
+    BeginOcclusionFrame(buffer);
 
-    //Camera to Shder
-    PassCameraPositionToCurrentProgram(programModel, app);
+    // Occluders outside of the frustum can not cover anything on screen. The occluder is inside
+    // the entity's own box, so it never hides the entity that owns it.
+    for (u32 i = 0; i < app->entities.size(); ++i)
+    {
+        const Entity& entity = app->entities[i];
+        if (!entity.isOccluder || !app->entitySpheres.visible[i]) continue;
 
-    //Matrix
-    float aspectRatio = (float)app->displaySize.x / (float)app->displaySize.y;
-    float znear = 0.1f;
-    float zfar = 1000.0f;
+        const Mesh& mesh = app->meshes[app->models[entity.modelIndex].meshIdx];
+        if (mesh.occluderIndices.empty()) continue;
+        AddOccluder(buffer, app->viewProjection * entity.worldMatrix,
+                    mesh.occluderVertices.data(), mesh.occluderIndices.data(), (u32)mesh.occluderIndices.size());
+    }
 
-    mat4 projection = glm::perspective(glm::radians(app->camera.zoom), aspectRatio, znear, zfar);
-    mat4 view = app->camera.GetViewMatrix();
+    u32 occludedCount = 0;
+    if (!buffer.triangles.empty())
+    {
+        RasterizeOccluders(buffer);
+
+        OccludeeTestJob job;
+        job.app = app;
+        job.occludedCount = 0;
+        ParallelFor((u32)app->entities.size(), OCCLUSION_TEST_BATCH_SIZE, TestOccludees, &job);
+        occludedCount = job.occludedCount;
+    }
+
+    app->occludedEntityCount = occludedCount;
+    app->visibleEntityCount -= occludedCount;
+    app->occlusionTime = glfwGetTime() - startTime;
+}
 
-    for (int i = 0; i < app->entities.size(); i++)
+void CullEntities(App* app)
+{
+    CullingSpheres& spheres = app->entitySpheres;
+    if (GetCullingMode(app) != CULLING_CPU)
     {
+        ResizeCullingSpheres(spheres, 0);
+        app->visibleEntityCount = (u32)app->entities.size();
+        app->entityCullingTime = 0.0;
+        app->occludedEntityCount = 0;
+        app->occlusionTime = 0.0;
+        return;
+    }
 
-        mat4 world = app->entities[i].worldMatrix;
+    const f64 startTime = glfwGetTime();
 
-        world = TransformPositionScale(app->entities[i].position, vec3(0.45f));
+    if (app->useEntityBvh)
+    {
+        // Only the visibility flags are used, the spheres are not written
+        std::vector<u32>& visibleEntities = app->bvhQueryItems;
+        visibleEntities.clear();
+        QueryBvhFrustum(app->entityBvh, app->frustumPlanes, visibleEntities);
+
+        spheres.count = (u32)app->entities.size();
+        spheres.visible.assign(spheres.count, 0);
+        for (u32 entityIdx : visibleEntities)
+            spheres.visible[entityIdx] = 1;
+        app->visibleEntityCount = (u32)visibleEntities.size();
+    }
+    else
+    {
+        ResizeCullingSpheres(spheres, (u32)app->entities.size());
+        for (u32 i = 0; i < app->entities.size(); ++i)
+        {
+            const Entity& entity = app->entities[i];
+            const Mesh& mesh = app->meshes[app->models[entity.modelIndex].meshIdx];
+            SetCullingSphere(spheres, i, TransformBoundingSphere(entity.worldMatrix, mesh.boundingSphere));
+        }
+        app->visibleEntityCount = CullSpheres(app->frustumPlanes, spheres);
+    }
 
-        int worldMatrixLocation = glGetUniformLocation(programModel.handle, "uWorldMatrix");
-        glUniformMatrix4fv(worldMatrixLocation, 1, GL_FALSE, glm::value_ptr(world));
+    app->entityCullingTime = glfwGetTime() - startTime;
 
-        mat4 worldViewProjection = projection * view * world;
+    app->occludedEntityCount = 0;
+    app->occlusionTime = 0.0;
+    if (app->useSoftwareOcclusion)
+        CullOccludedEntities(app);
+}
 
-        int worldProjectionMatrixLocation = glGetUniformLocation(programModel.handle, "uWorldViewProjectionMatrix");
-        glUniformMatrix4fv(worldProjectionMatrixLocation, 1, GL_FALSE, glm::value_ptr(worldViewProjection));
+void UpdateEntityBvh(App* app)
+{
+    Bvh& bvh = app->entityBvh;
+    const u32 entityCount = (u32)app->entities.size();
 
-        RenderModel(app, app->entities[i], programModel);
+    if (GetBvhItemCount(bvh) != entityCount)
+    {
+        std::vector<vec3> boundsMin(entityCount);
+        std::vector<vec3> boundsMax(entityCount);
+        for (u32 i = 0; i < entityCount; ++i)
+            GetEntityBounds(app, app->entities[i], &boundsMin[i], &boundsMax[i]);
+        BuildBvh(bvh, boundsMin.data(), boundsMax.data(), entityCount);
+        return;
     }
 
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    // Entities that did not move are skipped by SetBvhItemBounds
+    for (u32 i = 0; i < entityCount; ++i)
+    {
+        vec3 boundsMin, boundsMax;
+        GetEntityBounds(app, app->entities[i], &boundsMin, &boundsMax);
+        SetBvhItemBounds(bvh, i, boundsMin, boundsMax);
+    }
+    UpdateBvh(bvh);
+}
 
-    DrawDice(app);
+// Deterministic, so that runs of the benchmark can be compared
+static f32 RandomFloat(u32& seed)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return (seed & 0xffffff) / 16777216.0f;
 }
 
-void PassCameraPositionToCurrentProgram(Program& programModel, App* app)
+static vec3 RandomVec3(u32& seed, f32 halfSize)
 {
-    int cameraLocation = glGetUniformLocation(programModel.handle, "uCameraPosition");
-    glUniform3fv(cameraLocation, 1, glm::value_ptr(app->camera.position));
+    return vec3(RandomFloat(seed), RandomFloat(seed), RandomFloat(seed)) * (2.0f * halfSize) - halfSize;
 }
 
-void PassLightsToCurrentProgram(Program& programModel, App* app)
+void BenchmarkEntityBvh(App* app)
 {
-    int lightsCountLocation = glGetUniformLocation(programModel.handle, "lightCount");
-    glUniform1ui(lightsCountLocation, app->lights.size());
+    const u32 itemCount = 131072;
+    const u32 buildIterations = 3;
+    const u32 refitFrames = 60;
+    const u32 movedPerFrame = itemCount / 10;
+    const u32 frustumQueryCount = 100;
+    const u32 queryCount = 10000;
+    const f32 worldHalfSize = 1000.0f;
+    const f32 queryRadius = 20.0f;
+
+    // Boxes about the size of the entities, scattered around the camera
+    u32 seed = 0x9e3779b9u;
+    std::vector<vec3> boundsMin(itemCount);
+    std::vector<vec3> boundsMax(itemCount);
+    for (u32 i = 0; i < itemCount; ++i)
+    {
+        const vec3 center = app->camera.position + RandomVec3(seed, worldHalfSize);
+        const vec3 extents = vec3(0.25f) + vec3(RandomFloat(seed), RandomFloat(seed), RandomFloat(seed)) * 2.0f;
+        boundsMin[i] = center - extents;
+        boundsMax[i] = center + extents;
+    }
 
-    int lightNum = 0;
+    Bvh bvh = {};
+    f64 start = glfwGetTime();
+    for (u32 i = 0; i < buildIterations; ++i)
+        BuildBvh(bvh, boundsMin.data(), boundsMax.data(), itemCount);
+    const f64 buildTime = (glfwGetTime() - start) / buildIterations;
+
+    // A tenth of the items move a bit every frame, and now and then some jump across the world
+    u32 refitNodeCount = 0;
+    u32 rebuiltSubtreeCount = 0;
+    start = glfwGetTime();
+    for (u32 frame = 0; frame < refitFrames; ++frame)
+    {
+        const f32 maxOffset = frame % 20 == 19 ? 100.0f : 1.0f;
+        for (u32 i = 0; i < movedPerFrame; ++i)
+        {
+            const u32 itemIdx = (u32)(RandomFloat(seed) * itemCount) % itemCount;
+            const vec3 offset = RandomVec3(seed, maxOffset);
+            boundsMin[itemIdx] += offset;
+            boundsMax[itemIdx] += offset;
+            SetBvhItemBounds(bvh, itemIdx, boundsMin[itemIdx], boundsMax[itemIdx]);
+        }
+        UpdateBvh(bvh);
+        refitNodeCount += bvh.refitNodeCount;
+        rebuiltSubtreeCount += bvh.rebuiltSubtreeCount;
+    }
+    const f64 refitTime = (glfwGetTime() - start) / refitFrames;
 
-    for (int i = 0; i < app->lights.size(); i++)
+    std::vector<u32>& items = app->bvhQueryItems;
+    u64 frustumItemCount = 0;
+    start = glfwGetTime();
+    for (u32 i = 0; i < frustumQueryCount; ++i)
     {
-        int location = -1;
-        std::string posStr = "lights[" + std::to_string(lightNum) + "]";
-        location = glGetUniformLocation(programModel.handle, (posStr + ".type").c_str());
-        glUniform1ui(location, (u32)app->lights[i].type);
-        location = glGetUniformLocation(programModel.handle, (posStr + ".color").c_str());
-        glUniform3fv(location, 1, glm::value_ptr(app->lights[i].color));
-        location = glGetUniformLocation(programModel.handle, (posStr + ".position").c_str());
-        glUniform3fv(location, 1, glm::value_ptr(app->lights[i].position));
-        location = glGetUniformLocation(programModel.handle, (posStr + ".direction").c_str());
-        glUniform3fv(location, 1, glm::value_ptr(app->lights[i].direction));
-        lightNum++;
+        items.clear();
+        QueryBvhFrustum(bvh, app->frustumPlanes, items);
+        frustumItemCount += items.size();
     }
-}
+    const f64 frustumTime = (glfwGetTime() - start) / frustumQueryCount;
 
-void DrawDice(App* app)
-{
-    glClearColor(0.1f, 0.1f, 0.1f, 0.0f);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glPushDebugGroup(GL_DEBUG_SOURCE_APPLICATION, 1, -1, "Dice Texture");
+    // The same centers for the tree and for the linear scan it is compared with
+    std::vector<vec3> queryCenters(queryCount);
+    for (vec3& center : queryCenters)
+        center = app->camera.position + RandomVec3(seed, worldHalfSize);
 
-    // - bind the program 
-    Program programTexturedGeometry = app->programs[app->forwardQuadProgramIdx];
-    if (app->renderMode == RenderMode::DEFERRED)
+    u64 sphereItemCount = 0;
+    start = glfwGetTime();
+    for (const vec3& center : queryCenters)
     {
-        programTexturedGeometry = app->programs[app->deferredQuadProgramIdx];
+        items.clear();
+        QueryBvhSphere(bvh, center, queryRadius, items);
+        sphereItemCount += items.size();
     }
+    const f64 sphereTime = glfwGetTime() - start;
 
-    if (app->renderMode == RenderMode::FORWARD && app->currentRenderTargetMode == RenderTargetsMode::DEPTH)
+    u64 linearItemCount = 0;
+    const u32 linearQueryCount = queryCount / 100;
+    start = glfwGetTime();
+    for (u32 q = 0; q < linearQueryCount; ++q)
     {
-        programTexturedGeometry = app->programs[app->depthProgramIdx];
+        const vec3& center = queryCenters[q];
+        for (u32 i = 0; i < itemCount; ++i)
+        {
+            const vec3 offset = center - glm::clamp(center, boundsMin[i], boundsMax[i]);
+            linearItemCount += glm::dot(offset, offset) <= queryRadius * queryRadius ? 1 : 0;
+        }
     }
+    const f64 linearTime = glfwGetTime() - start;
 
+    u64 boxItemCount = 0;
+    start = glfwGetTime();
+    for (const vec3& center : queryCenters)
+    {
+        items.clear();
+        QueryBvhBox(bvh, center - vec3(queryRadius), center + vec3(queryRadius), items);
+        boxItemCount += items.size();
+    }
+    const f64 boxTime = glfwGetTime() - start;
 
-    glUseProgram(programTexturedGeometry.handle);
-    glBindVertexArray(app->vao);
+    u32 rayHitCount = 0;
+    start = glfwGetTime();
+    for (const vec3& center : queryCenters)
+    {
+        f32 hitDistance;
+        if (RaycastBvh(bvh, app->camera.position, center - app->camera.position, 1.0f, &hitDistance) != UINT32_MAX)
+            rayHitCount++;
+    }
+    const f64 rayTime = glfwGetTime() - start;
+
+    ILOG("Entity BVH benchmark (%u boxes, %u nodes)", itemCount, (u32)bvh.nodes.size());
+    ILOG("    build:   %.2f ms (%.1f M boxes/s)", buildTime * 1000.0, itemCount / buildTime / 1e6);
+    ILOG("    refit:   %.2f ms per frame moving %u boxes (%u nodes refit, %u subtrees built again per frame)",
+         refitTime * 1000.0, movedPerFrame, refitNodeCount / refitFrames, rebuiltSubtreeCount / refitFrames);
+    ILOG("    frustum: %.3f ms per query (%u boxes visible)", frustumTime * 1000.0, (u32)(frustumItemCount / frustumQueryCount));
+    ILOG("    sphere:  %.0f queries/s (%.1f boxes each), linear scan %.0f queries/s (%.1f boxes each)",
+         queryCount / sphereTime, (f64)sphereItemCount / queryCount, linearQueryCount / linearTime, (f64)linearItemCount / linearQueryCount);
+    ILOG("    box:     %.0f queries/s (%.1f boxes each)", queryCount / boxTime, (f64)boxItemCount / queryCount);
+    ILOG("    ray:     %.0f rays/s (%u hits)", queryCount / rayTime, rayHitCount);
+}
 
-    if (app->renderMode == RenderMode::DEFERRED) {
-        int renderModeLocation = glGetUniformLocation(programTexturedGeometry.handle, "renderTargetMode");
-        glUniform1ui(renderModeLocation, (u32)app->currentRenderTargetMode);
+void WriteDrawCommands(App* app)
+{
+    UniformRing& ring = app->uniforms;
+    GpuCulling& gpuCulling = app->gpuCulling;
+    const std::vector<DrawItem>& items = app->renderQueue.items;
+    const CullingMode cullingMode = GetCullingMode(app);
+    gpuCulling.cullDrawsOffset = UINT32_MAX;
+    app->visibleInstanceCount = 0;
+    app->totalInstanceCount = 0;
+    if (items.empty())
+        return;
 
-        PassLightsToCurrentProgram(programTexturedGeometry, app);
-        PassCameraPositionToCurrentProgram(programTexturedGeometry, app);
+    // Culled draws get their own copy of the matrices of their visible instances
+    u32 visibleCapacity = 0;
+    u32 maxInstanceCount = 0;
+    for (const DrawItem& item : items)
+    {
+        const u32 instanceCount = app->instanceGroups[item.groupIdx].instanceCount;
+        visibleCapacity += instanceCount;
+        maxInstanceCount = glm::max(maxInstanceCount, instanceCount);
     }
 
+    const u32 paramsOffset = AllocateUniformBlock(app, (u32)items.size() * (u32)sizeof(DrawParams));
+    const u32 commandsOffset = paramsOffset == UINT32_MAX ? UINT32_MAX : AllocateUniformBlock(app, (u32)items.size() * (u32)sizeof(DrawElementsIndirectCommand));
+    u32 cullingOffset = 0;
+    if (commandsOffset != UINT32_MAX && cullingMode == CULLING_CPU)
+        cullingOffset = AllocateUniformBlock(app, visibleCapacity * (u32)sizeof(mat4));
+    else if (commandsOffset != UINT32_MAX && cullingMode == CULLING_GPU)
+        cullingOffset = AllocateUniformBlock(app, (u32)items.size() * (u32)sizeof(CullDraw));
+    if (commandsOffset == UINT32_MAX || cullingOffset == UINT32_MAX)
+    {
+        for (const InstanceGroup& group : app->instanceGroups)
+            ring.droppedEntityCount += group.instanceCount;
+        return;
+    }
 
-    // - set the blending state
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    glUniform1i(app->programUniformTexture, 0);
+    u8* regionMemory = GetUniformRegionMemory(ring);
+    DrawParams* params = (DrawParams*)(regionMemory + paramsOffset);
+    DrawElementsIndirectCommand* commands = (DrawElementsIndirectCommand*)(regionMemory + commandsOffset);
+    u32 firstVisibleMatrix = 0;
+    for (u32 i = 0; i < items.size(); ++i)
+    {
+        const DrawItem& item = items[i];
+        const InstanceGroup& group = app->instanceGroups[item.groupIdx];
+        const Submesh& submesh = app->meshes[app->models[group.modelIdx].meshIdx].submeshes[item.submeshIdx];
+        const u32 localParamsIdx = group.firstLocalParams + item.submeshIdx;
 
-    if (app->renderMode == RenderMode::FORWARD) {
-        glActiveTexture(GL_TEXTURE0);
-        switch (app->currentRenderTargetMode)
+        params[i] = { group.firstWorldMatrix, localParamsIdx };
+        commands[i] = { submesh.indexCount, group.instanceCount, submesh.firstIndex, (i32)submesh.baseVertex, i };
+
+        if (cullingMode == CULLING_CPU)
         {
-        case RenderTargetsMode::ALBEDO:
-            glBindTexture(GL_TEXTURE_2D, app->colorAttachmentHandle);
-            break;
-        case RenderTargetsMode::NORMALS:
-            glBindTexture(GL_TEXTURE_2D, app->normalAttachmentHandle);
-            break;
-        case RenderTargetsMode::POSITION:
-            glBindTexture(GL_TEXTURE_2D, app->positionAttachmentHandle);
-            break;
-        case RenderTargetsMode::DEPTH: 
-            glBindTexture(GL_TEXTURE_2D, app->depthAttachmentHandle); 
-            break;
-        case RenderTargetsMode::FINAL_RENDER:
-            glBindTexture(GL_TEXTURE_2D, app->finalRenderAttachmentHandle);
-            break;
-        default:
-            break;
+            mat4* visibleMatrices = (mat4*)(regionMemory + cullingOffset) + firstVisibleMatrix;
+            u32 visibleCount = 0;
+            for (u32 j = 0; j < group.instanceCount; ++j)
+            {
+                const mat4& worldMatrix = app->instanceWorldMatrices[group.firstInstance + j];
+                if (IsBoxInFrustum(app->frustumPlanes, worldMatrix, submesh.boundsMin, submesh.boundsMax))
+                    visibleMatrices[visibleCount++] = worldMatrix;
+            }
+            params[i].firstWorldMatrix = cullingOffset / (u32)sizeof(mat4) + firstVisibleMatrix;
+            commands[i].instanceCount = visibleCount;
+            app->visibleInstanceCount += visibleCount;
+        }
+        else if (cullingMode == CULLING_GPU)
+        {
+            // The shader counts the visible instances up from 0, into its copy of the commands
+            CullDraw& cullDraw = ((CullDraw*)(regionMemory + cullingOffset))[i];
+            cullDraw = {};
+            cullDraw.boundsMin = submesh.boundsMin;
+            cullDraw.boundsMax = submesh.boundsMax;
+            cullDraw.firstWorldMatrix = group.firstWorldMatrix;
+            cullDraw.instanceCount = group.instanceCount;
+            cullDraw.firstVisibleMatrix = firstVisibleMatrix;
+            params[i].firstWorldMatrix = firstVisibleMatrix;
+            commands[i].instanceCount = 0;
         }
-        GLuint colorTextureLocation = glGetUniformLocation(programTexturedGeometry.handle, "uColor");
-        glUniform1i(colorTextureLocation, 0);
 
+        firstVisibleMatrix += group.instanceCount;
+        app->totalInstanceCount += group.instanceCount;
     }
-    else {
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, app->colorAttachmentHandle);
-        GLuint colorLocation = glGetUniformLocation(programTexturedGeometry.handle, "uColor");
-        glUniform1i(colorLocation, 0);
-
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, app->normalAttachmentHandle);
-        GLuint normalsTextureLocation = glGetUniformLocation(programTexturedGeometry.handle, "uNormals");
-        glUniform1i(normalsTextureLocation, 1);
 
-        glActiveTexture(GL_TEXTURE2);
-        glBindTexture(GL_TEXTURE_2D, app->positionAttachmentHandle);
-        GLuint positionTextureLocation = glGetUniformLocation(programTexturedGeometry.handle, "uPosition");
-        glUniform1i(positionTextureLocation, 2);
-
-        glActiveTexture(GL_TEXTURE3);
-        glBindTexture(GL_TEXTURE_2D, app->depthAttachmentHandle);
-        GLuint depthTextureLocation = glGetUniformLocation(programTexturedGeometry.handle, "uDepth");
-        glUniform1i(depthTextureLocation, 3);
+    const u32 regionOffset = ring.frameIdx * UNIFORM_RING_FRAME_SIZE;
+    ring.drawParamsOffset = regionOffset + paramsOffset;
+    ring.drawCommandsOffset = regionOffset + commandsOffset;
+    ring.blockCount += cullingMode == CULLING_NONE ? 2 : 3;
+    if (cullingMode == CULLING_GPU)
+    {
+        gpuCulling.cullDrawsOffset = regionOffset + cullingOffset;
+        gpuCulling.maxInstanceCount = maxInstanceCount;
+        gpuCulling.visibleCapacity = visibleCapacity;
     }
+}
 
-    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
-    glBindVertexArray(0);
-    glUseProgram(0);
-    glPopDebugGroup();
+void InitGpuCulling(App* app)
+{
+    GpuCulling& culling = app->gpuCulling;
+    culling.stageIdx = FindShaderStage(app, GL_COMPUTE_SHADER, "Shaders/cull_instances.glsl", "CULL_INSTANCES", std::string());
+    culling.cullDrawsOffset = UINT32_MAX;
+    glGenProgramPipelines(1, &culling.pipeline);
+    glGenBuffers(1, &culling.buffer);
+
+    // Level 0 is half the depth attachment, and the levels go down to 1x1
+    HiZPyramid& hiZ = app->hiZ;
+    hiZ.stageIdx = FindShaderStage(app, GL_COMPUTE_SHADER, "Shaders/hiz_downsample.glsl", "HIZ_DOWNSAMPLE", std::string());
+    hiZ.size = glm::max(app->displaySize / 2, ivec2(1));
+    hiZ.levelCount = 1;
+    while ((hiZ.size.x >> hiZ.levelCount) > 0 || (hiZ.size.y >> hiZ.levelCount) > 0)
+        hiZ.levelCount++;
+    glGenProgramPipelines(1, &hiZ.pipeline);
+    glGenTextures(1, &hiZ.texture);
+    BindTexture(app, HIZ_TEXTURE_UNIT, GL_TEXTURE_2D, hiZ.texture);
+    glTexStorage2D(GL_TEXTURE_2D, hiZ.levelCount, GL_R32F, hiZ.size.x, hiZ.size.y);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 }
 
+// Reads the culled commands back, which waits for the GPU, and compares them with culling on the CPU
+static void VerifyGpuCulling(App* app)
+{
+    const GpuCulling& culling = app->gpuCulling;
+    const std::vector<DrawItem>& items = app->renderQueue.items;
 
+    const bool occlusionTested = app->hiZ.isValid && app->useOcclusionCulling;
 
-void RenderModel(App* app, Entity entity,Program texturedMeshProgram)
-{
-    Model& model = app->models[entity.modelIndex];
-    Mesh& mesh = app->meshes[model.meshIdx];
+    std::vector<DrawElementsIndirectCommand> commands(items.size());
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    BindBuffer(app, GL_COPY_READ_BUFFER, culling.buffer);
+    glGetBufferSubData(GL_COPY_READ_BUFFER, 0, commands.size() * sizeof(DrawElementsIndirectCommand), commands.data());
 
-    for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+    u32 mismatchCount = 0;
+    u32 gpuVisibleCount = 0;
+    u32 cpuVisibleCount = 0;
+    for (u32 i = 0; i < items.size(); ++i)
     {
-        GLuint vao = FindVAO(mesh, i, texturedMeshProgram);
-        glBindVertexArray(vao);
+        const InstanceGroup& group = app->instanceGroups[items[i].groupIdx];
+        const Submesh& submesh = app->meshes[app->models[group.modelIdx].meshIdx].submeshes[items[i].submeshIdx];
 
-        u32 submeshMaterialIdx = model.materialIdx[i];
-        Material& submeshMaterial = app->materials[submeshMaterialIdx];
+        u32 visibleCount = 0;
+        for (u32 j = 0; j < group.instanceCount; ++j)
+            visibleCount += IsBoxInFrustum(app->frustumPlanes, app->instanceWorldMatrices[group.firstInstance + j], submesh.boundsMin, submesh.boundsMax) ? 1 : 0;
 
-        if (submeshMaterial.albedoTextureIdx < app->textures.size()) {
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, app->textures[submeshMaterial.albedoTextureIdx].handle);
-            int textureLocation = glGetUniformLocation(texturedMeshProgram.handle, "uTexture");
-            glUniform1i(textureLocation, 0);
-        }
-        Submesh& submesh = mesh.submeshes[i];
-        glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(u64)submesh.indexOffset);
+        // Occlusion can only remove instances that are in the frustum
+        mismatchCount += (occlusionTested ? commands[i].instanceCount > visibleCount : commands[i].instanceCount != visibleCount) ? 1 : 0;
+        gpuVisibleCount += commands[i].instanceCount;
+        cpuVisibleCount += visibleCount;
     }
-    glBindTexture(GL_TEXTURE_2D, 0);
+
+    ILOG("GPU culling check: %u draws, %u visible instances on the GPU and %u on the CPU, %u draws differ",
+         (u32)items.size(), gpuVisibleCount, cpuVisibleCount, mismatchCount);
+    if (occlusionTested)
+        ILOG("    %u instances in the frustum occluded by the Hi-Z pyramid", cpuVisibleCount - glm::min(gpuVisibleCount, cpuVisibleCount));
 }
 
-void ProcessAssimpMesh(const aiScene* scene, aiMesh* mesh, Mesh* myMesh, u32 baseMeshMaterialIndex, std::vector<u32>& submeshMaterialIndices)
+void CullDrawsOnGpu(App* app)
 {
-    std::vector<float> vertices;
-    std::vector<u32> indices;
+    GpuCulling& culling = app->gpuCulling;
+    const UniformRing& ring = app->uniforms;
+    if (culling.cullDrawsOffset == UINT32_MAX)
+        return;
 
-    bool hasTexCoords = false;
-    bool hasTangentSpace = false;
+    // HotReloadPrograms detaches a stage it builds again, which is attached here the first time it is ready
+    const ShaderStage& stage = app->shaderStages[culling.stageIdx];
+    if (culling.attachedStageHandle != stage.handle)
+    {
+        glUseProgramStages(culling.pipeline, GL_COMPUTE_SHADER_BIT, stage.handle);
+        culling.attachedStageHandle = stage.handle;
+    }
 
-    // process vertices
-    for (unsigned int i = 0; i < mesh->mNumVertices; i++)
+    const u32 drawCount = (u32)app->renderQueue.items.size();
+    const u32 commandsSize = drawCount * (u32)sizeof(DrawElementsIndirectCommand);
+    const u32 alignment = (u32)app->storageBufferAlignment;
+    culling.visibleMatricesOffset = (commandsSize + alignment - 1) / alignment * alignment;
+    const u32 requiredSize = culling.visibleMatricesOffset + culling.visibleCapacity * (u32)sizeof(mat4);
+    if (requiredSize > culling.bufferSize)
     {
-        vertices.push_back(mesh->mVertices[i].x);
-        vertices.push_back(mesh->mVertices[i].y);
-        vertices.push_back(mesh->mVertices[i].z);
-        vertices.push_back(mesh->mNormals[i].x);
-        vertices.push_back(mesh->mNormals[i].y);
-        vertices.push_back(mesh->mNormals[i].z);
+        culling.bufferSize = glm::max(requiredSize, culling.bufferSize * 2);
+        BindBuffer(app, GL_COPY_WRITE_BUFFER, culling.buffer);
+        glBufferData(GL_COPY_WRITE_BUFFER, culling.bufferSize, NULL, GL_DYNAMIC_COPY);
+    }
 
-        if (mesh->mTextureCoords[0]) // does the mesh contain texture coordinates?
-        {
-            hasTexCoords = true;
-            vertices.push_back(mesh->mTextureCoords[0][i].x);
-            vertices.push_back(mesh->mTextureCoords[0][i].y);
-        }
+    // The commands start with no instances, the shader adds the visible ones
+    BindBuffer(app, GL_COPY_READ_BUFFER, ring.handle);
+    BindBuffer(app, GL_COPY_WRITE_BUFFER, culling.buffer);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, ring.drawCommandsOffset, 0, commandsSize);
 
-        if (mesh->mTangents != nullptr && mesh->mBitangents)
-        {
-            hasTangentSpace = true;
-            vertices.push_back(mesh->mTangents[i].x);
-            vertices.push_back(mesh->mTangents[i].y);
-            vertices.push_back(mesh->mTangents[i].z);
-
-            // For some reason ASSIMP gives me the bitangents flipped.
-            // Maybe it's my fault, but when I generate my own geometry
-            // in other files (see the generation of standard assets)
-            // and all the bitangents have the orientation I expect,
-            // everything works ok.
-            // I think that (even if the documentation says the opposite)
-            // it returns a left-handed tangent space matrix.
-            // SOLUTION: I invert the components of the bitangent here.
-            vertices.push_back(-mesh->mBitangents[i].x);
-            vertices.push_back(-mesh->mBitangents[i].y);
-            vertices.push_back(-mesh->mBitangents[i].z);
-        }
-    }
+    const u32 regionOffset = ring.frameIdx * UNIFORM_RING_FRAME_SIZE;
+    BindBufferRange(app, GL_SHADER_STORAGE_BUFFER, STORAGE_BINDING_WORLD_MATRICES, ring.handle, regionOffset, UNIFORM_RING_FRAME_SIZE);
+    BindBufferRange(app, GL_SHADER_STORAGE_BUFFER, STORAGE_BINDING_CULL_DRAWS, ring.handle, culling.cullDrawsOffset, drawCount * sizeof(CullDraw));
+    BindBufferRange(app, GL_SHADER_STORAGE_BUFFER, STORAGE_BINDING_DRAW_COMMANDS, culling.buffer, 0, commandsSize);
+    BindBufferRange(app, GL_SHADER_STORAGE_BUFFER, STORAGE_BINDING_VISIBLE_MATRICES, culling.buffer, culling.visibleMatricesOffset, culling.visibleCapacity * sizeof(mat4));
+
+    if (app->hiZ.isValid && app->useOcclusionCulling)
+        BindTexture(app, HIZ_TEXTURE_UNIT, GL_TEXTURE_2D, app->hiZ.texture);
 
-    // process indices
-    for (unsigned int i = 0; i < mesh->mNumFaces; i++)
+    BindProgramPipeline(app, culling.pipeline);
+    glDispatchCompute((culling.maxInstanceCount + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, drawCount, 1);
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+
+    if (culling.verifyNextFrame)
     {
-        aiFace face = mesh->mFaces[i];
-        for (unsigned int j = 0; j < face.mNumIndices; j++)
-        {
-            indices.push_back(face.mIndices[j]);
-        }
+        VerifyGpuCulling(app);
+        culling.verifyNextFrame = false;
     }
+}
 
-    // store the proper (previously proceessed) material for this mesh
-    submeshMaterialIndices.push_back(baseMeshMaterialIndex + mesh->mMaterialIndex);
+void BuildHiZPyramid(App* app, const mat4& viewProjection)
+{
+    HiZPyramid& hiZ = app->hiZ;
+    hiZ.isValid = false;
+    if (!app->useOcclusionCulling || GetCullingMode(app) != CULLING_GPU)
+        return;
 
-    // create the vertex format
-    VertexBufferLayout vertexBufferLayout = {};
-    vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 0, 3, 0 });
-    vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 1, 3, 3 * sizeof(float) });
-    vertexBufferLayout.stride = 6 * sizeof(float);
-    if (hasTexCoords)
+    // HotReloadPrograms detaches a stage it builds again, which is attached here the first time it is ready
+    ShaderStage& stage = app->shaderStages[hiZ.stageIdx];
+    if (!IsShaderStageReady(app, stage))
+        return;
+    if (hiZ.attachedStageHandle != stage.handle)
     {
-        vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 2, 2, vertexBufferLayout.stride });
-        vertexBufferLayout.stride += 2 * sizeof(float);
+        glUseProgramStages(hiZ.pipeline, GL_COMPUTE_SHADER_BIT, stage.handle);
+        hiZ.attachedStageHandle = stage.handle;
     }
-    if (hasTangentSpace)
-    {
-        vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 3, 3, vertexBufferLayout.stride });
-        vertexBufferLayout.stride += 3 * sizeof(float);
 
-        vertexBufferLayout.attributes.push_back(VertexBufferAttribute{ 4, 3, vertexBufferLayout.stride });
-        vertexBufferLayout.stride += 3 * sizeof(float);
+    glPushDebugGroup(GL_DEBUG_SOURCE_APPLICATION, 1, -1, "Hi-Z Pyramid");
+    BindProgramPipeline(app, hiZ.pipeline);
+
+    // Each level reads the one before, so it waits for its writes to be visible to texel fetches
+    ivec2 sourceSize = app->displaySize;
+    for (u32 level = 0; level < hiZ.levelCount; ++level)
+    {
+        const ivec2 levelSize = glm::max(sourceSize / 2, ivec2(1));
+        BindTexture(app, HIZ_TEXTURE_UNIT, GL_TEXTURE_2D, level == 0 ? app->depthAttachmentHandle : hiZ.texture);
+        glProgramUniform1i(stage.handle, HIZ_UNIFORM_SOURCE_LEVEL, level == 0 ? 0 : (i32)level - 1);
+        glProgramUniform2i(stage.handle, HIZ_UNIFORM_SOURCE_SIZE, sourceSize.x, sourceSize.y);
+        glBindImageTexture(HIZ_IMAGE_UNIT, hiZ.texture, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+        glDispatchCompute((levelSize.x + HIZ_GROUP_SIZE - 1) / HIZ_GROUP_SIZE, (levelSize.y + HIZ_GROUP_SIZE - 1) / HIZ_GROUP_SIZE, 1);
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+        sourceSize = levelSize;
     }
 
-    // add the submesh into the mesh
-    Submesh submesh = {};
-    submesh.vertexBufferLayout = vertexBufferLayout;
-    submesh.vertices.swap(vertices);
-    submesh.indices.swap(indices);
-    myMesh->submeshes.push_back(submesh);
+    glPopDebugGroup();
+    hiZ.viewProjection = viewProjection;
+    hiZ.isValid = true;
 }
 
-void ProcessAssimpMaterial(App* app, aiMaterial* material, Material& myMaterial, String directory)
+void InitDepthPrepass(App* app)
 {
-    aiString name;
-    aiColor3D diffuseColor;
-    aiColor3D emissiveColor;
-    aiColor3D specularColor;
-    ai_real shininess;
-    material->Get(AI_MATKEY_NAME, name);
-    material->Get(AI_MATKEY_COLOR_DIFFUSE, diffuseColor);
-    material->Get(AI_MATKEY_COLOR_EMISSIVE, emissiveColor);
-    material->Get(AI_MATKEY_COLOR_SPECULAR, specularColor);
-    material->Get(AI_MATKEY_SHININESS, shininess);
+    DepthPrepass& prepass = app->depthPrepass;
+    prepass.programIdx = LoadProgram(app, "Shaders/depth_prepass.glsl", "DEPTH_PREPASS", "Shaders/depth_prepass.glsl", "DEPTH_PREPASS", UINT32_MAX);
+    glGenQueries(DEPTH_PREPASS_QUERY_FRAMES, prepass.prepassQueries);
+    glGenQueries(DEPTH_PREPASS_QUERY_FRAMES, prepass.forwardQueries);
+}
 
-    myMaterial.name = name.C_Str();
-    myMaterial.albedo = vec3(diffuseColor.r, diffuseColor.g, diffuseColor.b);
-    myMaterial.emissive = vec3(emissiveColor.r, emissiveColor.g, emissiveColor.b);
-    myMaterial.smoothness = shininess / 256.0f;
+void DrawDepthPrepass(App* app)
+{
+    DepthPrepass& prepass = app->depthPrepass;
+    prepass.isEnabled = false;
+    if (app->renderMode != RenderMode::FORWARD)
+        return;
 
-    aiString aiFilename;
-    if (material->GetTextureCount(aiTextureType_DIFFUSE) > 0)
+    // Issued DEPTH_PREPASS_QUERY_FRAMES frames ago, so the results are there already
+    prepass.queryIdx = (prepass.queryIdx + 1) % DEPTH_PREPASS_QUERY_FRAMES;
+    const u32 queryIdx = prepass.queryIdx;
+    if (prepass.isQueryPending[queryIdx])
     {
-        material->GetTexture(aiTextureType_DIFFUSE, 0, &aiFilename);
-        String filename = MakeString(aiFilename.C_Str());
-        String filepath = MakePath(directory, filename);
-        myMaterial.albedoTextureIdx = LoadTexture2D(app, filepath.str);
+        GLuint prepassSamples = 0;
+        GLuint forwardSamples = 0;
+        glGetQueryObjectuiv(prepass.prepassQueries[queryIdx], GL_QUERY_RESULT, &prepassSamples);
+        glGetQueryObjectuiv(prepass.forwardQueries[queryIdx], GL_QUERY_RESULT, &forwardSamples);
+        prepass.isQueryPending[queryIdx] = false;
+        if (forwardSamples > 0)
+            prepass.overdraw = (f32)prepassSamples / (f32)forwardSamples;
     }
-    if (material->GetTextureCount(aiTextureType_EMISSIVE) > 0)
-    {
-        material->GetTexture(aiTextureType_EMISSIVE, 0, &aiFilename);
-        String filename = MakeString(aiFilename.C_Str());
-        String filepath = MakePath(directory, filename);
-        myMaterial.emissiveTextureIdx = LoadTexture2D(app, filepath.str);
-    }
-    if (material->GetTextureCount(aiTextureType_SPECULAR) > 0)
+
+    switch (prepass.mode)
     {
-        material->GetTexture(aiTextureType_SPECULAR, 0, &aiFilename);
-        String filename = MakeString(aiFilename.C_Str());
-        String filepath = MakePath(directory, filename);
-        myMaterial.specularTextureIdx = LoadTexture2D(app, filepath.str);
+    case DEPTH_PREPASS_ON:
+        prepass.isEnabled = true;
+        break;
+    case DEPTH_PREPASS_AUTO:
+        prepass.isEnabled = prepass.overdraw >= DEPTH_PREPASS_MIN_OVERDRAW || ++prepass.framesSinceProbe >= DEPTH_PREPASS_PROBE_INTERVAL;
+        break;
+    default:
+        break;
     }
-    if (material->GetTextureCount(aiTextureType_NORMALS) > 0)
+    if (!prepass.isEnabled || !IsProgramReady(app, prepass.programIdx))
     {
-        material->GetTexture(aiTextureType_NORMALS, 0, &aiFilename);
-        String filename = MakeString(aiFilename.C_Str());
-        String filepath = MakePath(directory, filename);
-        myMaterial.normalsTextureIdx = LoadTexture2D(app, filepath.str);
+        prepass.isEnabled = false;
+        return;
     }
-    if (material->GetTextureCount(aiTextureType_HEIGHT) > 0)
+    prepass.framesSinceProbe = 0;
+
+    glPushDebugGroup(GL_DEBUG_SOURCE_APPLICATION, 1, -1, "Depth Pre-pass");
+    SetColorWriteState(app, false);
+    SetDepthState(app, true, true, GL_LESS);
+    glBeginQuery(GL_SAMPLES_PASSED, prepass.prepassQueries[queryIdx]);
+    SubmitRenderQueue(app, prepass.programIdx);
+    glEndQuery(GL_SAMPLES_PASSED);
+    glPopDebugGroup();
+
+    SetColorWriteState(app, true);
+    SetDepthState(app, true, false, GL_EQUAL);
+    glBeginQuery(GL_SAMPLES_PASSED, prepass.forwardQueries[queryIdx]);
+    prepass.isQueryPending[queryIdx] = true;
+}
+
+void EndDepthPrepass(App* app)
+{
+    if (!app->depthPrepass.isEnabled)
+        return;
+
+    glEndQuery(GL_SAMPLES_PASSED);
+    SetDepthState(app, true, true, GL_LESS);
+}
+
+// What has to be bound to draw an item. Items with the same state can be drawn by the same call
+struct DrawState
+{
+    Program* program;
+    GLuint   vao;
+    GLuint   textureArray;       // 0 if the program does not sample it
+    GLuint   normalTextureArray;
+};
+
+static DrawState GetDrawState(App* app, const DrawItem& item, u32 programOverrideIdx)
+{
+    const InstanceGroup& group = app->instanceGroups[item.groupIdx];
+    const Model& model = app->models[group.modelIdx];
+    const Submesh& submesh = app->meshes[model.meshIdx].submeshes[item.submeshIdx];
+    const Material& material = app->materials[model.materialIdx[item.submeshIdx]];
+    const u32 features = GetMaterialFeatures(app, material, submesh);
+
+    DrawState state = {};
+    state.vao = app->meshPool.vertexFormats[submesh.vertexFormatIdx].vao;
+    if (programOverrideIdx != UINT32_MAX)
     {
-        material->GetTexture(aiTextureType_HEIGHT, 0, &aiFilename);
-        String filename = MakeString(aiFilename.C_Str());
-        String filepath = MakePath(directory, filename);
-        myMaterial.bumpTextureIdx = LoadTexture2D(app, filepath.str);
+        state.program = &GetProgram(app, programOverrideIdx);
+        return state;
     }
 
-    //myMaterial.createNormalFromBump();
+    state.program = &GetProgram(app, item.programIdx);
+    if (features & SHADER_FEATURE_ALBEDO_TEX)
+        state.textureArray = app->textures[material.albedoTextureIdx].handle;
+    if (features & SHADER_FEATURE_NORMAL_MAP)
+        state.normalTextureArray = app->textures[material.normalsTextureIdx].handle;
+    return state;
 }
 
-void ProcessAssimpNode(const aiScene* scene, aiNode* node, Mesh* myMesh, u32 baseMeshMaterialIndex, std::vector<u32>& submeshMaterialIndices)
+static bool IsSameDrawState(const DrawState& a, const DrawState& b)
 {
-    // process all the node's meshes (if any)
-    for (unsigned int i = 0; i < node->mNumMeshes; i++)
+    return a.program->handle == b.program->handle && a.vao == b.vao &&
+           a.textureArray == b.textureArray && a.normalTextureArray == b.normalTextureArray;
+}
+
+void SubmitRenderQueue(App* app, u32 programOverrideIdx)
+{
+    RenderQueue& queue = app->renderQueue;
+    const UniformRing& uniforms = app->uniforms;
+    queue.drawCallCount = 0;
+    if (uniforms.drawCommandsOffset == UINT32_MAX)
+        return;
+
+    // The whole region is bound as the arrays the DrawParams index into, once per frame. When
+    // culled on the GPU, the commands and the world matrices come from the culling buffer instead
+    const GpuCulling& gpuCulling = app->gpuCulling;
+    const u32 regionOffset = uniforms.frameIdx * UNIFORM_RING_FRAME_SIZE;
+    u64 commandsOffset = uniforms.drawCommandsOffset;
+    BindBufferRange(app, GL_SHADER_STORAGE_BUFFER, STORAGE_BINDING_LOCAL_PARAMS, uniforms.handle, regionOffset, UNIFORM_RING_FRAME_SIZE);
+    if (gpuCulling.cullDrawsOffset != UINT32_MAX)
+    {
+        BindBufferRange(app, GL_SHADER_STORAGE_BUFFER, STORAGE_BINDING_WORLD_MATRICES, gpuCulling.buffer,
+                        gpuCulling.visibleMatricesOffset, gpuCulling.visibleCapacity * sizeof(mat4));
+        BindBuffer(app, GL_DRAW_INDIRECT_BUFFER, gpuCulling.buffer);
+        commandsOffset = 0;
+    }
+    else
     {
-        aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
-        ProcessAssimpMesh(scene, mesh, myMesh, baseMeshMaterialIndex, submeshMaterialIndices);
+        BindBufferRange(app, GL_SHADER_STORAGE_BUFFER, STORAGE_BINDING_WORLD_MATRICES, uniforms.handle, regionOffset, UNIFORM_RING_FRAME_SIZE);
+        BindBuffer(app, GL_DRAW_INDIRECT_BUFFER, uniforms.handle);
     }
 
-    // then do the same for each of its children
-    for (unsigned int i = 0; i < node->mNumChildren; i++)
+    // Materials in the same texture array page only need a different layer index, which is in
+    // their LocalParams, so the sorted items form long batches
+    GLuint boundProgram = 0;
+    GLuint boundVao = 0;
+    u32 batchBegin = 0;
+    while (batchBegin < queue.items.size())
     {
-        ProcessAssimpNode(scene, node->mChildren[i], myMesh, baseMeshMaterialIndex, submeshMaterialIndices);
+        const DrawState state = GetDrawState(app, queue.items[batchBegin], programOverrideIdx);
+        u32 batchEnd = batchBegin + 1;
+        while (batchEnd < queue.items.size() && IsSameDrawState(GetDrawState(app, queue.items[batchEnd], programOverrideIdx), state))
+            batchEnd++;
+
+        Program& program = *state.program;
+        if (program.handle != boundProgram)
+        {
+            BindProgramPipeline(app, program.handle);
+            PassLightsToCurrentProgram(program, app);
+            SetUniform1i(app, program, TextureUniform, 0);
+            SetUniform1i(app, program, NormalTextureUniform, 1);
+            boundProgram = program.handle;
+        }
+
+        // The DrawParams binding is part of the VAO state
+        if (state.vao != boundVao)
+        {
+            BindVertexArray(app, state.vao);
+            glBindVertexBuffer(DRAW_PARAMS_VERTEX_BINDING, uniforms.handle, uniforms.drawParamsOffset, sizeof(DrawParams));
+            boundVao = state.vao;
+        }
+
+        if (state.textureArray)
+            BindTexture(app, 0, GL_TEXTURE_2D_ARRAY, state.textureArray);
+        if (state.normalTextureArray)
+            BindTexture(app, 1, GL_TEXTURE_2D_ARRAY, state.normalTextureArray);
+
+        // Drawn from the commands either way, as only they have the culled instance counts
+        const u64 batchOffset = commandsOffset + (u64)batchBegin * sizeof(DrawElementsIndirectCommand);
+        if (app->useMultiDrawIndirect)
+        {
+            glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)batchOffset, batchEnd - batchBegin, 0);
+            queue.drawCallCount++;
+        }
+        else
+        {
+            for (u32 i = 0; i < batchEnd - batchBegin; ++i)
+                glDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)(batchOffset + i * sizeof(DrawElementsIndirectCommand)));
+            queue.drawCallCount += batchEnd - batchBegin;
+        }
+
+        batchBegin = batchEnd;
     }
 }
 
-u32 LoadModel(App* app, const char* filename)
+void ApplyGeometryResidency(App* app, u32 meshIdx)
 {
-    const aiScene* scene = aiImportFile(filename,
-        aiProcess_Triangulate |
-        aiProcess_GenSmoothNormals |
-        aiProcess_CalcTangentSpace |
-        aiProcess_JoinIdenticalVertices |
-        aiProcess_PreTransformVertices |
-        aiProcess_ImproveCacheLocality |
-        aiProcess_OptimizeMeshes |
-        aiProcess_SortByPType);
+    Mesh& mesh = app->meshes[meshIdx];
+    if (mesh.residency == GEOMETRY_RESIDENCY_FULL)
+        return;
 
-    if (!scene)
+    for (Submesh& submesh : mesh.submeshes)
     {
-        ELOG("Error loading mesh %s: %s", filename, aiGetErrorString());
-        return UINT32_MAX;
+        if (mesh.residency == GEOMETRY_RESIDENCY_POSITIONS && submesh.positions.empty())
+        {
+            const u32 floatStride = submesh.vertexBufferLayout.stride / sizeof(float);
+            submesh.positions.resize(submesh.vertexCount);
+            for (u32 i = 0; i < submesh.vertexCount; ++i)
+            {
+                const float* position = &submesh.vertices[i * floatStride]; // Location 0, at the start of each vertex
+                submesh.positions[i] = vec3(position[0], position[1], position[2]);
+            }
+        }
+
+        // Swapped with empty vectors, as clear() keeps the memory
+        std::vector<float>().swap(submesh.vertices);
+        if (mesh.residency == GEOMETRY_RESIDENCY_NONE)
+            std::vector<u32>().swap(submesh.indices);
+    }
+}
+
+u32 LoadModel(App* app, const char* filename, GeometryResidency residency)
+{
+    // Look for the model in the import cache before doing any import work
+    CookedModel cookedModel;
+    char cachePath[512];
+    const bool hasCacheKey = GetModelCachePath(filename, cachePath, sizeof(cachePath));
+    if (!hasCacheKey || !LoadCookedModel(cachePath, &cookedModel))
+    {
+        if (!ImportModel(filename, &cookedModel))
+        {
+            return UINT32_MAX;
+        }
+        if (hasCacheKey)
+        {
+            WriteCookedModel(cachePath, cookedModel);
+        }
     }
 
     app->meshes.push_back(Mesh{});
     Mesh& mesh = app->meshes.back();
+    mesh.residency = residency;
     u32 meshIdx = (u32)app->meshes.size() - 1u;
 
     app->models.push_back(Model{});
@@ -882,133 +3269,223 @@ u32 LoadModel(App* app, const char* filename)
     model.meshIdx = meshIdx;
     u32 modelIdx = (u32)app->models.size() - 1u;
 
-    String directory = GetDirectoryPart(MakeString(filename));
-
     // Create a list of materials
     u32 baseMeshMaterialIndex = (u32)app->materials.size();
-    for (unsigned int i = 0; i < scene->mNumMaterials; ++i)
+    for (const CookedMaterial& cookedMaterial : cookedModel.materials)
     {
-        app->materials.push_back(Material{});
-        Material& material = app->materials.back();
-        ProcessAssimpMaterial(app, scene->mMaterials[i], material, directory);
-    }
-
-    ProcessAssimpNode(scene, scene->mRootNode, &mesh, baseMeshMaterialIndex, model.materialIdx);
+        Material material = {};
+        material.name = cookedMaterial.name;
+        material.albedo = cookedMaterial.albedo;
+        material.emissive = cookedMaterial.emissive;
+        material.smoothness = cookedMaterial.smoothness;
+
+        u32* textureIndices[MATERIAL_TEXTURE_SLOT_COUNT] = {
+            &material.albedoTextureIdx,
+            &material.emissiveTextureIdx,
+            &material.specularTextureIdx,
+            &material.normalsTextureIdx,
+            &material.bumpTextureIdx
+        };
+        for (u32 slot = 0; slot < MATERIAL_TEXTURE_SLOT_COUNT; ++slot)
+        {
+            if (!cookedMaterial.texturePaths[slot].empty())
+                *textureIndices[slot] = LoadTexture2D(app, cookedMaterial.texturePaths[slot].c_str());
+        }
 
-    aiReleaseImport(scene);
+        app->materials.push_back(material);
+    }
 
-    u32 vertexBufferSize = 0;
-    u32 indexBufferSize = 0;
+    // The geometry is moved, not copied, from the cooked model
+    mesh.submeshes.reserve(cookedModel.submeshes.size());
+    for (CookedSubmesh& cookedSubmesh : cookedModel.submeshes)
+    {
+        mesh.submeshes.push_back(Submesh{});
+        Submesh& submesh = mesh.submeshes.back();
+        submesh.vertexBufferLayout = cookedSubmesh.vertexBufferLayout;
+        submesh.vertices.swap(cookedSubmesh.vertices);
+        submesh.indices.swap(cookedSubmesh.indices);
+
+        submesh.boundsMin = cookedSubmesh.boundsMin;
+        submesh.boundsMax = cookedSubmesh.boundsMax;
+        submesh.boundingSphere = cookedSubmesh.boundingSphere;
+
+        // store the proper (previously proceessed) material for this mesh
+        model.materialIdx.push_back(baseMeshMaterialIndex + cookedSubmesh.materialIdx);
+    }
 
+    // Bounds of the whole mesh, from those of its submeshes
+    mesh.boundsMin = vec3(FLT_MAX);
+    mesh.boundsMax = vec3(-FLT_MAX);
+    for (const Submesh& submesh : mesh.submeshes)
+    {
+        mesh.boundsMin = glm::min(mesh.boundsMin, submesh.boundsMin);
+        mesh.boundsMax = glm::max(mesh.boundsMax, submesh.boundsMax);
+    }
+    if (mesh.submeshes.empty())
+        mesh.boundsMin = mesh.boundsMax = vec3(0.0f);
+
+    const vec3 meshCenter = (mesh.boundsMin + mesh.boundsMax) * 0.5f;
+    f32 meshRadius = 0.0f;
+    for (const Submesh& submesh : mesh.submeshes)
+        meshRadius = glm::max(meshRadius, glm::distance(meshCenter, vec3(submesh.boundingSphere)) + submesh.boundingSphere.w);
+    mesh.boundingSphere = vec4(meshCenter, meshRadius);
+    mesh.occluderVertices = cookedModel.occluderVertices;
+    mesh.occluderIndices = cookedModel.occluderIndices;
+
+    // The geometry gets its ranges of the pool buffers and reaches them through the upload queue
     for (u32 i = 0; i < mesh.submeshes.size(); ++i)
     {
-        vertexBufferSize += mesh.submeshes[i].vertices.size() * sizeof(float);
-        indexBufferSize += mesh.submeshes[i].indices.size() * sizeof(u32);
+        AllocateSubmeshGeometry(app, meshIdx, i);
     }
 
-    glGenBuffers(1, &mesh.vertexBufferHandle);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBufferHandle);
-    glBufferData(GL_ARRAY_BUFFER, vertexBufferSize, NULL, GL_STATIC_DRAW);
-
-    glGenBuffers(1, &mesh.indexBufferHandle);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBufferHandle);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBufferSize, NULL, GL_STATIC_DRAW);
+    return modelIdx;
+}
+u8 LoadProgramAttributes(Program& program)
+{
+    // The attributes are those of the vertex stage attached to the pipeline
+    const GLuint stageHandle = program.attachedStageHandles[PROGRAM_STAGE_VERTEX];
+    program.vertexInputLayout.attributes.clear();
 
-    u32 indicesOffset = 0;
-    u32 verticesOffset = 0;
+    GLsizei attributeCount;
+    glGetProgramiv(stageHandle, GL_ACTIVE_ATTRIBUTES, &attributeCount);
 
-    for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+    for (u32 i = 0; i < attributeCount; ++i)
     {
-        const void* verticesData = mesh.submeshes[i].vertices.data();
-        const u32   verticesSize = mesh.submeshes[i].vertices.size() * sizeof(float);
-        glBufferSubData(GL_ARRAY_BUFFER, verticesOffset, verticesSize, verticesData);
-        mesh.submeshes[i].vertexOffset = verticesOffset;
-        verticesOffset += verticesSize;
+        GLchar attributeName[128];
+        GLsizei attributeNameLenght;
+        GLint attributeSize;
+        GLenum attributeType;
+        glGetActiveAttrib(stageHandle, i, ARRAY_COUNT(attributeName), &attributeNameLenght, &attributeSize, &attributeType, attributeName);
 
-        const void* indicesData = mesh.submeshes[i].indices.data();
-        const u32   indicesSize = mesh.submeshes[i].indices.size() * sizeof(u32);
-        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, indicesOffset, indicesSize, indicesData);
-        mesh.submeshes[i].indexOffset = indicesOffset;
-        indicesOffset += indicesSize;
+        u8 attributeLoacation = glGetAttribLocation(stageHandle, attributeName);
+        program.vertexInputLayout.attributes.push_back({ attributeLoacation, (u8)attributeSize });
     }
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-    return modelIdx;
+    return attributeCount;
 }
-GLuint FindVAO(Mesh& mesh, u32 submeshIndex, const Program& program)
+
+UniformHandle GetUniformHandle(const char* name)
 {
-    Submesh& submesh = mesh.submeshes[submeshIndex];
+    const UniformHandle handle = HashBytes(name, strlen(name), UNIFORM_HASH_SEED);
+    return handle ? handle : 1; // 0 marks the empty slots
+}
 
-    //Try finding a vao for this submesh/program
-    for (u32 i = 0; i < (u32)submesh.vaos.size(); ++i)
+void ReflectProgramUniforms(Program& program)
+{
+    std::vector<ProgramUniform> entries;
+    for (GLuint stageHandle : program.attachedStageHandles)
     {
-        if (submesh.vaos[i].programHandle == program.handle)
-        {
-            return submesh.vaos[i].handle;
-        }
-    }
+        if (!stageHandle)
+            continue;
 
-    GLuint vaoHandle = 0;
+        GLint uniformCount = 0;
+        glGetProgramiv(stageHandle, GL_ACTIVE_UNIFORMS, &uniformCount);
+        for (GLint i = 0; i < uniformCount; ++i)
+        {
+            GLchar uniformName[128];
+            GLsizei uniformNameLength;
+            GLint arraySize;
+            GLenum type;
+            glGetActiveUniform(stageHandle, i, ARRAY_COUNT(uniformName), &uniformNameLength, &arraySize, &type, uniformName);
 
-    //Create a new vao for this submesh/program
-    glGenVertexArrays(1, &vaoHandle);
-    glBindVertexArray(vaoHandle);
+            // Members of uniform blocks have no location, they are set through their block
+            const GLint location = glGetUniformLocation(stageHandle, uniformName);
+            if (location == -1)
+                continue;
 
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBufferHandle);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBufferHandle);
+            if (uniformNameLength > 3 && strcmp(uniformName + uniformNameLength - 3, "[0]") == 0)
+                uniformName[uniformNameLength - 3] = '\0';
 
-    for (u32 i = 0; i < program.vertexInputLayout.attributes.size(); ++i)
-    {
-        bool attributeWasLinked = false;
+            entries.push_back({ GetUniformHandle(uniformName), stageHandle, location, type, arraySize });
+        }
 
-        for (u32 j = 0; j < submesh.vertexBufferLayout.attributes.size(); ++j)
+        GLint blockCount = 0;
+        glGetProgramiv(stageHandle, GL_ACTIVE_UNIFORM_BLOCKS, &blockCount);
+        for (GLint i = 0; i < blockCount; ++i)
         {
-            if (program.vertexInputLayout.attributes[i].location == submesh.vertexBufferLayout.attributes[j].location)
-            {
-                const u32 index = submesh.vertexBufferLayout.attributes[j].location;
-                const u32 ncomp = submesh.vertexBufferLayout.attributes[j].componentCount;
-                const u32 offset = submesh.vertexBufferLayout.attributes[j].offset + submesh.vertexOffset;  //attribute offset + vertex offset
-                const u32 stride = submesh.vertexBufferLayout.stride;
-                glVertexAttribPointer(index, ncomp, GL_FLOAT, GL_FALSE, stride, (void*)(u64)offset);
-                glEnableVertexAttribArray(index);
-
-                attributeWasLinked = true;
-                break;
-            }
+            GLchar blockName[128];
+            glGetActiveUniformBlockName(stageHandle, i, ARRAY_COUNT(blockName), NULL, blockName);
+            entries.push_back({ GetUniformHandle(blockName), stageHandle, i, 0, 1 });
         }
-
-        assert(attributeWasLinked); //The submesh should provide an attribute for each vertex input
     }
 
-    glBindVertexArray(0);
-
-    //Store it in the list of vas for this submesh
-    Vao vao = { vaoHandle, program.handle };
-    submesh.vaos.push_back(vao);
+    u32 capacity = UNIFORM_TABLE_MIN_CAPACITY;
+    while (capacity < entries.size() * 2)
+        capacity *= 2;
 
-    return vaoHandle;
+    program.uniforms.assign(capacity, ProgramUniform{});
+    const u64 mask = capacity - 1;
+    for (const ProgramUniform& entry : entries)
+    {
+        u64 slot = entry.handle & mask;
+        while (program.uniforms[slot].handle)
+            slot = (slot + 1) & mask;
+        program.uniforms[slot] = entry;
+    }
 }
-u8 LoadProgramAttributes(Program& program)
+
+const ProgramUniform* FindProgramUniform(const Program& program, UniformHandle handle, const ProgramUniform* previous)
 {
-    GLsizei attributeCount;
-    glGetProgramiv(program.handle, GL_ACTIVE_ATTRIBUTES, &attributeCount);
+    if (program.uniforms.empty())
+        return NULL;
 
-    for (u32 i = 0; i < attributeCount; ++i)
+    // All the entries of a handle are in its probe sequence, which ends at an empty slot
+    const u64 mask = program.uniforms.size() - 1;
+    u64 slot = previous ? ((previous - program.uniforms.data()) + 1) & mask : handle & mask;
+    for (; program.uniforms[slot].handle; slot = (slot + 1) & mask)
     {
-        GLchar attributeName[128];
-        GLsizei attributeNameLenght;
-        GLint attributeSize;
-        GLenum attributeType;
-        glGetActiveAttrib(program.handle, i, ARRAY_COUNT(attributeName), &attributeNameLenght, &attributeSize, &attributeType, attributeName);
+        if (program.uniforms[slot].handle == handle)
+            return &program.uniforms[slot];
+    }
+    return NULL;
+}
 
-        u8 attributeLoacation = glGetAttribLocation(program.handle, attributeName);
-        program.vertexInputLayout.attributes.push_back({ attributeLoacation, (u8)attributeSize });
+// Returns true if the stage already has the value, and otherwise caches it so the caller sets it
+static bool IsUniformCached(App* app, const ProgramUniform& uniform, const void* value, u32 size)
+{
+    GLStateCache& state = app->glState;
+    const u64 key = (u64)uniform.stageHandle << 32 | (u32)uniform.location;
+    auto it = state.uniformValues.find(key);
+    if (it != state.uniformValues.end() && memcmp(it->second.words, value, size) == 0)
+    {
+        state.elidedCount++;
+        return true;
     }
 
-    return attributeCount;
+    UniformValue& cached = it != state.uniformValues.end() ? it->second : state.uniformValues[key];
+    memcpy(cached.words, value, size);
+    state.issuedCount++;
+    return false;
+}
+
+void SetUniform1i(App* app, const Program& program, UniformHandle handle, i32 value)
+{
+    for (const ProgramUniform* uniform = FindProgramUniform(program, handle); uniform; uniform = FindProgramUniform(program, handle, uniform))
+        if (!IsUniformCached(app, *uniform, &value, sizeof(value)))
+            glProgramUniform1i(uniform->stageHandle, uniform->location, value);
+}
+
+void SetUniform1ui(App* app, const Program& program, UniformHandle handle, u32 value)
+{
+    for (const ProgramUniform* uniform = FindProgramUniform(program, handle); uniform; uniform = FindProgramUniform(program, handle, uniform))
+        if (!IsUniformCached(app, *uniform, &value, sizeof(value)))
+            glProgramUniform1ui(uniform->stageHandle, uniform->location, value);
+}
+
+void SetUniform3fv(App* app, const Program& program, UniformHandle handle, const vec3& value)
+{
+    for (const ProgramUniform* uniform = FindProgramUniform(program, handle); uniform; uniform = FindProgramUniform(program, handle, uniform))
+        if (!IsUniformCached(app, *uniform, glm::value_ptr(value), sizeof(value)))
+            glProgramUniform3fv(uniform->stageHandle, uniform->location, 1, glm::value_ptr(value));
 }
+
+void SetUniformMatrix4fv(App* app, const Program& program, UniformHandle handle, const mat4& value)
+{
+    for (const ProgramUniform* uniform = FindProgramUniform(program, handle); uniform; uniform = FindProgramUniform(program, handle, uniform))
+        if (!IsUniformCached(app, *uniform, glm::value_ptr(value), sizeof(value)))
+            glProgramUniformMatrix4fv(uniform->stageHandle, uniform->location, 1, GL_FALSE, glm::value_ptr(value));
+}
+
 mat4 TransformScale(const vec3& scaleFactors)
 {
     mat4 transform = glm::scale(scaleFactors);
@@ -5,6 +5,12 @@
 #pragma once
 
 #include "platform.h"
+#include "assets.h"
+#include "render_queue.h"
+#include "culling.h"
+#include "bvh.h"
+#include "occlusion.h"
+#include <unordered_map>
 #ifdef _DEBUG
 #include <glad/glad.h>
 #endif // _DEBUG
@@ -96,17 +102,27 @@ public:
     void UpdateCameraVectors();
 };
 
-struct Image
+// Textures are not separate GL objects: images with the same size are packed as
+// layers of GL_TEXTURE_2D_ARRAY pages, so materials can be switched without rebinding.
+// Pages start small and double their layer count when they get full.
+#define TEXTURE_ARRAY_PAGE_INITIAL_LAYERS 4
+#define TEXTURE_ARRAY_PAGE_MAX_LAYERS     64
+
+struct TextureArray
 {
-    void* pixels;
-    ivec2 size;
-    i32   nchannels;
-    i32   stride;
+    GLuint handle;
+    ivec2  size;
+    GLenum internalFormat;
+    u32    mipCount;
+    u32    layerCount;
+    u32    layerCapacity;
 };
 
 struct Texture
 {
-    GLuint      handle;
+    GLuint      handle;   // Handle of the texture array page
+    u32         arrayIdx;
+    u32         layer;
     std::string filepath;
 };
 
@@ -136,48 +152,223 @@ struct VertexShaderLayout
 };
 
 
-struct Program
+enum ProgramBuildState
 {
+    PROGRAM_BUILDING, // Submitted to the driver, its status has not been asked yet
+    PROGRAM_READY,
+    PROGRAM_FAILED
+};
+
+// SEPARABLE PROGRAMS
+//
+// Each shader stage is linked as its own separable program, and a Program is a pipeline object
+// that mixes a vertex and a fragment stage. Stages built from the same file, name and defines
+// are built once, so the mesh and full screen programs share their vertex stages, and so do the
+// fragment permutations that only differ in features the vertex stage does not use.
+
+enum ProgramStage
+{
+    PROGRAM_STAGE_VERTEX,
+    PROGRAM_STAGE_FRAGMENT,
+    PROGRAM_STAGE_COUNT
+};
+
+// A separable program with a single stage, shared by all the pipelines that use it
+struct ShaderStage
+{
+    GLenum             type;                 // GL_VERTEX_SHADER, GL_FRAGMENT_SHADER or GL_COMPUTE_SHADER
+    std::string        filepath;             // Empty for the fallbacks, which are built from memory
+    std::string        shaderName;
+    std::string        defines;              // "#define" lines of its permutation
     GLuint             handle;
-    std::string        filepath;
+    GLuint             shaderHandle;         // Only while building
+    ProgramBuildState  buildState;
+    u64                binaryKey;            // Of the program binary cache
+    std::vector<std::string> dependencies;   // Its file and all the files it includes
+    std::vector<u64>         dependencyTimestamps;
+};
+
+// UNIFORM TABLES
+//
+// The active uniforms and uniform blocks of the stages of a pipeline are reflected once, when the
+// stages are attached to it, into an open addressing table keyed by the hash of their names. The
+// draw code looks them up by handle (see GetUniformHandle), so setting a uniform does not go
+// through glGetUniformLocation nor builds any string.
+typedef u64 UniformHandle;
+
+#define UNIFORM_HASH_SEED          0x756e69 // Seed of HashBytes for the uniform names
+#define UNIFORM_TABLE_MIN_CAPACITY 16       // Power of two, kept at most half full
+
+struct ProgramUniform
+{
+    UniformHandle handle;      // 0 if the slot is empty
+    GLuint        stageHandle; // A uniform declared by both stages has one entry for each
+    GLint         location;    // Block index for uniform blocks
+    GLenum        type;        // 0 for uniform blocks
+    GLint         arraySize;
+};
+
+struct LightUniformHandles
+{
+    UniformHandle type;
+    UniformHandle color;
+    UniformHandle direction;
+    UniformHandle position;
+};
+
+struct Program
+{
+    GLuint             handle;               // Program pipeline
+    std::string        filepath;             // Of its fragment stage
     std::string        programName;
     u64                lastWriteTimestamp; // What is this for?
     VertexShaderLayout vertexInputLayout;
+    u32                stageIndices[PROGRAM_STAGE_COUNT];         // Into App::shaderStages
+    GLuint             attachedStageHandles[PROGRAM_STAGE_COUNT]; // What the pipeline uses now, 0 if nothing
+    u32                fallbackProgramIdx;   // Drawn with instead while building, or if the build failed
+    std::vector<ProgramUniform> uniforms;    // Of all its attached stages, see ReflectProgramUniforms
 };
-//RELATE VBO WITH SHADER
 
-struct Vao {
-    GLuint handle;
-    GLuint programHandle;
+// SHADER PERMUTATIONS
+//
+// Program sources go through a preprocessor that resolves #include "file", relative to the
+// including file, and records the files each program depends on, so that editing any of them
+// reloads the program. Programs can also be built with a set of feature defines and a light
+// count, packed in a permutation key. Permutations are built the first time they are asked for,
+// and kept by key.
+#define SHADER_FEATURE_ALBEDO_TEX (1 << 0) // HAS_ALBEDO_TEX
+#define SHADER_FEATURE_NORMAL_MAP (1 << 1) // NORMAL_MAP
+#define SHADER_FEATURE_COUNT      2
+#define SHADER_VERTEX_FEATURES    SHADER_FEATURE_NORMAL_MAP // The ones the vertex stages are built with
+#define SHADER_MAX_INCLUDE_DEPTH  16
+#define PROGRAM_RELOAD_INTERVAL   0.5 // Seconds between checks of the program sources
+
+#define MAKE_PERMUTATION_KEY(features, lightCount) ((features) | ((lightCount) << 16))
+
+// PROGRAM BUILDS
+//
+// All the programs are submitted at startup without asking for their status, which would make
+// the driver finish each build before starting the next one. A program's status is only asked
+// for when it is first needed: with GL_KHR_parallel_shader_compile, GL_COMPLETION_STATUS_KHR
+// tells whether that would block, and meanwhile a fallback program is drawn with instead.
+
+struct ProgramBuildQueue
+{
+    bool hasParallelCompile; // GL_KHR_parallel_shader_compile or GL_ARB_parallel_shader_compile
+    u32  pendingCount;
+    f64  submitTime;         // glfwGetTime of the first submission
+    f64  readyTime;          // Seconds from submitTime until the last build finished
+    f64  lastReloadCheckTime;
+    u32  reloadCount;
 };
-// VEO ATTRIBUTES 
-struct VertexBufferAttribute {
-    u8 location;
-    u8 componentCount;
-    u8 offset;
 
+// PROGRAM BINARY CACHE
+//
+// Linked programs are saved with glGetProgramBinary into the import cache directory, keyed by
+// their source, their defines and the driver (vendor, renderer and version), and loaded back
+// with glProgramBinary. A driver can still reject a binary, e.g. after an update that kept
+// the version string, and then the program is compiled from source and saved again.
+#define PROGRAM_BINARY_MAGIC   0x42504741 // "AGPB"
+#define PROGRAM_BINARY_VERSION 2
+
+struct ProgramBinaryHeader
+{
+    u32 magic;
+    u32 version;
+    u64 key;
+    u32 binaryFormat;
+    u32 binarySize;
 };
 
-struct VertexBufferLayout
+struct ProgramCacheStats
 {
-    std::vector<VertexBufferAttribute> attributes;
-    u8 stride;
+    bool isSupported;    // The driver has at least one program binary format
+    u32  binaryHits;
+    u32  compiledCount;
+    u32  rejectedCount;  // Binaries found in the cache but refused by glProgramBinary
+    f64  loadTime;       // Seconds spent preprocessing programs and submitting their builds
+
+    // Benchmark results, in seconds for all the programs
+    f64  benchmarkCompileTime;
+    f64  benchmarkBinaryTime;
 };
+
 struct Submesh
 {
     VertexBufferLayout vertexBufferLayout;
     std::vector<float> vertices;
     std::vector<u32> indices;
-    u32 vertexOffset;
-    u32 indexOffset;
-    std::vector<Vao> vaos;
+    u32 vertexFormatIdx; // Pool of MeshPool::vertexFormats that holds the vertices
+    u32 vertexCount;
+    u32 indexCount;
+    u32 baseVertex;      // Ranges of the pool buffers, in vertices and indices
+    u32 firstIndex;
+    vec3 boundsMin;      // Model space AABB of its vertices, computed when it is imported
+    vec3 boundsMax;
+    vec4 boundingSphere; // Model space, center in xyz and radius in w
+    std::vector<vec3> positions; // Only kept by GEOMETRY_RESIDENCY_POSITIONS
+};
+
+/**
+ * What a mesh keeps of its geometry in RAM once it is on the GPU.
+ */
+enum GeometryResidency
+{
+    GEOMETRY_RESIDENCY_NONE,      // Nothing, the GPU copy is the only one
+    GEOMETRY_RESIDENCY_POSITIONS, // Positions and indices, for picking and culling on the CPU
+    GEOMETRY_RESIDENCY_FULL,      // Vertices and indices as they were loaded, for editing
+    GEOMETRY_RESIDENCY_COUNT
 };
 
 struct Mesh
 {
     std::vector<Submesh> submeshes;
-    GLuint vertexBufferHandle;
-    GLuint indexBufferHandle;
+    u32 pendingUploads; // The mesh is not drawn until its geometry is on the GPU
+    GeometryResidency residency;
+    vec3 boundsMin;      // Union of the AABBs of its submeshes
+    vec3 boundsMax;
+    vec4 boundingSphere; // Contains the spheres of its submeshes
+    std::vector<vec3> occluderVertices; // Model space, see GenerateOccluder, empty if it has no occluder
+    std::vector<u32>  occluderIndices;
+};
+
+// MESH POOL
+//
+// All the geometry lives in a few big buffers: one vertex buffer per vertex format, and one
+// index buffer shared by all of them. Submeshes get ranges of them from a first fit free list,
+// and are drawn with glDrawElementsBaseVertex from a VAO shared by all the submeshes with the
+// same vertex format. When a pool runs out of space it is rebuilt into a new buffer that packs
+// the ranges in use together, and it only grows if that does not free enough space.
+#define MESH_POOL_INITIAL_VERTICES 65536
+#define MESH_POOL_INITIAL_INDICES  262144
+
+struct PoolRange
+{
+    u32 offset;
+    u32 size;
+};
+
+struct PoolAllocator
+{
+    u32                    capacity;
+    u32                    usedSize;
+    std::vector<PoolRange> freeRanges; // Sorted by offset, adjacent ranges are merged
+};
+
+struct VertexFormatPool
+{
+    VertexBufferLayout layout;
+    GLuint             vao;
+    GLuint             vertexBufferHandle;
+    PoolAllocator      allocator; // In vertices
+};
+
+struct MeshPool
+{
+    std::vector<VertexFormatPool> vertexFormats;
+    GLuint                        indexBufferHandle;
+    PoolAllocator                 indexAllocator; // In indices
+    u32                           rebuildCount;
 };
 
 struct Model {
@@ -201,8 +392,9 @@ struct Entity
     float metallic = 0.5f;
     float roughness = 0.5f;
     u32 modelIndex;
-    u32 localParamsOffset;
-    u32 localParamsSize;
+    bool isOccluder = false; // Its mesh's occluder is rasterized for the software occlusion culling
+    u32 localParamsOffset; // Of its first submesh's LocalParams in the uniform ring this frame, shared by its instance group
+    u32 localParamsSize;   // Of the LocalParams of all its submeshes, 0 if they did not fit
 };
 
 struct Light
@@ -215,6 +407,340 @@ struct Light
 };
 
 
+// GPU UPLOADS
+//
+// Geometry and textures are not uploaded when they are loaded: they are queued, and each frame
+// copies at most uploadBudgetMB of them into a persistently mapped staging ring. From there they
+// reach their destination with glCopyBufferSubData, or glTexSubImage3D using the ring as pixel
+// unpack buffer. Fences tell when the GPU is done reading a region of the ring so it can be reused.
+#define UPLOAD_RING_SIZE         MB(64)
+#define UPLOAD_RING_ALIGNMENT    64
+#define UPLOAD_DEFAULT_BUDGET_MB 16
+
+enum UploadType
+{
+    UPLOAD_SUBMESH_VERTICES,
+    UPLOAD_SUBMESH_INDICES,
+    UPLOAD_TEXTURE_LAYER
+};
+
+struct UploadRequest
+{
+    UploadType type;
+    u64        size;
+    u64        uploadedSize; // Requests bigger than the budget are split over several frames
+
+    // UPLOAD_SUBMESH_*: the source and the destination are looked up when the request is
+    // processed, as the mesh pool can move the submesh to another buffer in the meantime.
+    // The data is not copied, so it must not change until the request is done.
+    u32 meshIdx;
+    u32 submeshIdx;
+
+    // UPLOAD_TEXTURE_LAYER: the queue owns the image and frees it when done
+    Image image;
+    u32   arrayIdx;
+    u32   layer;
+};
+
+struct UploadRegion
+{
+    u64    end;   // Ring position where the region ends
+    GLsync fence;
+};
+
+struct UploadQueue
+{
+    GLuint ringHandle;
+    u8*    ringMemory; // NULL if persistent mapping is not available, then each copy maps its range
+    u64    head;       // Positions only grow, the ring offset is position % UPLOAD_RING_SIZE
+    u64    tail;
+    u64    fencedHead;
+
+    std::vector<UploadRegion>  regions;  // Oldest first
+    std::vector<UploadRequest> requests; // In submission order
+    u32                        firstRequest;
+
+    i32 budgetMB;
+    u64 pendingBytes;
+    u64 uploadedBytesLastFrame;
+};
+
+// UNIFORM RING
+//
+// The camera and material parameters reach the programs through buffers instead of uniform
+// calls. Each frame writes a GlobalParams block, the LocalParams of each submesh of each instance
+// group, the instance transforms and the draw commands into its own region of a persistently
+// mapped buffer. GlobalParams is a uniform block, while the whole region is also bound as shader
+// storage arrays of LocalParams and world matrices, which the draws index (see MULTI-DRAW
+// INDIRECT). A region is only written again once the fence of the frame that used it is
+// signaled. The blocks are declared in Shaders/uniform_blocks.glsl.
+#define UNIFORM_RING_FRAMES            3       // Frames in flight
+#define UNIFORM_RING_FRAME_SIZE        MB(4)   // Of each frame's region
+#define UNIFORM_BINDING_GLOBAL_PARAMS  0
+#define STORAGE_BINDING_LOCAL_PARAMS   0
+#define STORAGE_BINDING_WORLD_MATRICES 1
+
+struct GlobalParams // std140
+{
+    mat4 view;
+    mat4 projection;
+    vec3 cameraPosition;
+    u32  lightCount;
+    vec4 frustumPlanes[6]; // World space, normals pointing inside, see ExtractFrustumPlanes
+    mat4 hiZViewProjection; // Of the frame the Hi-Z pyramid was built from
+    u32  hiZWidth;          // Of the depth attachment the pyramid was built from
+    u32  hiZHeight;
+    u32  hiZLevelCount;
+    u32  hiZEnabled;        // 1 if the culling shader has to test occlusion against the pyramid
+};
+
+struct LocalParams // std430
+{
+    vec3 albedo;
+    u32  textureLayer;
+    u32  normalTextureLayer;
+    u32  padding[3];    // The array stride is rounded up to the vec3 alignment
+};
+
+struct UniformRing
+{
+    GLuint handle;
+    u8*    memory;      // The whole ring if persistently mapped, else the current region while it is written
+    bool   isPersistent;
+    u32    frameIdx;    // Region written this frame
+    u32    head;        // Offset in the current region
+    GLsync fences[UNIFORM_RING_FRAMES];
+
+    u32    blockAlignment;      // Of every block: the uniform and storage offset alignments, and sizeof(mat4)
+    u32    globalParamsOffset;  // Of this frame, from the start of the buffer
+    u32    drawParamsOffset;    // Of this frame's DrawParams, from the start of the buffer, UINT32_MAX if they did not fit
+    u32    drawCommandsOffset;  // Of this frame's DrawElementsIndirectCommands, likewise
+    u32    blockCount;          // Written this frame
+    u32    blockCountLastFrame;
+    u32    usedBytesLastFrame;
+    u32    droppedEntityCount;  // Entities not drawn because a region was full, since startup
+};
+
+// INSTANCING
+//
+// Entities that share a model are drawn together, with one instanced draw per submesh. Their world
+// matrices are written to the uniform ring, where the vertex stage reads them by instance.
+// Materials belong to the model and all the entities of a pass use the same program, so the
+// model alone decides the group.
+struct InstanceGroup
+{
+    u32 modelIdx;
+    u32 instanceCount;
+    u32 firstWorldMatrix;  // Index of its first world matrix in this frame's region
+    u32 firstInstance;     // Into App::instanceWorldMatrices, the same matrices in CPU memory
+    u32 firstLocalParams;  // Index of the LocalParams of the model's first submesh, UINT32_MAX if they did not fit
+    f32 nearestDistance;   // From the camera to its nearest instance
+};
+
+// MULTI-DRAW INDIRECT
+//
+// Each item of the render queue gets a DrawElementsIndirectCommand and a DrawParams in the
+// uniform ring. The baseInstance of a draw is its index, and the per instance attribute
+// aDrawParams has a divisor no draw reaches, so all the instances of a draw read its DrawParams:
+// where its world matrices start and which LocalParams it uses. As nothing else changes from one
+// draw to the next, the consecutive items with the same program, VAO and texture arrays are
+// submitted with a single glMultiDrawElementsIndirect.
+#define DRAW_PARAMS_ATTRIBUTE_LOCATION 5          // aDrawParams
+#define DRAW_PARAMS_VERTEX_BINDING     15         // Away from the bindings glVertexAttribPointer uses
+#define DRAW_PARAMS_DIVISOR            0x7fffffff // More instances than any draw has
+
+struct DrawElementsIndirectCommand
+{
+    u32 count;
+    u32 instanceCount;
+    u32 firstIndex;
+    i32 baseVertex;
+    u32 baseInstance;
+};
+
+struct DrawParams
+{
+    u32 firstWorldMatrix;
+    u32 localParamsIdx;
+};
+
+// GL STATE CACHE
+//
+// The draw code changes GL state through the Bind* and Set*State functions, which remember what is
+// bound and skip the calls that would not change it. The cache is only trusted within a frame: the
+// loading and upload code and the GUI renderer call GL directly, so BeginGLStateFrame forgets it
+// before the first draw. Uniform values are cached by stage and location, as stages are shared by
+// several pipelines, and forgotten whenever a stage is built.
+#define GL_STATE_TEXTURE_UNITS    8
+#define GL_STATE_BUFFER_BINDINGS  8 // Indexed uniform and shader storage bindings
+#define GL_STATE_UNKNOWN          UINT32_MAX // Of the state not set since the frame began
+
+enum GLStateBufferTarget
+{
+    GL_STATE_BUFFER_ARRAY,
+    GL_STATE_BUFFER_UNIFORM,
+    GL_STATE_BUFFER_COPY_READ,
+    GL_STATE_BUFFER_COPY_WRITE,
+    GL_STATE_BUFFER_PIXEL_UNPACK,
+    GL_STATE_BUFFER_SHADER_STORAGE,
+    GL_STATE_BUFFER_DRAW_INDIRECT,
+    GL_STATE_BUFFER_TARGET_COUNT
+};
+
+enum GLStateTextureTarget
+{
+    GL_STATE_TEXTURE_2D,
+    GL_STATE_TEXTURE_2D_ARRAY,
+    GL_STATE_TEXTURE_CUBE_MAP,
+    GL_STATE_TEXTURE_TARGET_COUNT
+};
+
+struct BufferRangeBinding
+{
+    GLuint     buffer;
+    GLintptr   offset;
+    GLsizeiptr size;
+};
+
+struct UniformValue
+{
+    u32 words[16]; // Large enough for a mat4
+};
+
+struct GLStateCache
+{
+    GLuint framebuffer;
+    GLuint programPipeline;
+    GLuint vertexArray;
+    GLuint buffers[GL_STATE_BUFFER_TARGET_COUNT];
+    BufferRangeBinding uniformBuffers[GL_STATE_BUFFER_BINDINGS];
+    BufferRangeBinding storageBuffers[GL_STATE_BUFFER_BINDINGS];
+    u32    activeTextureUnit;
+    GLuint textures[GL_STATE_TEXTURE_UNITS][GL_STATE_TEXTURE_TARGET_COUNT];
+    GLuint samplers[GL_STATE_TEXTURE_UNITS];
+    u32    blendEnabled;     // 0, 1 or GL_STATE_UNKNOWN
+    u32    blendFunc;        // srcFactor << 16 | dstFactor, the factors fit in 16 bits
+    u32    depthTestEnabled; // 0, 1 or GL_STATE_UNKNOWN
+    u32    depthWriteEnabled;
+    GLenum depthFunc;
+    u32    colorWriteEnabled; // Of all the channels of all the draw buffers
+    std::unordered_map<u64, UniformValue> uniformValues; // By stage handle << 32 | location
+
+    u32 issuedCount;         // Calls that reached GL this frame
+    u32 elidedCount;         // Calls skipped this frame because they would not change anything
+    u32 issuedCountLastFrame;
+    u32 elidedCountLastFrame;
+};
+
+// FRUSTUM CULLING
+//
+// The instances of each draw are tested against the camera frustum, with the AABB of the submesh
+// transformed by their world matrix, and only the visible ones are drawn. On the CPU, the world
+// matrices of the visible instances of each draw are copied to the uniform ring. On the GPU, the
+// compute stage of Shaders/cull_instances.glsl copies them to a GPU only buffer and counts them
+// with atomics in the instanceCount of the draw commands. The number of draws stays the one the
+// CPU wrote, as glMultiDrawElementsIndirectCount is not in GL 4.3, so draws with no visible
+// instances are left in with an instanceCount of 0.
+#define STORAGE_BINDING_CULL_DRAWS       2
+#define STORAGE_BINDING_DRAW_COMMANDS    3
+#define STORAGE_BINDING_VISIBLE_MATRICES 4
+#define CULL_GROUP_SIZE                  64 // local_size_x of the culling shader, one instance each
+
+enum CullingMode
+{
+    CULLING_NONE,
+    CULLING_CPU,
+    CULLING_GPU, // Culled on the CPU while the culling shader builds, or if it failed
+    CULLING_MODE_COUNT
+};
+
+struct CullDraw // std430
+{
+    vec3 boundsMin;
+    u32  firstWorldMatrix;   // Of its instances, in this frame's region of the uniform ring
+    vec3 boundsMax;
+    u32  instanceCount;
+    u32  firstVisibleMatrix; // Where its visible instances go, in GpuCulling::buffer
+    u32  padding[3];
+};
+
+struct GpuCulling
+{
+    u32    stageIdx;            // Compute stage, into App::shaderStages
+    GLuint pipeline;
+    GLuint attachedStageHandle;
+    GLuint buffer;              // The culled draw commands, and then the visible world matrices
+    u32    bufferSize;
+    u32    visibleMatricesOffset;
+    u32    cullDrawsOffset;     // Of this frame's CullDraws, from the start of the uniform ring, UINT32_MAX if not culled on the GPU
+    u32    maxInstanceCount;    // Of a draw this frame, the width of the dispatch
+    u32    visibleCapacity;     // Instances of all the draws this frame
+    bool   verifyNextFrame;     // Reads the culled commands back and checks them against the CPU
+};
+
+// HI-Z OCCLUSION CULLING
+//
+// After the geometry pass, the compute stage of Shaders/hiz_downsample.glsl reduces the depth
+// attachment into a mip chain where each texel keeps the farthest depth of the pixels under it,
+// starting at half the resolution of the attachment. The next frame, the culling shader projects
+// the box of each instance that passed the frustum test with the view projection the pyramid was
+// built with, picks the level where the box covers at most 2x2 texels, and skips the instance if
+// the box is farther than all of them. Testing against the previous frame costs no extra pass,
+// but an instance that something hid last frame shows up one frame late when it moves away.
+#define HIZ_TEXTURE_UNIT          4
+#define HIZ_IMAGE_UNIT            0
+#define HIZ_GROUP_SIZE            8 // local_size_x and local_size_y of the downsample shader
+#define HIZ_UNIFORM_SOURCE_LEVEL  0 // Explicit uniform locations of the downsample shader
+#define HIZ_UNIFORM_SOURCE_SIZE   1
+
+struct HiZPyramid
+{
+    u32    stageIdx;            // Compute stage, into App::shaderStages
+    GLuint pipeline;
+    GLuint attachedStageHandle;
+    GLuint texture;             // GL_R32F with all its levels
+    ivec2  size;                // Of level 0, half the depth attachment
+    u32    levelCount;
+    mat4   viewProjection;      // Of the frame it was built from
+    bool   isValid;             // Built last frame, so this frame can test against it
+};
+
+// DEPTH PRE-PASS
+//
+// The forward shader lights every fragment that passes the depth test, so each layer of overdraw
+// lights the same pixel again. The pre-pass draws the render queue first with the depth only
+// program of Shaders/depth_prepass.glsl, and the forward pass then tests with GL_EQUAL and depth
+// writes off, so only the visible fragment of each pixel is lit. It is only worth its extra
+// vertex work when there is overdraw to remove, which DEPTH_PREPASS_AUTO measures: the samples
+// that pass the pre-pass over those that pass the forward pass are the fragments the forward pass
+// would have lit without it, per visible one. They are counted with GL_SAMPLES_PASSED queries,
+// read DEPTH_PREPASS_QUERY_FRAMES frames later so that reading them does not stall. Frames without
+// the pre-pass measure nothing, so every DEPTH_PREPASS_PROBE_INTERVAL frames one draws it again.
+#define DEPTH_PREPASS_QUERY_FRAMES   4
+#define DEPTH_PREPASS_MIN_OVERDRAW   1.5f // Auto keeps the pre-pass while the overdraw is at least this
+#define DEPTH_PREPASS_PROBE_INTERVAL 120  // Frames
+
+enum DepthPrepassMode
+{
+    DEPTH_PREPASS_OFF,
+    DEPTH_PREPASS_ON,
+    DEPTH_PREPASS_AUTO,
+    DEPTH_PREPASS_MODE_COUNT
+};
+
+struct DepthPrepass
+{
+    DepthPrepassMode mode;
+    u32    programIdx;
+    GLuint prepassQueries[DEPTH_PREPASS_QUERY_FRAMES]; // GL_SAMPLES_PASSED of each pass
+    GLuint forwardQueries[DEPTH_PREPASS_QUERY_FRAMES];
+    bool   isQueryPending[DEPTH_PREPASS_QUERY_FRAMES]; // Issued and not read yet
+    u32    queryIdx;           // Of this frame
+    u32    framesSinceProbe;
+    f32    overdraw;           // Last measured, 0 if never
+    bool   isEnabled;          // This frame
+};
+
 enum RenderMode
 {
     FORWARD,
@@ -242,7 +768,10 @@ struct App
     ivec2 displaySize;
 
     std::vector<Texture>    textures;
-    std::vector<Program>    programs;
+    std::vector<TextureArray> textureArrays;
+    std::vector<Program>    programs;     // Program pipelines
+    std::vector<ShaderStage> shaderStages; // Shared by the pipelines
+    std::vector<LightUniformHandles> lightUniforms; // Of each element of the lights array
     std::vector<Material>   materials;
     std::vector<Mesh>       meshes;
     std::vector<Model>      models;
@@ -271,6 +800,8 @@ struct App
     u32 deferredProgramIdx;
     u32 forwardMeshProgramIdx;
     u32 depthProgramIdx;
+    u32 fallbackMeshProgramIdx;
+    u32 fallbackQuadProgramIdx;
 
     u32 texturedMeshProgramIdx;
     u32 sphereMeshProgramIdx;
@@ -284,6 +815,42 @@ struct App
 
     // Mode
     RenderMode renderMode;
+    DepthPrepass depthPrepass; // Of the forward path
+
+    MeshPool          meshPool;
+    UploadQueue       uploads;
+    ProgramCacheStats programCache;
+    ProgramBuildQueue programBuilds;
+    UniformRing       uniforms;
+    bool              useMultiDrawIndirect; // Else each item is its own draw, for comparison
+    CullingMode       cullingMode;
+    GpuCulling        gpuCulling;
+    HiZPyramid        hiZ;
+    bool              useOcclusionCulling;  // Against hiZ, when culling on the GPU
+    vec4              frustumPlanes[6];     // Of this frame's camera
+    mat4              viewProjection;
+    u32               visibleInstanceCount; // Of all the draws last frame, when culled on the CPU
+    u32               totalInstanceCount;
+    CullingSpheres    entitySpheres;        // World space, one per entity, when culled on the CPU
+    u32               visibleEntityCount;
+    f64               entityCullingTime;    // Seconds spent in CullEntities last frame
+    Bvh               entityBvh;            // World space boxes of the entities, by entity index
+    bool              useEntityBvh;         // CullEntities queries the BVH instead of testing every sphere
+    std::vector<u32>  bvhQueryItems;        // Keeps its capacity between queries
+    OcclusionBuffer   occlusionBuffer;
+    bool              useSoftwareOcclusion; // CullEntities tests the visible entities against the occluders
+    u32               occludedEntityCount;  // Of last frame
+    f64               occlusionTime;        // Seconds spent rasterizing and testing last frame
+    std::vector<mat4> instanceWorldMatrices; // Of this frame, grouped as in the uniform ring
+    std::vector<InstanceGroup> instanceGroups; // Of this frame, rebuilt by BuildInstanceGroups
+    std::vector<u32>           modelInstanceGroups; // Group of each model this frame, UINT32_MAX if none
+    RenderQueue                renderQueue;
+    GLStateCache               glState;
+    std::unordered_map<u64, u32> programPermutations; // Base program index << 32 | permutation key -> program index
+
+    // Image decode benchmark results (MB/s of images with their whole mip chain)
+    f64 stbDecodeThroughput;
+    f64 cookedDecodeThroughput;
 
     // Embedded geometry (in-editor simple meshes such as
     // a screen filling quad, a cube, a sphere...)
@@ -291,6 +858,7 @@ struct App
     GLuint embeddedElements;
 
     GLint uniformBufferAlignment;
+    GLint storageBufferAlignment;
     u32 model;
     u32 sphereModel;
     u32 directionalLight;
@@ -312,22 +880,238 @@ void Update(App* app);
 
 void Render(App* app);
 
-void PassCameraPositionToCurrentProgram(Program& programModel, App* app);
-
 void PassLightsToCurrentProgram(Program& programModel, App* app);
 
 void DrawDice(App* app);
 
-void RenderModel(App* app,Entity model, Program texturedMeshProgram);
+/**
+ * Fills the render queue with a draw item for each submesh of each instance group, drawn with the
+ * permutation of the program that matches its material, and sorts it.
+ */
+void BuildRenderQueue(App* app, u32 programIdx, f32 zfar);
+
+/**
+ * Writes the indirect command and the DrawParams of every item of the render queue into the
+ * uniform ring, and culls their instances if culling on the CPU. Called after BuildRenderQueue
+ * and before FlushUniformFrame.
+ */
+void WriteDrawCommands(App* app);
+
+/**
+ * Builds the culling and Hi-Z downsample shaders, and creates the buffer the culled draws are
+ * written to and the Hi-Z pyramid texture.
+ */
+void InitGpuCulling(App* app);
+
+/**
+ * Reduces this frame's depth attachment into the Hi-Z pyramid the next frame tests occlusion
+ * against, when culling on the GPU with useOcclusionCulling. Otherwise the pyramid is left invalid.
+ */
+void BuildHiZPyramid(App* app, const mat4& viewProjection);
+
+/**
+ * Loads the depth only program and creates the queries of the depth pre-pass.
+ */
+void InitDepthPrepass(App* app);
+
+/**
+ * Reads the sample counts of the oldest queries, decides whether this frame draws the pre-pass,
+ * and draws it. It is then left set up for the forward pass: depth testing with GL_EQUAL, depth
+ * writes off and its query running. Does nothing outside of the forward path.
+ */
+void DrawDepthPrepass(App* app);
+
+/**
+ * Ends the query of the forward pass and restores depth writes, after the forward pass.
+ */
+void EndDepthPrepass(App* app);
+
+/**
+ * Dispatches the culling shader over the draws written by WriteDrawCommands, if culling on the GPU.
+ */
+void CullDrawsOnGpu(App* app);
+
+/**
+ * Moves the boxes of the entities in entityBvh to their world matrices, and builds it again
+ * if entities were added or removed.
+ */
+void UpdateEntityBvh(App* app);
+
+/**
+ * Times building, refitting and querying a BVH of synthetic boxes around the camera.
+ */
+void BenchmarkEntityBvh(App* app);
+
+/**
+ * Tests the bounding spheres of the entities against the frustum when culling on the CPU, and
+ * marks the visible ones in entitySpheres. BuildInstanceGroups skips the others. With
+ * useSoftwareOcclusion, the occluders are then rasterized and the boxes of the visible entities
+ * hidden behind them are marked too.
+ */
+void CullEntities(App* app);
+
+/**
+ * Draws the items of the render queue in order, in batches of consecutive items that use the same
+ * state, with one glMultiDrawElementsIndirect per batch, or one instanced draw per item if
+ * useMultiDrawIndirect is off. Passes such as the depth pre-pass draw all the items with the
+ * program of programOverrideIdx instead, which samples no textures.
+ */
+void SubmitRenderQueue(App* app, u32 programOverrideIdx = UINT32_MAX);
 
 u32 LoadTexture2D(App* app, const char* filepath);
 
-GLuint FindVAO(Mesh& mesh, u32 submeshIndex, const Program& program);
-
-u32 LoadModel(App* app, const char* filename);
+/**
+ * Finds a layer for the image in a texture array page and queues its upload. The upload
+ * queue takes ownership of the image.
+ */
+void AllocateTextureArrayLayer(App* app, const Image& image, Texture& texture);
+
+void BenchmarkImageDecode(App* app);
+
+/**
+ * Times compiling all the programs from source against loading them from their cached binaries.
+ */
+void BenchmarkProgramCache(App* app);
+
+/**
+ * Enables parallel shader compilation if the driver has it and builds the fallback programs.
+ */
+void InitProgramBuilds(App* app);
+
+/**
+ * Returns the program if its build is done, and its fallback otherwise. Without parallel shader
+ * compilation this waits for the build the first time the program is needed.
+ */
+Program& GetProgram(App* app, u32 programIdx);
+
+/**
+ * Runs #include directives, and returns in dependencies the path of every file read.
+ */
+bool PreprocessShader(const char* filepath, std::string* source, std::vector<std::string>* dependencies);
+
+/**
+ * Returns the index of a permutation of a program (see MAKE_PERMUTATION_KEY), and submits
+ * its build if it is the first time it is asked for.
+ */
+u32 GetProgramPermutation(App* app, u32 programIdx, u32 permutationKey);
+
+/**
+ * Builds again the programs whose source files, or the files they include, changed.
+ */
+void HotReloadPrograms(App* app);
+
+void InitUploadQueue(App* app);
+
+/**
+ * Creates the uniform ring and queries the offset alignment of uniform buffers.
+ */
+void InitUniformRing(App* app);
+
+/**
+ * Waits until the GPU is done with the ring region of this frame, and writes the GlobalParams
+ * block into it.
+ */
+void BeginUniformFrame(App* app, const mat4& view, const mat4& projection);
+
+/**
+ * Groups the entities by model, and writes the world matrices and LocalParams of every group into
+ * this frame's region of the uniform ring.
+ */
+void BuildInstanceGroups(App* app);
+
+/**
+ * Makes this frame's writes visible to the GPU. Called after the last Push and before drawing.
+ */
+void FlushUniformFrame(App* app);
+
+/**
+ * Fences this frame's region, called after its last draw.
+ */
+void EndUniformFrame(App* app);
+
+void QueueSubmeshUpload(App* app, u32 meshIdx, u32 submeshIdx);
+
+void QueueTextureLayerUpload(App* app, const Image& image, u32 arrayIdx, u32 layer);
+
+/**
+ * Copies queued uploads to the GPU until the per frame budget is spent. Called once per frame.
+ */
+void ProcessUploads(App* app);
+
+/**
+ * Finds (or adds) the pool for a vertex format and returns its index in MeshPool::vertexFormats.
+ */
+u32 FindVertexFormatPool(App* app, const VertexBufferLayout& layout);
+
+/**
+ * Gives a submesh ranges of the pool buffers for its vertices and indices, and queues their upload.
+ */
+void AllocateSubmeshGeometry(App* app, u32 meshIdx, u32 submeshIdx);
+
+/**
+ * Returns the ranges of the pool buffers used by a mesh, e.g. when it is unloaded. Meshes are
+ * never unloaded yet, so nothing calls it for now.
+ */
+void FreeMeshGeometry(App* app, u32 meshIdx);
+
+/**
+ * Releases the CPU copy of a mesh's geometry that its residency policy does not keep. It has
+ * to wait until the uploads of the mesh are done, as they read from that copy.
+ */
+void ApplyGeometryResidency(App* app, u32 meshIdx);
+
+u32 LoadModel(App* app, const char* filename, GeometryResidency residency = GEOMETRY_RESIDENCY_NONE);
 
 u8 LoadProgramAttributes(Program& program);
 
+/**
+ * Fills the uniform table of a pipeline with the active uniforms and uniform blocks of its
+ * attached stages.
+ */
+void ReflectProgramUniforms(Program& program);
+
+/**
+ * Returns the handle of a uniform name as GL reports it, e.g. "lights[2].color". Arrays of basic
+ * types go by their name without "[0]". Hash the names once and keep the handles.
+ */
+UniformHandle GetUniformHandle(const char* name);
+
+/**
+ * Returns the entry of a uniform in the table that comes after previous, or the first one if
+ * previous is NULL. Returns NULL when there are no more, or if no attached stage uses it.
+ */
+const ProgramUniform* FindProgramUniform(const Program& program, UniformHandle handle, const ProgramUniform* previous = NULL);
+
+/**
+ * Set a uniform on every stage of the pipeline that declares it. Stages are separate programs,
+ * so glUniform* would only reach the active one. Uniforms no stage uses are ignored, and so are
+ * the values a stage already has (see GLStateCache).
+ */
+void SetUniform1i(App* app, const Program& program, UniformHandle handle, i32 value);
+void SetUniform1ui(App* app, const Program& program, UniformHandle handle, u32 value);
+void SetUniform3fv(App* app, const Program& program, UniformHandle handle, const vec3& value);
+void SetUniformMatrix4fv(App* app, const Program& program, UniformHandle handle, const mat4& value);
+
+/**
+ * Forgets the cached GL state, as other code may have changed it since the last frame, and keeps
+ * the call counts of the last frame. Called before the first draw of a frame.
+ */
+void BeginGLStateFrame(App* app);
+
+/**
+ * Change GL state through the state cache, skipping the calls that would not change it.
+ */
+void BindFramebuffer(App* app, GLuint framebuffer);
+void BindProgramPipeline(App* app, GLuint pipeline);
+void BindVertexArray(App* app, GLuint vertexArray);
+void BindBuffer(App* app, GLenum target, GLuint buffer);
+void BindBufferRange(App* app, GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size);
+void BindTexture(App* app, u32 unit, GLenum target, GLuint texture);
+void BindSampler(App* app, u32 unit, GLuint sampler);
+void SetBlendState(App* app, bool enabled, GLenum srcFactor, GLenum dstFactor);
+void SetDepthState(App* app, bool testEnabled, bool writeEnabled, GLenum func);
+void SetColorWriteState(App* app, bool enabled);
+
 void HandleInput(App* app);
 
 Light CreateLight(App* app, LightType lightType, vec3 position, vec3 direction, vec3 color);
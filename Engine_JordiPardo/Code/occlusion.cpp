@@ -0,0 +1,242 @@
+//
+// occlusion.cpp : Occluder triangle setup, the SSE rasterizer and the box tests.
+//
+
+#include "occlusion.h"
+#include <float.h>
+
+// SSE is always there on x64
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define OCCLUSION_SIMD_SSE
+#include <xmmintrin.h>
+#endif
+
+void BeginOcclusionFrame(OcclusionBuffer& buffer)
+{
+    buffer.depth.assign(OCCLUSION_BUFFER_WIDTH * OCCLUSION_BUFFER_HEIGHT, 1.0f);
+    buffer.triangles.clear();
+}
+
+static glm::vec3 ClipToBufferSpace(const glm::vec4& clip)
+{
+    const glm::vec3 ndc = glm::vec3(clip) / clip.w;
+    return glm::vec3((ndc.x * 0.5f + 0.5f) * OCCLUSION_BUFFER_WIDTH,
+                     (ndc.y * 0.5f + 0.5f) * OCCLUSION_BUFFER_HEIGHT,
+                     ndc.z * 0.5f + 0.5f);
+}
+
+static void AddOccluderTriangle(OcclusionBuffer& buffer, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c)
+{
+    // Back facing or degenerate
+    const f32 doubleArea = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+    if (doubleArea <= 0.0f)
+        return;
+
+    const glm::vec3 boundsMin = glm::min(a, glm::min(b, c));
+    const glm::vec3 boundsMax = glm::max(a, glm::max(b, c));
+    if (boundsMax.x < 0.0f || boundsMin.x > OCCLUSION_BUFFER_WIDTH ||
+        boundsMax.y < 0.0f || boundsMin.y > OCCLUSION_BUFFER_HEIGHT || boundsMin.z > 1.0f)
+        return;
+
+    OccluderTriangle triangle;
+    triangle.vertices[0] = a;
+    triangle.vertices[1] = b;
+    triangle.vertices[2] = c;
+    buffer.triangles.push_back(triangle);
+}
+
+void AddOccluder(OcclusionBuffer& buffer, const glm::mat4& worldViewProjection,
+                 const glm::vec3* vertices, const u32* indices, u32 indexCount)
+{
+    for (u32 i = 0; i + 2 < indexCount; i += 3)
+    {
+        glm::vec4 clip[3];
+        for (u32 k = 0; k < 3; ++k)
+            clip[k] = worldViewProjection * glm::vec4(vertices[indices[i + k]], 1.0f);
+
+        // Clipping a triangle against one plane leaves at most a quad
+        glm::vec4 polygon[4];
+        u32 polygonSize = 0;
+        for (u32 k = 0; k < 3; ++k)
+        {
+            const glm::vec4& current = clip[k];
+            const glm::vec4& next = clip[(k + 1) % 3];
+            const bool isCurrentInside = current.w >= OCCLUSION_NEAR_W;
+            const bool isNextInside = next.w >= OCCLUSION_NEAR_W;
+            if (isCurrentInside)
+                polygon[polygonSize++] = current;
+            if (isCurrentInside != isNextInside)
+                polygon[polygonSize++] = glm::mix(current, next, (OCCLUSION_NEAR_W - current.w) / (next.w - current.w));
+        }
+        if (polygonSize < 3)
+            continue;
+
+        glm::vec3 screen[4];
+        for (u32 k = 0; k < polygonSize; ++k)
+            screen[k] = ClipToBufferSpace(polygon[k]);
+        for (u32 k = 1; k + 1 < polygonSize; ++k)
+            AddOccluderTriangle(buffer, screen[0], screen[k], screen[k + 1]);
+    }
+}
+
+// Edge functions e = a * x + b * y + c are positive on the inside of counter clockwise triangles,
+// and depth is interpolated with the plane z = a * x + b * y + c
+static void RasterizeTriangle(f32* depth, const OccluderTriangle& triangle, i32 firstRow, i32 lastRow)
+{
+    const glm::vec3* v = triangle.vertices;
+
+    // Pixels whose centers can be inside, clamped before the conversion so far vertices do not overflow
+    const f32 minX = glm::min(v[0].x, glm::min(v[1].x, v[2].x)), maxX = glm::max(v[0].x, glm::max(v[1].x, v[2].x));
+    const f32 minY = glm::min(v[0].y, glm::min(v[1].y, v[2].y)), maxY = glm::max(v[0].y, glm::max(v[1].y, v[2].y));
+    const i32 firstX = (i32)glm::clamp(floorf(minX), 0.0f, (f32)OCCLUSION_BUFFER_WIDTH) & ~3;
+    const i32 lastX = (i32)glm::clamp(ceilf(maxX), -1.0f, OCCLUSION_BUFFER_WIDTH - 1.0f);
+    const i32 firstY = glm::max((i32)glm::clamp(floorf(minY), 0.0f, (f32)OCCLUSION_BUFFER_HEIGHT), firstRow);
+    const i32 lastY = glm::min((i32)glm::clamp(ceilf(maxY), -1.0f, OCCLUSION_BUFFER_HEIGHT - 1.0f), lastRow);
+    if (firstX > lastX || firstY > lastY)
+        return;
+
+    f32 edgeA[3], edgeB[3], edgeC[3];
+    for (u32 k = 0; k < 3; ++k)
+    {
+        const glm::vec3& from = v[k];
+        const glm::vec3& to = v[(k + 1) % 3];
+        edgeA[k] = from.y - to.y;
+        edgeB[k] = to.x - from.x;
+        edgeC[k] = from.x * to.y - from.y * to.x;
+    }
+
+    // Each vertex is weighted by the edge in front of it
+    const f32 doubleArea = edgeA[0] * v[2].x + edgeB[0] * v[2].y + edgeC[0];
+    const f32 depthA = (edgeA[1] * v[0].z + edgeA[2] * v[1].z + edgeA[0] * v[2].z) / doubleArea;
+    const f32 depthB = (edgeB[1] * v[0].z + edgeB[2] * v[1].z + edgeB[0] * v[2].z) / doubleArea;
+    const f32 depthC = (edgeC[1] * v[0].z + edgeC[2] * v[1].z + edgeC[0] * v[2].z) / doubleArea;
+
+#if defined(OCCLUSION_SIMD_SSE)
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 columnStep = _mm_set1_ps(4.0f);
+    const __m128 firstColumns = _mm_add_ps(_mm_set1_ps((f32)firstX), _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f));
+    const __m128 a0 = _mm_set1_ps(edgeA[0]), a1 = _mm_set1_ps(edgeA[1]), a2 = _mm_set1_ps(edgeA[2]);
+    const __m128 za = _mm_set1_ps(depthA);
+
+    for (i32 y = firstY; y <= lastY; ++y)
+    {
+        const f32 py = y + 0.5f;
+        const __m128 c0 = _mm_set1_ps(edgeB[0] * py + edgeC[0]);
+        const __m128 c1 = _mm_set1_ps(edgeB[1] * py + edgeC[1]);
+        const __m128 c2 = _mm_set1_ps(edgeB[2] * py + edgeC[2]);
+        const __m128 zc = _mm_set1_ps(depthB * py + depthC);
+
+        f32* row = depth + y * OCCLUSION_BUFFER_WIDTH;
+        __m128 px = firstColumns;
+        for (i32 x = firstX; x <= lastX; x += 4, px = _mm_add_ps(px, columnStep))
+        {
+            __m128 inside = _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a0, px), c0), zero);
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a1, px), c1), zero));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a2, px), c2), zero));
+            if (_mm_movemask_ps(inside) == 0)
+                continue;
+
+            const __m128 z = _mm_add_ps(_mm_mul_ps(za, px), zc);
+            const __m128 current = _mm_loadu_ps(row + x);
+            const __m128 write = _mm_and_ps(inside, _mm_cmplt_ps(z, current));
+            _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(write, z), _mm_andnot_ps(write, current)));
+        }
+    }
+#else
+    for (i32 y = firstY; y <= lastY; ++y)
+    {
+        const f32 py = y + 0.5f;
+        f32* row = depth + y * OCCLUSION_BUFFER_WIDTH;
+        for (i32 x = firstX; x <= lastX; ++x)
+        {
+            const f32 px = x + 0.5f;
+            if (edgeA[0] * px + edgeB[0] * py + edgeC[0] < 0.0f ||
+                edgeA[1] * px + edgeB[1] * py + edgeC[1] < 0.0f ||
+                edgeA[2] * px + edgeB[2] * py + edgeC[2] < 0.0f)
+                continue;
+
+            row[x] = glm::min(row[x], depthA * px + depthB * py + depthC);
+        }
+    }
+#endif
+}
+
+// Bands do not share rows, so they write the buffer without synchronization
+static void RasterizeBands(void* userData, u32 begin, u32 end)
+{
+    OcclusionBuffer& buffer = *(OcclusionBuffer*)userData;
+    for (u32 band = begin; band < end; ++band)
+    {
+        const i32 firstRow = band * OCCLUSION_BAND_HEIGHT;
+        const i32 lastRow = glm::min(firstRow + OCCLUSION_BAND_HEIGHT, OCCLUSION_BUFFER_HEIGHT) - 1;
+        for (const OccluderTriangle& triangle : buffer.triangles)
+            RasterizeTriangle(buffer.depth.data(), triangle, firstRow, lastRow);
+    }
+}
+
+void RasterizeOccluders(OcclusionBuffer& buffer)
+{
+    const u32 bandCount = (OCCLUSION_BUFFER_HEIGHT + OCCLUSION_BAND_HEIGHT - 1) / OCCLUSION_BAND_HEIGHT;
+    ParallelFor(bandCount, 1, RasterizeBands, &buffer);
+}
+
+bool IsBoxOccluded(const OcclusionBuffer& buffer, const glm::mat4& viewProjection,
+                   const glm::vec3& boundsMin, const glm::vec3& boundsMax)
+{
+    if (buffer.depth.empty())
+        return false;
+
+    glm::vec2 rectMin(FLT_MAX), rectMax(-FLT_MAX);
+    f32 nearestDepth = FLT_MAX;
+    for (u32 corner = 0; corner < 8; ++corner)
+    {
+        const glm::vec3 position((corner & 1) ? boundsMax.x : boundsMin.x,
+                                 (corner & 2) ? boundsMax.y : boundsMin.y,
+                                 (corner & 4) ? boundsMax.z : boundsMin.z);
+        const glm::vec4 clip = viewProjection * glm::vec4(position, 1.0f);
+        if (clip.w < OCCLUSION_NEAR_W)
+            return false;
+
+        const glm::vec3 screen = ClipToBufferSpace(clip);
+        rectMin = glm::min(rectMin, glm::vec2(screen));
+        rectMax = glm::max(rectMax, glm::vec2(screen));
+        nearestDepth = glm::min(nearestDepth, screen.z);
+    }
+
+    // Every pixel the rectangle touches
+    const i32 firstX = (i32)glm::clamp(floorf(rectMin.x), 0.0f, OCCLUSION_BUFFER_WIDTH - 1.0f);
+    const i32 lastX = (i32)glm::clamp(floorf(rectMax.x), 0.0f, OCCLUSION_BUFFER_WIDTH - 1.0f);
+    const i32 firstY = (i32)glm::clamp(floorf(rectMin.y), 0.0f, OCCLUSION_BUFFER_HEIGHT - 1.0f);
+    const i32 lastY = (i32)glm::clamp(floorf(rectMax.y), 0.0f, OCCLUSION_BUFFER_HEIGHT - 1.0f);
+
+#if defined(OCCLUSION_SIMD_SSE)
+    // Groups of four aligned pixels, masking the ones of the first and last groups outside of the rectangle
+    const __m128 nearest = _mm_set1_ps(nearestDepth);
+    const i32 firstGroupX = firstX & ~3;
+    const u32 firstGroupMask = 0xf & (0xf << (firstX - firstGroupX));
+    const u32 lastGroupMask = 0xf >> (3 - ((lastX - firstGroupX) & 3));
+    for (i32 y = firstY; y <= lastY; ++y)
+    {
+        const f32* row = buffer.depth.data() + y * OCCLUSION_BUFFER_WIDTH;
+        for (i32 x = firstGroupX; x <= lastX; x += 4)
+        {
+            u32 mask = 0xf;
+            if (x == firstGroupX) mask &= firstGroupMask;
+            if (x + 4 > lastX) mask &= lastGroupMask;
+            if (((u32)_mm_movemask_ps(_mm_cmpge_ps(_mm_loadu_ps(row + x), nearest)) & mask) != 0)
+                return false;
+        }
+    }
+#else
+    for (i32 y = firstY; y <= lastY; ++y)
+    {
+        const f32* row = buffer.depth.data() + y * OCCLUSION_BUFFER_WIDTH;
+        for (i32 x = firstX; x <= lastX; ++x)
+        {
+            if (row[x] >= nearestDepth)
+                return false;
+        }
+    }
+#endif
+    return true;
+}
@@ -0,0 +1,55 @@
+//
+// occlusion.h: Software occlusion culling. Low poly occluders are rasterized on the CPU into a
+// small depth buffer, and the screen rectangles of the boxes of other objects are tested against
+// it before their draws are queued.
+//
+
+#pragma once
+
+#include "platform.h"
+
+#define OCCLUSION_BUFFER_WIDTH    256   // Multiple of 4, the SIMD width
+#define OCCLUSION_BUFFER_HEIGHT   128
+#define OCCLUSION_BAND_HEIGHT     16    // Rows rasterized by each ParallelFor batch
+#define OCCLUSION_NEAR_W          1e-4f // Occluder triangles are clipped against w = OCCLUSION_NEAR_W
+#define OCCLUSION_TEST_BATCH_SIZE 256   // Boxes tested by each ParallelFor batch of the callers
+
+/**
+ * Front facing occluder triangle in buffer space: x and y in pixels from the bottom left corner,
+ * z the depth in [0, 1].
+ */
+struct OccluderTriangle
+{
+    glm::vec3 vertices[3];
+};
+
+struct OcclusionBuffer
+{
+    std::vector<f32>              depth;     // Nearest occluder of each pixel, rows from the bottom
+    std::vector<OccluderTriangle> triangles; // Added since BeginOcclusionFrame
+};
+
+/**
+ * Clears the depth to the far plane and forgets the occluders of the previous frame.
+ */
+void BeginOcclusionFrame(OcclusionBuffer& buffer);
+
+/**
+ * Transforms the triangles of an occluder to buffer space, clips them against the near plane
+ * and keeps the ones facing the camera. The winding of the indices has to be counter clockwise.
+ */
+void AddOccluder(OcclusionBuffer& buffer, const glm::mat4& worldViewProjection,
+                 const glm::vec3* vertices, const u32* indices, u32 indexCount);
+
+/**
+ * Rasterizes the occluders added this frame. Bands of rows run in parallel with ParallelFor,
+ * and each one evaluates the edge functions of four pixels at once with SSE.
+ */
+void RasterizeOccluders(OcclusionBuffer& buffer);
+
+/**
+ * Returns true if the nearest point of the world space box is behind the occluders on every pixel
+ * of its screen rectangle. Boxes that cross the near plane are never occluded.
+ */
+bool IsBoxOccluded(const OcclusionBuffer& buffer, const glm::mat4& viewProjection,
+                   const glm::vec3& boundsMin, const glm::vec3& boundsMax);
@@ -72,15 +72,143 @@ String GetDirectoryPart(String path);
 /**
  * Reads a whole file and returns a string with its contents. The returned string
  * is temporary and should be copied if it needs to persist for several frames.
+ * The file is looked up in the mounted paks first.
  */
 String ReadTextFile(const char *filepath);
 
+struct MappedFile
+{
+    void* data;
+    u64   size;
+    void* fileHandle;
+    void* mappingHandle;
+    bool  isPakView;  // data points inside a mounted pak, there is nothing to unmap
+    bool  isHeapCopy; // data was decompressed from a pak entry into malloc'd memory
+};
+
+/**
+ * Maps a whole file into memory for reading, so that it can be accessed without copies.
+ * data is NULL if the file could not be opened or is empty. The memory stays valid until
+ * UnmapFile is called. The file is looked up in the mounted paks first.
+ */
+MappedFile MapFile(const char *filepath);
+
+void UnmapFile(MappedFile &file);
+
+/**
+ * Returns true if the file is in a mounted pak or on disk.
+ */
+bool FileExists(const char *filepath);
+
+// VIRTUAL FILE SYSTEM
+//
+// A pak packs many files into a single one, so that opening an asset is a lookup in an
+// index instead of a call to the file system. The layout is a PakHeader, the PakEntry
+// array, the hash table, the names and then the payloads, each one aligned to PAK_ALIGNMENT.
+// The hash table has a power of two number of buckets holding entry indices (UINT32_MAX if
+// empty), and it is probed linearly starting at pathHash & (bucketCount - 1).
+
+#define PAK_MAGIC     0x4b504741 // "AGPK"
+#define PAK_VERSION   1
+#define PAK_ALIGNMENT 4096
+#define PAK_HASH_SEED 0x70616b // Seed of HashBytes for the entry paths
+
+#define PAK_ENTRY_LZ4 0x1
+
+struct PakHeader
+{
+    u32 magic;
+    u32 version;
+    u32 entryCount;
+    u32 bucketCount;
+    u64 entriesOffset;
+    u64 bucketsOffset;
+    u64 namesOffset;
+};
+
+struct PakEntry
+{
+    u64 pathHash;   // HashBytes of the normalized path
+    u64 offset;     // From the start of the pak
+    u64 storedSize; // Size of the payload in the pak, compressed or not
+    u64 rawSize;
+    u32 nameOffset; // Normalized path, from namesOffset and without terminator
+    u32 nameLength;
+    u32 flags;
+    u32 padding;
+};
+
+/**
+ * Maps a pak so that its files can be read through MapFile and ReadTextFile. Paks are
+ * searched in the order they were mounted. They must be mounted before other threads
+ * start reading files. Returns false if the pak does not exist or is not valid.
+ */
+bool MountPak(const char *pakPath);
+
+void UnmountPaks();
+
+/**
+ * Creates a directory if it does not exist yet. Returns false if it could not be created.
+ */
+bool MakeDirectory(const char *path);
+
+/**
+ * Appends the paths of all the files inside a directory and its subdirectories,
+ * using '/' as separator and starting with the given directory.
+ */
+void ListFilesRecursive(const char *directory, std::vector<std::string> &filepaths);
+
+bool SetWorkingDirectory(const char *path);
+
 /**
  * It retrieves a timestamp indicating the last time the file was modified.
  * Can be useful in order to check for file modifications to implement hot reloads.
  */
 u64 GetFileLastWriteTimestamp(const char *filepath);
 
+/**
+ * Work function for ParallelFor. It has to process the items in [begin, end).
+ */
+typedef void (*JobFunction)(void *userData, u32 begin, u32 end);
+
+/**
+ * Splits [0, count) in batches of batchSize items and runs them on a pool of worker
+ * threads (and the calling thread). Returns once all the batches are done.
+ * It must only be called from the main thread, and jobs can not call it again.
+ */
+void ParallelFor(u32 count, u32 batchSize, JobFunction function, void *userData);
+
+/**
+ * Number of threads that run ParallelFor batches, the calling thread included.
+ */
+u32 GetJobThreadCount();
+
+/**
+ * Paths are compared with '/' separators, in lowercase and without "." or ".." segments.
+ */
+std::string NormalizeAssetPath(const char *path);
+
+// MurmurHash64A
+u64 HashBytes(const void *data, u64 size, u64 seed);
+
+// Extra bytes the destination of LZ4Decompress must have after dstSize, as the
+// decoder copies in 16 byte chunks and may write past the end of the last sequence.
+#define LZ4_DECODE_SLACK 32
+
+u32 LZ4CompressBound(u32 srcSize);
+
+/**
+ * Compresses srcSize bytes into an LZ4 block. Returns the size of the compressed
+ * block, or 0 if it did not fit in dstCapacity bytes.
+ */
+u32 LZ4Compress(const u8 *src, u32 srcSize, u8 *dst, u32 dstCapacity);
+
+/**
+ * Decompresses an LZ4 block that is known to expand to exactly dstSize bytes.
+ * Returns false if the block is malformed.
+ */
+bool LZ4Decompress(const u8 *src, u32 srcSize, u8 *dst, u32 dstSize);
+
 /**
  * It logs a string to whichever outputs are configured in the platform layer.
  * By default, the string is printed in the output console of VisualStudio.
@@ -107,3 +235,10 @@ LogString(logBuffer);             \
 #define PI  3.14159265359f
 #define TAU 6.28318530718f
 
+/**
+ * Temporary memory used by the string functions above. The platform layer resets
+ * it at the end of every frame.
+ */
+#define GLOBAL_FRAME_ARENA_SIZE MB(16)
+extern u8* GlobalFrameArenaMemory;
+extern u32 GlobalFrameArenaHead;
@@ -0,0 +1,900 @@
+//
+// platform_io.cpp : This file contains the platform services that do not depend on the window or
+// the graphics context (temporary memory, strings, files, logging and worker threads), so that
+// they can also be linked by command line tools such as the asset cooker.
+//
+
+#ifdef _WIN32
+#define VC_EXTRALEAN
+#define WIN32_LEAN_AND_MEAN
+#define _CRT_SECURE_NO_WARNINGS
+#include <Windows.h>
+#include <direct.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+#include "platform.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define PLATFORM_SSE2
+#endif
+
+u8* GlobalFrameArenaMemory = NULL;
+u32 GlobalFrameArenaHead = 0;
+
+u32 Strlen(const char* string)
+{
+    u32 len = 0;
+    while (*string++) len++;
+    return len;
+}
+
+void* PushSize(u32 byteCount)
+{
+    ASSERT(GlobalFrameArenaHead + byteCount <= GLOBAL_FRAME_ARENA_SIZE,
+           "Trying to allocate more temp memory than available");
+
+    u8* curPtr = GlobalFrameArenaMemory + GlobalFrameArenaHead;
+    GlobalFrameArenaHead += byteCount;
+    return curPtr;
+}
+
+void* PushBytes(const void* bytes, u32 byteCount)
+{
+    ASSERT(GlobalFrameArenaHead + byteCount <= GLOBAL_FRAME_ARENA_SIZE,
+            "Trying to allocate more temp memory than available");
+
+    u8* srcPtr = (u8*)bytes;
+    u8* curPtr = GlobalFrameArenaMemory + GlobalFrameArenaHead;
+    u8* dstPtr = GlobalFrameArenaMemory + GlobalFrameArenaHead;
+    GlobalFrameArenaHead += byteCount;
+    while (byteCount--) *dstPtr++ = *srcPtr++;
+    return curPtr;
+}
+
+u8* PushChar(u8 c)
+{
+    ASSERT(GlobalFrameArenaHead + 1 <= GLOBAL_FRAME_ARENA_SIZE,
+            "Trying to allocate more temp memory than available");
+    u8* ptr = GlobalFrameArenaMemory + GlobalFrameArenaHead;
+    GlobalFrameArenaHead++;
+    *ptr = c;
+    return ptr;
+}
+
+String MakeString(const char *cstr)
+{
+    String str = {};
+    str.len = Strlen(cstr);
+    str.str = (char*)PushBytes(cstr, str.len);
+              PushChar(0);
+    return str;
+}
+
+String MakePath(String dir, String filename)
+{
+    String str = {};
+    str.len = dir.len + filename.len + 1;
+    str.str = (char*)PushBytes(dir.str, dir.len);
+              PushChar('/');
+              PushBytes(filename.str, filename.len);
+              PushChar(0);
+    return str;
+}
+
+String GetDirectoryPart(String path)
+{
+    String str = {};
+    i32 len = (i32)path.len;
+    while (len >= 0) {
+        len--;
+        if (path.str[len] == '/' || path.str[len] == '\\')
+            break;
+    }
+    str.len = (u32)len;
+    str.str = (char*)PushBytes(path.str, str.len);
+              PushChar(0);
+    return str;
+}
+
+String ReadTextFile(const char* filepath)
+{
+    String fileText = {};
+
+    MappedFile file = MapFile(filepath);
+
+    if (file.data)
+    {
+        fileText.len = (u32)file.size;
+        fileText.str = (char*)PushBytes(file.data, fileText.len);
+                       PushChar(0);
+
+        UnmapFile(file);
+    }
+    else
+    {
+        ELOG("ReadTextFile() failed reading file %s", filepath);
+    }
+
+    return fileText;
+}
+
+static MappedFile MapDiskFile(const char* filepath)
+{
+    MappedFile mappedFile = {};
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filepath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return mappedFile;
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return mappedFile;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    void* data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (!data)
+    {
+        ELOG("MapFile() failed mapping file %s", filepath);
+        if (mapping) CloseHandle(mapping);
+        CloseHandle(file);
+        return mappedFile;
+    }
+
+    mappedFile.data = data;
+    mappedFile.size = (u64)fileSize.QuadPart;
+    mappedFile.fileHandle = file;
+    mappedFile.mappingHandle = mapping;
+#else
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0)
+        return mappedFile;
+
+    struct stat attrib;
+    if (fstat(fd, &attrib) != 0 || attrib.st_size == 0)
+    {
+        close(fd);
+        return mappedFile;
+    }
+
+    // The mapping keeps the file alive, so the descriptor can be closed right away
+    void* data = mmap(NULL, attrib.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        ELOG("MapFile() failed mapping file %s", filepath);
+        return mappedFile;
+    }
+
+    mappedFile.data = data;
+    mappedFile.size = (u64)attrib.st_size;
+#endif
+
+    return mappedFile;
+}
+
+static bool MapPakFile(const char* filepath, MappedFile* mappedFile);
+
+MappedFile MapFile(const char* filepath)
+{
+    MappedFile mappedFile = {};
+    if (MapPakFile(filepath, &mappedFile))
+        return mappedFile;
+
+    return MapDiskFile(filepath);
+}
+
+void UnmapFile(MappedFile& file)
+{
+    if (!file.data)
+        return;
+
+    if (file.isHeapCopy)
+        free(file.data);
+    if (file.isPakView || file.isHeapCopy)
+    {
+        file = {};
+        return;
+    }
+
+#ifdef _WIN32
+    UnmapViewOfFile(file.data);
+    CloseHandle((HANDLE)file.mappingHandle);
+    CloseHandle((HANDLE)file.fileHandle);
+#else
+    munmap(file.data, file.size);
+#endif
+
+    file = {};
+}
+
+struct Pak;
+static bool FindPakEntry(const char* filepath, const Pak** pak, const PakEntry** entry);
+
+bool FileExists(const char* filepath)
+{
+    const Pak* pak;
+    const PakEntry* entry;
+    if (FindPakEntry(filepath, &pak, &entry))
+        return true;
+
+#ifdef _WIN32
+    return GetFileAttributesA(filepath) != INVALID_FILE_ATTRIBUTES;
+#else
+    struct stat attrib;
+    return stat(filepath, &attrib) == 0;
+#endif
+}
+
+bool MakeDirectory(const char* path)
+{
+#ifdef _WIN32
+    return CreateDirectoryA(path, NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+void ListFilesRecursive(const char* directory, std::vector<std::string>& filepaths)
+{
+#ifdef _WIN32
+    std::string pattern = std::string(directory) + "/*";
+    WIN32_FIND_DATAA findData;
+    HANDLE find = FindFirstFileA(pattern.c_str(), &findData);
+    if (find == INVALID_HANDLE_VALUE)
+        return;
+
+    do
+    {
+        if (strcmp(findData.cFileName, ".") == 0 || strcmp(findData.cFileName, "..") == 0)
+            continue;
+
+        std::string path = std::string(directory) + "/" + findData.cFileName;
+        if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            ListFilesRecursive(path.c_str(), filepaths);
+        else
+            filepaths.push_back(path);
+    } while (FindNextFileA(find, &findData));
+
+    FindClose(find);
+#else
+    DIR* dir = opendir(directory);
+    if (!dir)
+        return;
+
+    while (struct dirent* entry = readdir(dir))
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        std::string path = std::string(directory) + "/" + entry->d_name;
+        struct stat attrib;
+        if (stat(path.c_str(), &attrib) != 0)
+            continue;
+
+        if (S_ISDIR(attrib.st_mode))
+            ListFilesRecursive(path.c_str(), filepaths);
+        else
+            filepaths.push_back(path);
+    }
+
+    closedir(dir);
+#endif
+}
+
+bool SetWorkingDirectory(const char* path)
+{
+#ifdef _WIN32
+    return _chdir(path) == 0;
+#else
+    return chdir(path) == 0;
+#endif
+}
+
+u64 GetFileLastWriteTimestamp(const char* filepath)
+{
+#ifdef _WIN32
+    union Filetime2u64 {
+        FILETIME filetime;
+        u64      u64time;
+    } conversor;
+
+    WIN32_FILE_ATTRIBUTE_DATA Data;
+    if(GetFileAttributesExA(filepath, GetFileExInfoStandard, &Data)) {
+        conversor.filetime = Data.ftLastWriteTime;
+        return(conversor.u64time);
+    }
+#else
+    // NOTE: This has not been tested in unix-like systems
+    struct stat attrib;
+    if (stat(filepath, &attrib) == 0) {
+        return attrib.st_mtime;
+    }
+#endif
+
+    return 0;
+}
+
+void LogString(const char* str)
+{
+#ifdef _WIN32
+    OutputDebugStringA(str);
+    OutputDebugStringA("\n");
+#endif
+#if !defined(_WIN32) || defined(_CONSOLE)
+    // Console builds (e.g. the Cooker run from a shell) also need the log outside the debugger
+    fprintf(stderr, "%s\n", str);
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////
+// Virtual file system
+
+struct Pak
+{
+    MappedFile      file;
+    const PakEntry* entries;
+    const u32*      buckets;
+    const char*     names;
+    u32             entryCount;
+    u32             bucketCount;
+};
+
+static std::vector<Pak> GlobalPaks;
+
+static bool IsPakRangeValid(const MappedFile& file, u64 offset, u64 size)
+{
+    return offset <= file.size && size <= file.size - offset;
+}
+
+bool MountPak(const char* pakPath)
+{
+    Pak pak = {};
+    pak.file = MapDiskFile(pakPath);
+    if (!pak.file.data)
+        return false;
+
+    const PakHeader* header = (const PakHeader*)pak.file.data;
+    bool valid = pak.file.size >= sizeof(PakHeader) &&
+                 header->magic == PAK_MAGIC && header->version == PAK_VERSION &&
+                 header->bucketCount > 0 && (header->bucketCount & (header->bucketCount - 1)) == 0 &&
+                 IsPakRangeValid(pak.file, header->entriesOffset, (u64)header->entryCount * sizeof(PakEntry)) &&
+                 IsPakRangeValid(pak.file, header->bucketsOffset, (u64)header->bucketCount * sizeof(u32)) &&
+                 IsPakRangeValid(pak.file, header->namesOffset, 0);
+
+    if (valid)
+    {
+        pak.entries = (const PakEntry*)((const u8*)pak.file.data + header->entriesOffset);
+        pak.buckets = (const u32*)((const u8*)pak.file.data + header->bucketsOffset);
+        pak.names = (const char*)pak.file.data + header->namesOffset;
+        pak.entryCount = header->entryCount;
+        pak.bucketCount = header->bucketCount;
+
+        // Validated once here so that lookups can trust the index
+        for (u32 i = 0; valid && i < pak.entryCount; ++i)
+        {
+            const PakEntry& entry = pak.entries[i];
+            valid = IsPakRangeValid(pak.file, entry.offset, entry.storedSize) &&
+                    IsPakRangeValid(pak.file, header->namesOffset + entry.nameOffset, entry.nameLength) &&
+                    ((entry.flags & PAK_ENTRY_LZ4) ? entry.rawSize <= UINT32_MAX && entry.storedSize <= UINT32_MAX
+                                                   : entry.rawSize == entry.storedSize);
+        }
+        for (u32 i = 0; valid && i < pak.bucketCount; ++i)
+            valid = pak.buckets[i] == UINT32_MAX || pak.buckets[i] < pak.entryCount;
+    }
+
+    if (!valid)
+    {
+        ELOG("MountPak() - %s is not a valid pak", pakPath);
+        UnmapFile(pak.file);
+        return false;
+    }
+
+    GlobalPaks.push_back(pak);
+    ILOG("Mounted pak %s (%u files)", pakPath, pak.entryCount);
+    return true;
+}
+
+void UnmountPaks()
+{
+    for (Pak& pak : GlobalPaks)
+        UnmapFile(pak.file);
+    GlobalPaks.clear();
+}
+
+static bool FindPakEntry(const char* filepath, const Pak** pak, const PakEntry** entry)
+{
+    if (GlobalPaks.empty())
+        return false;
+
+    const std::string path = NormalizeAssetPath(filepath);
+    const u64 hash = HashBytes(path.data(), path.size(), PAK_HASH_SEED);
+
+    for (const Pak& candidate : GlobalPaks)
+    {
+        const u32 mask = candidate.bucketCount - 1;
+        for (u32 probe = 0; probe < candidate.bucketCount; ++probe)
+        {
+            const u32 entryIdx = candidate.buckets[(hash + probe) & mask];
+            if (entryIdx == UINT32_MAX)
+                break;
+
+            const PakEntry& candidateEntry = candidate.entries[entryIdx];
+            if (candidateEntry.pathHash == hash && candidateEntry.nameLength == path.size() &&
+                memcmp(candidate.names + candidateEntry.nameOffset, path.data(), path.size()) == 0)
+            {
+                *pak = &candidate;
+                *entry = &candidateEntry;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+static bool MapPakFile(const char* filepath, MappedFile* mappedFile)
+{
+    const Pak* pak;
+    const PakEntry* entry;
+    if (!FindPakEntry(filepath, &pak, &entry) || entry->rawSize == 0)
+        return false;
+
+    const u8* payload = (const u8*)pak->file.data + entry->offset;
+    if (!(entry->flags & PAK_ENTRY_LZ4))
+    {
+        mappedFile->data = (void*)payload;
+        mappedFile->size = entry->rawSize;
+        mappedFile->isPakView = true;
+        return true;
+    }
+
+    u8* data = (u8*)malloc(entry->rawSize + LZ4_DECODE_SLACK);
+    if (!data || !LZ4Decompress(payload, (u32)entry->storedSize, data, (u32)entry->rawSize))
+    {
+        ELOG("MapFile() - Corrupted pak entry %s", filepath);
+        free(data);
+        return false;
+    }
+
+    mappedFile->data = data;
+    mappedFile->size = entry->rawSize;
+    mappedFile->isHeapCopy = true;
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Paths and hashing
+
+std::string NormalizeAssetPath(const char* path)
+{
+    std::string normalized;
+    if (*path == '/' || *path == '\\')
+        normalized = "/";
+
+    while (*path)
+    {
+        const char* segment = path;
+        while (*path && *path != '/' && *path != '\\') path++;
+        const size_t length = path - segment;
+        if (*path) path++;
+
+        if (length == 0 || (length == 1 && segment[0] == '.'))
+            continue;
+
+        // ".." removes the previous segment, unless there is none or it is also ".."
+        const size_t lastSeparator = normalized.find_last_of('/');
+        const size_t lastStart = lastSeparator == std::string::npos ? 0 : lastSeparator + 1;
+        if (length == 2 && segment[0] == '.' && segment[1] == '.' &&
+            lastStart < normalized.size() && normalized.compare(lastStart, std::string::npos, "..") != 0)
+        {
+            normalized.resize(lastStart > 1 ? lastStart - 1 : lastStart);
+            continue;
+        }
+
+        if (!normalized.empty() && normalized.back() != '/')
+            normalized += '/';
+        for (size_t i = 0; i < length; ++i)
+            normalized += (char)tolower((unsigned char)segment[i]);
+    }
+
+    return normalized;
+}
+
+// MurmurHash64A
+u64 HashBytes(const void* data, u64 size, u64 seed)
+{
+    const u64 m = 0xc6a4a7935bd1e995ull;
+    const int r = 47;
+
+    u64 h = seed ^ (size * m);
+
+    const u8* ptr = (const u8*)data;
+    const u8* end = ptr + (size & ~7ull);
+    while (ptr != end)
+    {
+        u64 k;
+        memcpy(&k, ptr, sizeof(k));
+        ptr += sizeof(k);
+
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+
+        h ^= k;
+        h *= m;
+    }
+
+    u64 tail = 0;
+    for (u32 i = 0; i < (size & 7); ++i)
+        tail |= (u64)ptr[i] << (8 * i);
+    if (size & 7)
+    {
+        h ^= tail;
+        h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+///////////////////////////////////////////////////////////////////////
+// LZ4
+
+#define LZ4_MIN_MATCH     4
+#define LZ4_LAST_LITERALS 5   // The last 5 bytes of a block are always literals
+#define LZ4_MF_LIMIT      12  // The last match must start at least 12 bytes before the end
+#define LZ4_MAX_OFFSET    65535
+#define LZ4_HASH_BITS     14
+
+static inline u32 Read32(const u8* ptr)
+{
+    u32 value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+static inline u32 LZ4Hash(u32 sequence)
+{
+    return (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+static inline u8* LZ4WriteLength(u8* op, u32 length)
+{
+    while (length >= 255)
+    {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (u8)length;
+    return op;
+}
+
+// Copies in 16 byte chunks, so it can write up to 15 bytes past dst + size
+static inline void WildCopy16(u8* dst, const u8* src, u32 size)
+{
+    u8* end = dst + size;
+    do
+    {
+#ifdef PLATFORM_SSE2
+        _mm_storeu_si128((__m128i*)dst, _mm_loadu_si128((const __m128i*)src));
+#else
+        memcpy(dst, src, 16);
+#endif
+        dst += 16;
+        src += 16;
+    } while (dst < end);
+}
+
+u32 LZ4CompressBound(u32 srcSize)
+{
+    return srcSize + srcSize / 255 + 16;
+}
+
+u32 LZ4Compress(const u8* src, u32 srcSize, u8* dst, u32 dstCapacity)
+{
+    const u8* ip = src;
+    const u8* anchor = src;
+    const u8* iend = src + srcSize;
+    const u8* matchLimit = iend - LZ4_LAST_LITERALS;
+    const u8* mfLimit = iend - LZ4_MF_LIMIT;
+
+    u8* op = dst;
+    u8* oend = dst + dstCapacity;
+
+    if (srcSize > LZ4_MF_LIMIT)
+    {
+        u32* hashTable = (u32*)calloc(1 << LZ4_HASH_BITS, sizeof(u32));
+
+        while (ip < mfLimit)
+        {
+            const u32 sequence = Read32(ip);
+            const u32 hash = LZ4Hash(sequence);
+            const u8* ref = src + hashTable[hash];
+            hashTable[hash] = (u32)(ip - src);
+
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || Read32(ref) != sequence)
+            {
+                ip++;
+                continue;
+            }
+
+            const u8* matchStart = ip;
+            ip += LZ4_MIN_MATCH;
+            ref += LZ4_MIN_MATCH;
+            while (ip < matchLimit && *ip == *ref)
+            {
+                ip++;
+                ref++;
+            }
+
+            const u32 literalLength = (u32)(matchStart - anchor);
+            const u32 matchLength = (u32)(ip - matchStart) - LZ4_MIN_MATCH;
+            const u16 offset = (u16)(ip - ref);
+
+            if (op + 1 + literalLength + literalLength / 255 + 2 + matchLength / 255 + 2 > oend)
+            {
+                free(hashTable);
+                return 0;
+            }
+
+            u8* token = op++;
+            *token = (u8)((literalLength >= 15 ? 15 : literalLength) << 4);
+            if (literalLength >= 15) op = LZ4WriteLength(op, literalLength - 15);
+            memcpy(op, anchor, literalLength);
+            op += literalLength;
+
+            *op++ = (u8)(offset & 0xff);
+            *op++ = (u8)(offset >> 8);
+
+            *token |= (u8)(matchLength >= 15 ? 15 : matchLength);
+            if (matchLength >= 15) op = LZ4WriteLength(op, matchLength - 15);
+
+            anchor = ip;
+        }
+
+        free(hashTable);
+    }
+
+    // Last sequence: only literals
+    const u32 literalLength = (u32)(iend - anchor);
+    if (op + 1 + literalLength + literalLength / 255 + 1 > oend)
+        return 0;
+
+    u8* token = op++;
+    *token = (u8)((literalLength >= 15 ? 15 : literalLength) << 4);
+    if (literalLength >= 15) op = LZ4WriteLength(op, literalLength - 15);
+    memcpy(op, anchor, literalLength);
+    op += literalLength;
+
+    return (u32)(op - dst);
+}
+
+bool LZ4Decompress(const u8* src, u32 srcSize, u8* dst, u32 dstSize)
+{
+    const u8* ip = src;
+    const u8* iend = src + srcSize;
+    u8* op = dst;
+    u8* oend = dst + dstSize;
+
+    while (ip < iend)
+    {
+        const u8 token = *ip++;
+
+        // Literals
+        u32 literalLength = token >> 4;
+        if (literalLength == 15)
+        {
+            u8 s;
+            do
+            {
+                if (ip >= iend) return false;
+                s = *ip++;
+                literalLength += s;
+            } while (s == 255);
+        }
+
+        if (literalLength > (u32)(oend - op) || literalLength > (u32)(iend - ip))
+            return false;
+
+        if (literalLength + 16 <= (u32)(iend - ip))
+            WildCopy16(op, ip, literalLength);
+        else
+            memcpy(op, ip, literalLength);
+        op += literalLength;
+        ip += literalLength;
+
+        if (ip == iend)
+            break; // The last sequence has no match
+
+        // Match
+        if (iend - ip < 2) return false;
+        const u32 offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (u32)(op - dst))
+            return false;
+
+        u32 matchLength = token & 15;
+        if (matchLength == 15)
+        {
+            u8 s;
+            do
+            {
+                if (ip >= iend) return false;
+                s = *ip++;
+                matchLength += s;
+            } while (s == 255);
+        }
+        matchLength += LZ4_MIN_MATCH;
+
+        if (matchLength > (u32)(oend - op))
+            return false;
+
+        const u8* match = op - offset;
+        if (offset >= 16)
+        {
+            WildCopy16(op, match, matchLength);
+        }
+        else
+        {
+            // Overlapping copy, the pattern repeats every offset bytes
+            for (u32 i = 0; i < matchLength; ++i)
+                op[i] = match[i];
+        }
+        op += matchLength;
+    }
+
+    return op == oend;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Worker threads
+
+struct JobPool
+{
+    std::vector<std::thread> workers;
+    std::mutex               mutex;
+    std::condition_variable  wakeCondition;
+    std::condition_variable  doneCondition;
+    u64                      generation = 0;
+    u32                      activeWorkers = 0; // Workers inside RunJobBatches, guarded by mutex
+    bool                     quit = false;
+
+    // Current ParallelFor
+    JobFunction      function = NULL;
+    void*            userData = NULL;
+    u32              count = 0;
+    u32              batchSize = 1;
+    u32              batchCount = 0;
+    std::atomic<u32> nextBatch{ 0 };
+    std::atomic<u32> pendingBatches{ 0 };
+
+    ~JobPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wakeCondition.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+};
+
+static JobPool GlobalJobPool;
+
+static void RunJobBatches(JobPool& pool)
+{
+    for (;;)
+    {
+        const u32 batch = pool.nextBatch.fetch_add(1);
+        if (batch >= pool.batchCount)
+            break;
+
+        const u32 begin = batch * pool.batchSize;
+        const u32 end = glm::min(begin + pool.batchSize, pool.count);
+        pool.function(pool.userData, begin, end);
+
+        if (pool.pendingBatches.fetch_sub(1) == 1)
+        {
+            std::lock_guard<std::mutex> lock(pool.mutex);
+            pool.doneCondition.notify_all();
+        }
+    }
+}
+
+static void JobWorkerMain(JobPool* pool)
+{
+    u64 seenGeneration = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(pool->mutex);
+            pool->wakeCondition.wait(lock, [&] { return pool->quit || pool->generation != seenGeneration; });
+            if (pool->quit)
+                return;
+            seenGeneration = pool->generation;
+            pool->activeWorkers++;
+        }
+
+        RunJobBatches(*pool);
+
+        {
+            std::lock_guard<std::mutex> lock(pool->mutex);
+            pool->activeWorkers--;
+        }
+        pool->doneCondition.notify_all();
+    }
+}
+
+u32 GetJobThreadCount()
+{
+    const u32 hardwareThreads = std::thread::hardware_concurrency();
+    return hardwareThreads > 1 ? hardwareThreads : 1;
+}
+
+void ParallelFor(u32 count, u32 batchSize, JobFunction function, void* userData)
+{
+    if (count == 0)
+        return;
+
+    JobPool& pool = GlobalJobPool;
+    if (batchSize == 0)
+        batchSize = 1;
+
+    const u32 batchCount = (count + batchSize - 1) / batchSize;
+    if (batchCount == 1)
+    {
+        function(userData, 0, count);
+        return;
+    }
+
+    if (pool.workers.empty())
+    {
+        for (u32 i = 1; i < GetJobThreadCount(); ++i)
+            pool.workers.push_back(std::thread(JobWorkerMain, &pool));
+    }
+
+    {
+        // Workers that woke up late for the previous call could otherwise claim batches of this one
+        std::unique_lock<std::mutex> lock(pool.mutex);
+        pool.doneCondition.wait(lock, [&] { return pool.activeWorkers == 0; });
+
+        pool.function = function;
+        pool.userData = userData;
+        pool.count = count;
+        pool.batchSize = batchSize;
+        pool.batchCount = batchCount;
+        pool.pendingBatches = batchCount;
+        pool.nextBatch = 0;
+        pool.generation++;
+    }
+    pool.wakeCondition.notify_all();
+
+    RunJobBatches(pool);
+
+    std::unique_lock<std::mutex> lock(pool.mutex);
+    pool.doneCondition.wait(lock, [&] { return pool.pendingBatches == 0; });
+}
@@ -0,0 +1,65 @@
+//
+// render_queue.cpp : Sort keys and the radix sort of the render queue.
+//
+
+#include "render_queue.h"
+#include <string.h>
+
+static u64 PackKeyField(u64 key, u32 value, u32 bits)
+{
+    return (key << bits) | (value & ((1u << bits) - 1));
+}
+
+u64 MakeDrawKey(RenderPass pass, u32 programIdx, u32 vertexFormatIdx, u32 materialIdx, f32 depth)
+{
+    const u32 maxDepth = (1u << RENDER_KEY_DEPTH_BITS) - 1;
+    const f32 clampedDepth = depth < 0.0f ? 0.0f : (depth > 1.0f ? 1.0f : depth);
+
+    u64 key = 0;
+    key = PackKeyField(key, (u32)pass, RENDER_KEY_PASS_BITS);
+    key = PackKeyField(key, programIdx, RENDER_KEY_PROGRAM_BITS);
+    key = PackKeyField(key, vertexFormatIdx, RENDER_KEY_VERTEX_FORMAT_BITS);
+    key = PackKeyField(key, materialIdx, RENDER_KEY_MATERIAL_BITS);
+    key = PackKeyField(key, (u32)(clampedDepth * maxDepth), RENDER_KEY_DEPTH_BITS);
+    return key;
+}
+
+void SortRenderQueue(RenderQueue& queue)
+{
+    std::vector<DrawItem>& items = queue.items;
+    std::vector<DrawItem>& scratch = queue.sortScratch;
+    scratch.resize(items.size());
+
+    DrawItem* src = items.data();
+    DrawItem* dst = scratch.data();
+    const u32 count = (u32)items.size();
+
+    for (u32 shift = 0; shift < 64; shift += 8)
+    {
+        u32 offsets[256] = {};
+        for (u32 i = 0; i < count; ++i)
+            offsets[(src[i].key >> shift) & 0xFF]++;
+
+        // Every key has the same byte, the order would not change
+        if (count == 0 || offsets[(src[0].key >> shift) & 0xFF] == count)
+            continue;
+
+        u32 offset = 0;
+        for (u32 bucket = 0; bucket < 256; ++bucket)
+        {
+            const u32 bucketSize = offsets[bucket];
+            offsets[bucket] = offset;
+            offset += bucketSize;
+        }
+
+        for (u32 i = 0; i < count; ++i)
+            dst[offsets[(src[i].key >> shift) & 0xFF]++] = src[i];
+
+        DrawItem* swap = src;
+        src = dst;
+        dst = swap;
+    }
+
+    if (src != items.data())
+        memcpy(items.data(), src, count * sizeof(DrawItem));
+}
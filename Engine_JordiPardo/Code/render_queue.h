@@ -0,0 +1,51 @@
+//
+// render_queue.h: Draw items with a sort key each, sorted every frame so that the draws that
+// share state are submitted together.
+//
+
+#pragma once
+
+#include "platform.h"
+
+// Key fields, from the most significant bits. Indices that do not fit their field are wrapped,
+// which only makes the order worse: the submission still compares the actual state.
+#define RENDER_KEY_PASS_BITS          4
+#define RENDER_KEY_PROGRAM_BITS       12
+#define RENDER_KEY_VERTEX_FORMAT_BITS 8
+#define RENDER_KEY_MATERIAL_BITS      16
+#define RENDER_KEY_DEPTH_BITS         24
+
+enum RenderPass
+{
+    RENDER_PASS_OPAQUE, // Front to back within the same state, for early depth rejection
+    RENDER_PASS_COUNT
+};
+
+struct DrawItem
+{
+    u64 key;
+
+    // What the item draws, the queue does not look at it
+    u32 programIdx;
+    u32 groupIdx;
+    u32 submeshIdx;
+};
+
+struct RenderQueue
+{
+    std::vector<DrawItem> items;
+    std::vector<DrawItem> sortScratch; // Keeps its capacity between frames
+    u32                   drawCallCount; // Issued by the last submission
+};
+
+/**
+ * Packs the state of a draw into its sort key. The depth goes from 0 (nearest) to 1, and is
+ * clamped to that range.
+ */
+u64 MakeDrawKey(RenderPass pass, u32 programIdx, u32 vertexFormatIdx, u32 materialIdx, f32 depth);
+
+/**
+ * Sorts the items by key with a stable LSD radix sort, one byte per pass. Passes where every
+ * key has the same byte are skipped.
+ */
+void SortRenderQueue(RenderQueue& queue);
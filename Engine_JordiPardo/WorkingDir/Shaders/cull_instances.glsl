@@ -0,0 +1,127 @@
+// Frustum culling of the instances of the draws of a frame (see FRUSTUM CULLING in engine.h),
+// and occlusion culling against the Hi-Z pyramid of the previous frame if it is enabled (see
+// HI-Z OCCLUSION CULLING). Each invocation tests one instance of one draw, x is the instance and
+// y the draw. The visible ones are counted into the instanceCount of the draw's command, which
+// starts at 0, and their world matrices are copied to where the draw reads them.
+#ifdef CULL_INSTANCES
+
+#if defined(COMPUTE) ///////////////////////////////////////////////
+
+layout(local_size_x = 64) in; // CULL_GROUP_SIZE
+
+#include "uniform_blocks.glsl"
+
+struct CullDraw
+{
+    vec3 boundsMin;
+    uint firstWorldMatrix;
+    vec3 boundsMax;
+    uint instanceCount;
+    uint firstVisibleMatrix;
+};
+
+struct DrawCommand
+{
+    uint count;
+    uint instanceCount;
+    uint firstIndex;
+    int  baseVertex;
+    uint baseInstance;
+};
+
+layout(binding = 2, std430) readonly buffer CullDraws
+{
+    CullDraw uCullDraws[];
+};
+
+layout(binding = 3, std430) buffer DrawCommands
+{
+    DrawCommand uDrawCommands[];
+};
+
+layout(binding = 4, std430) writeonly buffer VisibleWorldMatrices
+{
+    mat4 uVisibleWorldMatrices[];
+};
+
+// Same test as IsBoxInFrustum in engine.cpp
+bool IsBoxInFrustum(mat4 worldMatrix, vec3 boundsMin, vec3 boundsMax)
+{
+    vec3 center = vec3(worldMatrix * vec4((boundsMin + boundsMax) * 0.5, 1.0));
+    mat3 absMatrix = mat3(abs(worldMatrix[0].xyz), abs(worldMatrix[1].xyz), abs(worldMatrix[2].xyz));
+    vec3 extents = absMatrix * ((boundsMax - boundsMin) * 0.5);
+
+    for (int i = 0; i < 6; ++i)
+    {
+        vec3 normal = uFrustumPlanes[i].xyz;
+        if (dot(normal, center) + uFrustumPlanes[i].w + dot(abs(normal), extents) < 0.0)
+            return false;
+    }
+    return true;
+}
+
+layout(binding = 4) uniform sampler2D uHiZ; // HIZ_TEXTURE_UNIT
+
+// True if the box is behind the farthest depth of the pyramid texels it covers. Boxes that
+// cross the near plane or the borders of the screen of that frame are never occluded.
+bool IsBoxOccluded(mat4 worldMatrix, vec3 boundsMin, vec3 boundsMax)
+{
+    if (uHiZEnabled == 0u)
+        return false;
+
+    mat4 toClip = uHiZViewProjection * worldMatrix;
+    vec3 ndcMin = vec3(1e30);
+    vec3 ndcMax = vec3(-1e30);
+    for (int i = 0; i < 8; ++i)
+    {
+        vec3 corner = vec3((i & 1) != 0 ? boundsMax.x : boundsMin.x,
+                           (i & 2) != 0 ? boundsMax.y : boundsMin.y,
+                           (i & 4) != 0 ? boundsMax.z : boundsMin.z);
+        vec4 clip = toClip * vec4(corner, 1.0);
+        if (clip.w <= 0.0)
+            return false;
+        vec3 ndc = clip.xyz / clip.w;
+        ndcMin = min(ndcMin, ndc);
+        ndcMax = max(ndcMax, ndc);
+    }
+    if (any(lessThan(ndcMin.xy, vec2(-1.0))) || any(greaterThan(ndcMax.xy, vec2(1.0))))
+        return false;
+
+    // Pixels of the depth attachment, level L texels cover 2^(L + 1) of them on each side
+    vec2 screenSize = vec2(uHiZWidth, uHiZHeight);
+    ivec2 pixelMin = ivec2(min((ndcMin.xy * 0.5 + 0.5) * screenSize, screenSize - 1.0));
+    ivec2 pixelMax = ivec2(min((ndcMax.xy * 0.5 + 0.5) * screenSize, screenSize - 1.0));
+    ivec2 pixelExtent = pixelMax - pixelMin + 1;
+    int level = max(int(ceil(log2(float(max(pixelExtent.x, pixelExtent.y))))) - 1, 0);
+    level = min(level, int(uHiZLevelCount) - 1);
+
+    // The box covers at most 2x2 texels of that level
+    ivec2 lastTexel = textureSize(uHiZ, level) - 1;
+    ivec2 texelMin = min(pixelMin >> (level + 1), lastTexel);
+    ivec2 texelMax = min(pixelMax >> (level + 1), lastTexel);
+    float farthestDepth = max(max(texelFetch(uHiZ, texelMin, level).r, texelFetch(uHiZ, ivec2(texelMax.x, texelMin.y), level).r),
+                              max(texelFetch(uHiZ, ivec2(texelMin.x, texelMax.y), level).r, texelFetch(uHiZ, texelMax, level).r));
+
+    float nearestDepth = ndcMin.z * 0.5 + 0.5;
+    return nearestDepth > farthestDepth;
+}
+
+void main()
+{
+    uint drawIdx = gl_WorkGroupID.y;
+    uint instanceIdx = gl_GlobalInvocationID.x;
+    CullDraw draw = uCullDraws[drawIdx];
+    if (instanceIdx >= draw.instanceCount)
+        return;
+
+    mat4 worldMatrix = uWorldMatrices[draw.firstWorldMatrix + instanceIdx];
+    if (!IsBoxInFrustum(worldMatrix, draw.boundsMin, draw.boundsMax) ||
+        IsBoxOccluded(worldMatrix, draw.boundsMin, draw.boundsMax))
+        return;
+
+    uint slot = atomicAdd(uDrawCommands[drawIdx].instanceCount, 1);
+    uVisibleWorldMatrices[draw.firstVisibleMatrix + slot] = worldMatrix;
+}
+
+#endif
+#endif
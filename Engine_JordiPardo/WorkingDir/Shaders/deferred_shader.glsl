@@ -1,74 +1,31 @@
 #ifdef DEFERRED_SHADER
 
-#if defined(VERTEX) ///////////////////////////////////////////////////
+#if defined(FRAGMENT) ///////////////////////////////////////////////
 
-struct Light
-{
-    unsigned int type;
-    vec3 color;
-    vec3 direction;
-    vec3 position;
-};
-
-// TODO: Write your vertex shader here
-layout(location=0) in vec3 aPosition;
-layout(location=1) in vec3 aNormal;
-layout(location=2) in vec2 aTexCoord;
-
-out vec2 vTexCoord;
-out vec3 vPosition;
-out vec3 vNormal;  
-out vec3 vViewDir; 
-
-uniform mat4 uWorldMatrix;
-uniform mat4 uWorldViewProjectionMatrix;
-uniform vec3 uCameraPosition;
-uniform Light lights[5];
-out vec3 lightPos;
-
-void main()
-{
-	lightPos = lights[0].position;
-	vTexCoord = aTexCoord;
-	vPosition = vec3(uWorldMatrix * vec4(aPosition, 1.0));
-	mat4 model = mat4(1.0f);
-    //vNormal   = vec3(uWorldMatrix * vec4(aNormal, 0.0));
-    vNormal = mat3(transpose(inverse(model))) * aNormal;
-    vViewDir  = uCameraPosition - vPosition;
-	gl_Position = uWorldViewProjectionMatrix * vec4(aPosition, 1.0f);
-
-}
-
-#elif defined(FRAGMENT) ///////////////////////////////////////////////
-
-
-// TODO: Write your fragment shader here
-struct Light
-{
-    unsigned int type;
-    vec3 color;
-    vec3 direction;
-    vec3 position;
-};
 in vec2 vTexCoord;
 in vec3 vNormal;
 in vec3 vViewDir;
 in vec3 vPosition;
+#ifdef NORMAL_MAP
+in vec3 vTangent;
+in vec3 vBitangent;
+#endif
 
-uniform sampler2D uTexture;
-uniform float alpha;
-uniform Light lights[5];
-uniform unsigned int lightCount;
+#include "material.glsl"
 
 layout(location = 0) out vec4 oColor;
 layout(location = 1) out vec4 rt1; //Normals 
 layout(location = 2) out vec4 rt2; //Position 
 
-
 void main()
 {
-    oColor = texture(uTexture,vTexCoord);
-    rt1 = vec4(vNormal,1.0f);
+#ifdef NORMAL_MAP
+    vec3 normal = GetSurfaceNormal(vTexCoord, vNormal, vTangent, vBitangent);
+#else
+    vec3 normal = normalize(vNormal);
+#endif
+    oColor = GetAlbedo(vTexCoord);
+    rt1 = vec4(normal,1.0f);
     rt2 = vec4(vPosition,1.0f);
 }
 
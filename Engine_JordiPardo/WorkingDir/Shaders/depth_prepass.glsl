@@ -0,0 +1,35 @@
+// Depth only program of the depth pre-pass (see DEPTH PRE-PASS in engine.h). The position is
+// computed with the same expressions as in mesh_vertex.glsl, and both declare it invariant, so
+// the forward pass gets the exact same depths and can test them with GL_EQUAL.
+#ifdef DEPTH_PREPASS
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+// Separable programs have to redeclare the built-in outputs they write
+out gl_PerVertex
+{
+    vec4 gl_Position;
+};
+invariant gl_Position;
+
+layout(location=0) in vec3 aPosition;
+layout(location=5) in uvec2 aDrawParams; // First world matrix and LocalParams index of the draw, see DrawParams
+
+#include "uniform_blocks.glsl"
+
+void main()
+{
+    mat4 worldMatrix = uWorldMatrices[aDrawParams.x + gl_InstanceID];
+    vec3 position = vec3(worldMatrix * vec4(aPosition, 1.0));
+    gl_Position = uProjection * uView * vec4(position, 1.0f);
+}
+
+#elif defined(FRAGMENT) ///////////////////////////////////////////////
+
+// Nothing to write, the color writes are masked during the pre-pass
+void main()
+{
+}
+
+#endif
+#endif
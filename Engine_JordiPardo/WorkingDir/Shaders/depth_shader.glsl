@@ -1,19 +1,6 @@
 #ifdef DEPTH_SHADER
 
-#if defined(VERTEX) ///////////////////////////////////////////////////
-
-layout(location = 0) in vec3 aPosition;
-layout(location = 1) in vec2 aTexCoord;
-
-out vec2 vTexCoord;
-
-void main()
-{
-    vTexCoord = aTexCoord;
-    gl_Position = vec4(aPosition, 1.0);
-}
-
-#elif defined(FRAGMENT) ///////////////////////////////////////////////
+#if defined(FRAGMENT) ///////////////////////////////////////////////
 
 in vec2 vTexCoord;
 
@@ -0,0 +1,41 @@
+// Builds a level of the Hi-Z pyramid (see HI-Z OCCLUSION CULLING in engine.h). Each texel keeps
+// the farthest depth of the texels of the source it covers: 2x2 of them, plus the last row or
+// column of odd sized sources. The source is the depth attachment for level 0, and the previous
+// level for the others.
+#ifdef HIZ_DOWNSAMPLE
+
+#if defined(COMPUTE) ///////////////////////////////////////////////
+
+layout(local_size_x = 8, local_size_y = 8) in; // HIZ_GROUP_SIZE
+
+layout(binding = 4) uniform sampler2D uSource;                  // HIZ_TEXTURE_UNIT
+layout(binding = 0, r32f) uniform writeonly image2D uDestination; // HIZ_IMAGE_UNIT
+
+layout(location = 0) uniform int uSourceLevel;  // HIZ_UNIFORM_SOURCE_LEVEL
+layout(location = 1) uniform ivec2 uSourceSize; // HIZ_UNIFORM_SOURCE_SIZE
+
+void main()
+{
+    ivec2 destinationSize = imageSize(uDestination);
+    ivec2 coord = ivec2(gl_GlobalInvocationID.xy);
+    if (any(greaterThanEqual(coord, destinationSize)))
+        return;
+
+    ivec2 lastTexel = uSourceSize - 1;
+    ivec2 footprint = ivec2(1) + ivec2(equal(coord, destinationSize - 1)) * (uSourceSize & 1);
+
+    float farthestDepth = 0.0;
+    for (int y = 0; y <= footprint.y; ++y)
+    {
+        for (int x = 0; x <= footprint.x; ++x)
+        {
+            ivec2 sourceCoord = min(coord * 2 + ivec2(x, y), lastTexel);
+            farthestDepth = max(farthestDepth, texelFetch(uSource, sourceCoord, uSourceLevel).r);
+        }
+    }
+
+    imageStore(uDestination, coord, vec4(farthestDepth));
+}
+
+#endif
+#endif
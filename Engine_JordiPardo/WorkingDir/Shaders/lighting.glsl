@@ -0,0 +1,94 @@
+// Lights and the lighting model shared by the forward and deferred programs.
+// LIGHT_COUNT is part of the permutation key of the programs that include this file.
+
+#ifndef LIGHTING_GLSL
+#define LIGHTING_GLSL
+
+#ifndef LIGHT_COUNT
+#define LIGHT_COUNT 5
+#endif
+
+struct Light
+{
+    unsigned int type;
+    vec3 color;
+    vec3 direction;
+    vec3 position;
+};
+
+#if LIGHT_COUNT > 0
+uniform Light lights[LIGHT_COUNT];
+#endif
+
+vec3 CalculateDirectionalLight(Light light, vec3 position, vec3 normal, vec3 viewDir)
+{
+    vec3 lightDir = normalize(light.direction);
+
+    float ambientStrenght = 0.2;
+    vec3  ambient = ambientStrenght * light.color;
+
+    float diff = max(dot(normal, lightDir), 0.0f);
+    vec3 diffuse = diff * light.color;
+
+    float specularStrength = 0.1f;
+    vec3 reflectDir = reflect(-lightDir, normal);
+
+    viewDir = normalize(viewDir);
+    float spec = pow(max(dot(viewDir, reflectDir), 0.0f), 32);
+    vec3 specular = specularStrength * spec * light.color;
+
+    return ambient + diffuse + specular;
+}
+
+vec3 CalculatePointLight(Light light, vec3 position, vec3 normal, vec3 viewDir)
+{
+    vec3 lightDir = position - light.position;
+    lightDir = normalize(-lightDir);
+
+    float constant = 1.0f;
+    float linear = 0.09f;
+    float quadratic = 0.032f;
+
+    float distance = length(light.position - position);
+    float attenuation = 1.0f / (constant + linear * distance + quadratic * (distance * distance));
+
+    float ambientStrenght = 0.2;
+    vec3  ambient = ambientStrenght * light.color;
+
+    float diff = max(dot(normal, lightDir), 0.0f);
+    vec3 diffuse = diff * light.color;
+
+    float specularStrength = 0.1f;
+    vec3 reflectDir = reflect(-lightDir, normal);
+
+    float spec = pow(max(dot(viewDir, reflectDir), 0.0f), 2);
+    vec3 specular = specularStrength * spec * light.color;
+
+    ambient *= attenuation;
+    diffuse *= attenuation;
+    specular *= attenuation;
+
+    return ambient + diffuse + specular;
+}
+
+// Sum of all the lights at a point, to be multiplied by its albedo
+vec3 CalculateLighting(vec3 position, vec3 normal, vec3 viewDir)
+{
+    vec3 lightAmount = vec3(0.0f);
+#if LIGHT_COUNT > 0
+    for (uint i = 0; i < LIGHT_COUNT; ++i)
+    {
+        if (lights[i].type == 0)
+        {
+            lightAmount += CalculateDirectionalLight(lights[i], position, normal, viewDir);
+        }
+        else
+        {
+            lightAmount += CalculatePointLight(lights[i], position, normal, viewDir);
+        }
+    }
+#endif
+    return lightAmount;
+}
+
+#endif // LIGHTING_GLSL
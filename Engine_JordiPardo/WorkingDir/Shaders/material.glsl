@@ -0,0 +1,38 @@
+// Material inputs of the mesh programs. HAS_ALBEDO_TEX and NORMAL_MAP are part of their
+// permutation key, so materials without those textures do not pay for sampling them.
+
+#ifndef MATERIAL_GLSL
+#define MATERIAL_GLSL
+
+// The albedo and the texture layers come from the LocalParams of the draw
+#include "uniform_blocks.glsl"
+
+flat in uint vLocalParamsIdx;
+
+#ifdef HAS_ALBEDO_TEX
+uniform sampler2DArray uTexture;
+#endif
+
+#ifdef NORMAL_MAP
+uniform sampler2DArray uNormalTexture;
+#endif
+
+vec4 GetAlbedo(vec2 texCoord)
+{
+#ifdef HAS_ALBEDO_TEX
+    return texture(uTexture, vec3(texCoord, uLocalParams[vLocalParamsIdx].textureLayer));
+#else
+    return vec4(uLocalParams[vLocalParamsIdx].albedo, 1.0);
+#endif
+}
+
+#ifdef NORMAL_MAP
+vec3 GetSurfaceNormal(vec2 texCoord, vec3 normal, vec3 tangent, vec3 bitangent)
+{
+    mat3 tbn = mat3(normalize(tangent), normalize(bitangent), normalize(normal));
+    vec3 tangentNormal = texture(uNormalTexture, vec3(texCoord, uLocalParams[vLocalParamsIdx].normalTextureLayer)).xyz * 2.0 - 1.0;
+    return normalize(tbn * tangentNormal);
+}
+#endif
+
+#endif // MATERIAL_GLSL
@@ -0,0 +1,53 @@
+// Vertex stage shared by the forward and deferred mesh programs. Of the permutation
+// features, only NORMAL_MAP changes it, so it is built once per value of NORMAL_MAP.
+#ifdef MESH_VERTEX
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+// Separable programs have to redeclare the built-in outputs they write
+out gl_PerVertex
+{
+    vec4 gl_Position;
+};
+invariant gl_Position; // Matches the depth of Shaders/depth_prepass.glsl
+
+layout(location=0) in vec3 aPosition;
+layout(location=1) in vec3 aNormal;
+layout(location=2) in vec2 aTexCoord;
+#ifdef NORMAL_MAP
+layout(location=3) in vec3 aTangent;
+layout(location=4) in vec3 aBitangent;
+#endif
+layout(location=5) in uvec2 aDrawParams; // First world matrix and LocalParams index of the draw, see DrawParams
+
+out vec2 vTexCoord;
+out vec3 vPosition;
+out vec3 vNormal;  
+out vec3 vViewDir; 
+#ifdef NORMAL_MAP
+out vec3 vTangent;
+out vec3 vBitangent;
+#endif
+flat out uint vLocalParamsIdx;
+
+#include "uniform_blocks.glsl"
+
+void main()
+{
+    mat4 worldMatrix = uWorldMatrices[aDrawParams.x + gl_InstanceID];
+    vLocalParamsIdx = aDrawParams.y;
+	vTexCoord = aTexCoord;
+	vPosition = vec3(worldMatrix * vec4(aPosition, 1.0));
+	mat4 model = mat4(1.0f);
+    //vNormal   = vec3(worldMatrix * vec4(aNormal, 0.0));
+    vNormal = mat3(transpose(inverse(model))) * aNormal;
+#ifdef NORMAL_MAP
+    vTangent = mat3(model) * aTangent;
+    vBitangent = mat3(model) * aBitangent;
+#endif
+    vViewDir  = uCameraPosition - vPosition;
+	gl_Position = uProjection * uView * vec4(vPosition, 1.0f);
+}
+
+#endif
+#endif
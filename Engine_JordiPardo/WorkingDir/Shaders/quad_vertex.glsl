@@ -0,0 +1,24 @@
+// Vertex stage shared by the full screen programs (FORWARD_QUAD, DEFERRED_QUAD, DEPTH_SHADER)
+#ifdef QUAD_VERTEX
+
+#if defined(VERTEX) ///////////////////////////////////////////////////
+
+// Separable programs have to redeclare the built-in outputs they write
+out gl_PerVertex
+{
+    vec4 gl_Position;
+};
+
+layout(location = 0) in vec3 aPosition;
+layout(location = 1) in vec2 aTexCoord;
+
+out vec2 vTexCoord;
+
+void main()
+{
+    vTexCoord = aTexCoord;
+    gl_Position = vec4(aPosition, 1.0);
+}
+
+#endif
+#endif
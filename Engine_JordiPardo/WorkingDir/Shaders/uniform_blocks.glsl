@@ -0,0 +1,42 @@
+// Uniform and storage blocks filled by the uniform ring of the engine (see UNIFORM RING in
+// engine.h). Their layout has to match GlobalParams and LocalParams there.
+
+#ifndef UNIFORM_BLOCKS_GLSL
+#define UNIFORM_BLOCKS_GLSL
+
+// Written once per frame
+layout(binding = 0, std140) uniform GlobalParams
+{
+    mat4 uView;
+    mat4 uProjection;
+    vec3 uCameraPosition;
+    uint uLightCount;
+    vec4 uFrustumPlanes[6]; // World space, normals pointing inside
+    mat4 uHiZViewProjection; // Of the frame the Hi-Z pyramid was built from
+    uint uHiZWidth;          // Of the depth attachment the pyramid was built from
+    uint uHiZHeight;
+    uint uHiZLevelCount;
+    uint uHiZEnabled;
+};
+
+// Written once per frame for each submesh of each instance group, and indexed with the
+// localParamsIdx of the draw (see MULTI-DRAW INDIRECT in engine.h)
+struct LocalParams
+{
+    vec3 albedo;
+    uint textureLayer;
+    uint normalTextureLayer;
+};
+
+layout(binding = 0, std430) readonly buffer LocalParamsArray
+{
+    LocalParams uLocalParams[];
+};
+
+// Written once per frame for each entity, consecutive for the entities of an instance group
+layout(binding = 1, std430) readonly buffer WorldMatrices
+{
+    mat4 uWorldMatrices[];
+};
+
+#endif // UNIFORM_BLOCKS_GLSL